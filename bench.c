@@ -0,0 +1,304 @@
+/*  bench.c – cost of one log call across the configuration matrix
+ *
+ *  Built four times from the same sources:
+ *      tklog_bench           built-in formatter
+ *      tklog_bench_snprintf  TKLOG_NO_FAST_FORMAT (vsnprintf for everything)
+ *      tklog_bench_memory    TKLOG_MEMORY (allocation tracking on)
+ *      tklog_bench_sampled   TKLOG_MEMORY with TKLOG_MEMORY_SAMPLE_BYTES
+ *
+ *  Each binary runs every TKLOG_SHOW_* combination (passed as the runtime
+ *  flag word of _tklog), scope depths 0/4/16 when the path is shown, a null
+ *  sink and a file sink, at 1, 2, 4 … N threads, plus an allocation workload
+ *  that keeps a window of live blocks per thread.  For each run it reports
+ *  p50/p99/p999 ns per call and aggregate messages per second.  Results are
+ *  one JSON document on stdout.
+ *
+ *      tklog_bench [--threads N] [--iterations K] [--file PATH] > result.json
+ */
+#include "tklog.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !defined(TKLOG_SHOW_LOG_LEVEL) || !defined(TKLOG_SHOW_TIME) || \
+    !defined(TKLOG_SHOW_THREAD)    || !defined(TKLOG_SHOW_PATH)  || !defined(TKLOG_SCOPE)
+    #error "bench.c needs every TKLOG_SHOW_* flag and TKLOG_SCOPE so each combination can be selected at runtime"
+#endif
+
+/* ====================================================================== */
+/*                                 SINKS                                  */
+/* ====================================================================== */
+
+typedef enum { SINK_NULL, SINK_FILE } sink_t;
+
+static sink_t  g_sink = SINK_NULL;
+static FILE   *g_file = NULL;
+
+/* tklog serialises calls to TKLOG_OUTPUT_FN, so the FILE needs no extra lock. */
+bool tklog_bench_output(const char *msg, void *user)
+{
+    (void)user;
+    if (g_sink == SINK_FILE) {
+        fputs(msg, g_file);
+    }
+    return true;
+}
+
+static void sink_select(sink_t sink)
+{
+    if (g_file) {
+        fflush(g_file);
+        if (ftruncate(fileno(g_file), 0) != 0) {
+            perror("ftruncate");
+        }
+        rewind(g_file);
+    }
+    g_sink = sink;
+}
+
+/* ====================================================================== */
+/*                                 RUNS                                   */
+/* ====================================================================== */
+
+typedef enum { WORK_LOG, WORK_ALLOC } work_t;
+
+#define ALLOC_WINDOW 1024   /* live blocks per thread in the allocation workload */
+
+typedef struct {
+    work_t          work;
+    uint32_t        flags;
+    int             depth;
+    int             iterations;
+    uint32_t       *samples;        /* iterations ns values */
+    uint64_t        start_ns;
+    uint64_t        end_ns;
+    pthread_barrier_t *barrier;
+} Worker;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint32_t clamp_ns(uint64_t ns)
+{
+    return ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    const char *user = "alice";
+
+    for (int d = 0; d < w->depth; ++d) {
+        _tklog_scope_start(__LINE__, __FILE__);
+    }
+    void **window = NULL;
+    if (w->work == WORK_ALLOC) {
+        window = calloc(ALLOC_WINDOW, sizeof *window);
+    }
+
+    pthread_barrier_wait(w->barrier);
+    w->start_ns = now_ns();
+    if (w->work == WORK_LOG) {
+        for (int i = 0; i < w->iterations; ++i) {
+            uint64_t t0 = now_ns();
+            _tklog(w->flags, TKLOG_LEVEL_INFO, __LINE__, __FILE__,
+                   "request %d finished in %.2f ms for %s", i, (double)(i & 1023) * 0.25, user);
+            w->samples[i] = clamp_ns(now_ns() - t0);
+        }
+    } else {
+        for (int i = 0; i < w->iterations; ++i) {
+            void **slot = &window[i % ALLOC_WINDOW];
+            uint64_t t0 = now_ns();
+            if (*slot) {
+                free(*slot);    /* TKLOG_MEMORY treats free(NULL) as an error */
+            }
+            *slot = malloc(16 + (size_t)(i & 255));
+            w->samples[i] = clamp_ns(now_ns() - t0);
+        }
+    }
+    w->end_ns = now_ns();
+
+    if (window) {
+        for (int i = 0; i < ALLOC_WINDOW; ++i) {
+            if (window[i]) {
+                free(window[i]);
+            }
+        }
+        free(window);
+    }
+    for (int d = 0; d < w->depth; ++d) {
+        _tklog_scope_end();
+    }
+    return NULL;
+}
+
+typedef struct {
+    uint32_t p50, p99, p999;
+    double   msgs_per_sec;
+} Result;
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static Result run(work_t work, uint32_t flags, int depth, int threads, int iterations)
+{
+    size_t     total   = (size_t)threads * (size_t)iterations;
+    uint32_t  *samples = malloc(total * sizeof *samples);
+    Worker    *workers = calloc((size_t)threads, sizeof *workers);
+    pthread_t *tids    = calloc((size_t)threads, sizeof *tids);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, (unsigned)threads);
+
+    for (int t = 0; t < threads; ++t) {
+        workers[t] = (Worker){ work, flags, depth, iterations, samples + (size_t)t * (size_t)iterations, 0, 0, &barrier };
+        pthread_create(&tids[t], NULL, worker_main, &workers[t]);
+    }
+    uint64_t first = UINT64_MAX, last = 0;
+    for (int t = 0; t < threads; ++t) {
+        pthread_join(tids[t], NULL);
+        if (workers[t].start_ns < first) first = workers[t].start_ns;
+        if (workers[t].end_ns   > last)  last  = workers[t].end_ns;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    qsort(samples, total, sizeof *samples, cmp_u32);
+    Result r;
+    r.p50  = samples[total * 500 / 1000];
+    r.p99  = samples[total * 990 / 1000];
+    r.p999 = samples[total * 999 / 1000];
+    r.msgs_per_sec = last > first ? (double)total * 1e9 / (double)(last - first) : 0.0;
+
+    free(tids);
+    free(workers);
+    free(samples);
+    return r;
+}
+
+/* ====================================================================== */
+/*                                 REPORT                                 */
+/* ====================================================================== */
+
+static const struct { uint32_t bit; const char *name; } g_show[] = {
+    { TKLOG_INIT_F_LEVEL,  "level"  },
+    { TKLOG_INIT_F_TIME,   "time"   },
+    { TKLOG_INIT_F_THREAD, "thread" },
+    { TKLOG_INIT_F_PATH,   "path"   },
+};
+#define SHOW_COUNT (int)(sizeof g_show / sizeof g_show[0])
+
+static int g_results = 0;
+
+static void report(const char *workload, const char *sink, uint32_t flags, int depth, int threads, Result r)
+{
+    printf("%s\n    {\"workload\": \"%s\", \"sink\": \"%s\", \"flags\": [", g_results++ ? "," : "", workload, sink);
+    int n = 0;
+    for (int s = 0; s < SHOW_COUNT; ++s) {
+        if (flags & g_show[s].bit) {
+            printf("%s\"%s\"", n++ ? ", " : "", g_show[s].name);
+        }
+    }
+    printf("], \"scope_depth\": %d, \"threads\": %d, \"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u, \"msgs_per_sec\": %.0f}",
+           depth, threads, r.p50, r.p99, r.p999, r.msgs_per_sec);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    long        cpus       = sysconf(_SC_NPROCESSORS_ONLN);
+    int         max_thr    = cpus > 0 ? (int)cpus : 1;
+    int         iterations = 20000;
+    const char *path       = "tklog_bench.log";
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            max_thr = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--file") && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--threads N] [--iterations K] [--file PATH]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (max_thr < 1 || max_thr > 256 || iterations < 1000) {
+        fprintf(stderr, "%s: need 1 <= threads <= 256 and iterations >= 1000\n", argv[0]);
+        return 2;
+    }
+
+    g_file = fopen(path, "w");
+    if (!g_file) {
+        perror(path);
+        return 1;
+    }
+
+    int thread_counts[16], nthr = 0;
+    for (int t = 1; t < max_thr && nthr < 15; t *= 2) {
+        thread_counts[nthr++] = t;
+    }
+    thread_counts[nthr++] = max_thr;
+
+    _tklog(0, TKLOG_LEVEL_INFO, __LINE__, __FILE__, "warm up");
+
+    printf("{\n  \"tklog_bench\": 1,\n");
+#ifdef TKLOG_NO_FAST_FORMAT
+    printf("  \"formatter\": \"vsnprintf\",\n");
+#else
+    printf("  \"formatter\": \"fast\",\n");
+#endif
+#if defined(TKLOG_MEMORY) && defined(TKLOG_MEMORY_SAMPLE_BYTES)
+    printf("  \"memory\": true,\n  \"memory_sample_bytes\": %llu,\n", (unsigned long long)(TKLOG_MEMORY_SAMPLE_BYTES));
+#elif defined(TKLOG_MEMORY)
+    printf("  \"memory\": true,\n");
+#else
+    printf("  \"memory\": false,\n");
+#endif
+    printf("  \"cpus\": %ld,\n  \"iterations_per_thread\": %d,\n  \"results\": [", cpus, iterations);
+
+    static const struct { sink_t sink; const char *name; } sinks[] = {
+        { SINK_NULL, "null" }, { SINK_FILE, "file" } };
+    static const int depths[] = { 0, 4, 16 };
+
+    for (size_t k = 0; k < sizeof sinks / sizeof sinks[0]; ++k) {
+        sink_select(sinks[k].sink);
+        for (uint32_t combo = 0; combo < (1u << SHOW_COUNT); ++combo) {
+            uint32_t flags = 0;
+            for (int s = 0; s < SHOW_COUNT; ++s) {
+                if (combo & (1u << s)) {
+                    flags |= g_show[s].bit;
+                }
+            }
+            /* the scope stack only shows up in the line with the path flag */
+            int ndepth = (flags & TKLOG_INIT_F_PATH) ? (int)(sizeof depths / sizeof depths[0]) : 1;
+            for (int d = 0; d < ndepth; ++d) {
+                for (int t = 0; t < nthr; ++t) {
+                    Result r = run(WORK_LOG, flags, depths[d], thread_counts[t], iterations);
+                    report("log", sinks[k].name, flags, depths[d], thread_counts[t], r);
+                    sink_select(sinks[k].sink);
+                }
+            }
+        }
+    }
+    sink_select(SINK_NULL);
+    for (int t = 0; t < nthr; ++t) {
+        Result r = run(WORK_ALLOC, 0, 0, thread_counts[t], iterations);
+        report("alloc_free", "none", 0, 0, thread_counts[t], r);
+    }
+    printf("\n  ]\n}\n");
+
+    fclose(g_file);
+    g_file = NULL;
+    remove(path);
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*  stress.c – allocation tracking under contention
+ *
+ *  N threads (default 4) each keep a window of live blocks and churn it
+ *  with malloc, realloc and free, while one more thread keeps calling
+ *  tklog_memory_dump() so the dump runs against live shard traffic.  After
+ *  the churn every thread leaves a known number of blocks live, and the
+ *  final dump must list exactly those plus one block main allocated before
+ *  anything logged.  The wall time of the churn goes to
+ *  stderr; the exit status is non-zero when the dump disagrees.
+ *
+ *      tklog_stress [--threads N] [--iterations K]
+ *
+ *  Run it under TKLOG_THREAD_SANITIZER too: the dump and the tracked
+ *  allocations share the shard locks.
+ */
+#include "tklog.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(TKLOG_MEMORY) || !defined(TKLOG_MEMORY_PRINT_ON_EXIT)
+    #error "tklog_stress needs TKLOG_MEMORY and TKLOG_MEMORY_PRINT_ON_EXIT"
+#endif
+
+#define WINDOW  4096    /* live blocks per thread while churning */
+#define LEFT    16      /* blocks per thread still live for the final dump */
+
+/* ====================================================================== */
+/*                                  SINK                                  */
+/* ====================================================================== */
+
+static int g_counting = 0;      /* set around the final dump only */
+static int g_listed   = 0;      /* its "| at stress.c:" lines */
+
+/* tklog serialises calls to TKLOG_OUTPUT_FN, so the counters need no lock. */
+bool tklog_stress_output(const char *msg, void *user)
+{
+    (void)user;
+    if (g_counting && strstr(msg, " bytes | at stress.c:")) {
+        ++g_listed;
+    }
+    return true;
+}
+
+/* ====================================================================== */
+/*                                 THREADS                                */
+/* ====================================================================== */
+
+typedef struct {
+    int     iterations;
+    void  **left;               /* LEFT blocks handed back to main */
+} Churner;
+
+static int g_done = 0;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void *churn_main(void *arg)
+{
+    Churner *c = arg;
+    void **window = calloc(WINDOW, sizeof *window);
+    uint32_t rng = (uint32_t)(uintptr_t)c | 1u;
+
+    for (int i = 0; i < c->iterations; ++i) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        void **slot = &window[rng % WINDOW];
+        size_t size = 16 + (rng >> 24);
+        if (!*slot) {
+            *slot = malloc(size);
+        } else if (rng & 0x100) {
+            *slot = realloc(*slot, size);
+        } else {
+            free(*slot);    /* TKLOG_MEMORY treats free(NULL) as an error */
+            *slot = NULL;
+        }
+    }
+
+    int kept = 0;
+    for (int i = 0; i < WINDOW; ++i) {
+        if (!window[i]) {
+            continue;
+        }
+        if (kept < LEFT) {
+            c->left[kept++] = window[i];
+        } else {
+            free(window[i]);
+        }
+    }
+    for (; kept < LEFT; ++kept) {
+        c->left[kept] = malloc(32);
+    }
+    free(window);
+    return NULL;
+}
+
+static void *dump_main(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&g_done, __ATOMIC_ACQUIRE)) {
+        tklog_memory_dump();
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int threads    = 4;
+    int iterations = 200000;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--threads N] [--iterations K]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (threads < 1 || threads > 256 || iterations < 1) {
+        fprintf(stderr, "%s: need 1 <= threads <= 256 and iterations >= 1\n", argv[0]);
+        return 2;
+    }
+
+    /* static, so the only tracked blocks in the final dump are the churners' */
+    static Churner   churners[256];
+    static void     *left[256 * LEFT];
+    static pthread_t tids[256];
+    pthread_t        dumper;
+
+    /* tracked before anything has logged, so before tklog initialises */
+    void *early = malloc(24);
+
+    uint64_t t0 = now_ns();
+    pthread_create(&dumper, NULL, dump_main, NULL);
+    for (int t = 0; t < threads; ++t) {
+        churners[t].iterations = iterations;
+        churners[t].left       = &left[t * LEFT];
+        pthread_create(&tids[t], NULL, churn_main, &churners[t]);
+    }
+    for (int t = 0; t < threads; ++t) {
+        pthread_join(tids[t], NULL);
+    }
+    uint64_t t1 = now_ns();
+    __atomic_store_n(&g_done, 1, __ATOMIC_RELEASE);
+    pthread_join(dumper, NULL);
+
+    g_counting = 1;
+    tklog_memory_dump();
+    g_counting = 0;
+
+    int expected = threads * LEFT + 1;
+    fprintf(stderr, "tklog_stress: %d threads x %d malloc/realloc/free in %.2f s, final dump listed %d of %d blocks\n",
+            threads, iterations, (double)(t1 - t0) / 1e9, g_listed, expected);
+
+    for (int i = 0; i < threads * LEFT; ++i) {
+        free(left[i]);
+    }
+    free(early);
+    return g_listed == expected ? 0 : 1;
+}
@@ -30,6 +30,7 @@ int main(int argc, char **argv) {
     tklog_notice("Notice: Everything nominal");
     tklog_warning("Warning: This is a warning");
     tklog_error("Error: Simulated error");
+    tklog_info_kv("Structured fields", "argc", TKLOG_I64(argc), "name", TKLOG_STR(argv[0]), "ok", TKLOG_BOOL(true));
     // tklog_critical("Critical: Would exit if TKLOG_EXIT_ON_CRITICAL defined");
     // tklog_alert("Alert: High priority");
     // tklog_emergency("Emergency: Catastrophic failure");
@@ -84,10 +85,14 @@ int main(int argc, char **argv) {
 
     // Manual memory dump (if enabled)
     tklog_memory_dump();
+    tklog_memory_report(TKLOG_MEMORY_BY_BYTES);
 
     // Print timer aggregates
     tklog_timer_print();
 
+    // Write timer spans and scopes as a Chrome trace (if enabled)
+    tklog_trace_write("tklog_trace.json");
+
     // Clear timer data
     tklog_timer_clear();
 
@@ -9,10 +9,19 @@
  *  - Uses platform-specific high-resolution timing:
  *    - Windows: QueryPerformanceCounter (with GetTickCount64 fallback)
  *    - POSIX: clock_gettime(CLOCK_MONOTONIC) (with gettimeofday fallback)
+ *    - optional: calibrated rdtsc (TKLOG_CLOCK_TSC) or CLOCK_MONOTONIC_COARSE
  *  - Uses standard C memory functions (malloc, free, etc.)
  */
 
+#ifdef TKLOG_PRELOAD
+#define _GNU_SOURCE     /* dladdr */
+#endif
 #include <stdlib.h>
+#if defined(__linux__)
+#include <malloc.h>             /* malloc_usable_size; before tklog.h redefines malloc */
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>      /* malloc_size */
+#endif
 #include "tklog.h"
 #include <stdio.h>
 #include <string.h>
@@ -22,39 +31,635 @@
 #include <time.h>
 #include <sys/time.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <strings.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+#ifdef TKLOG_PRELOAD
+#include <dlfcn.h>
+#endif
+
+#if defined(TKLOG_CLOCK_TSC) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <x86intrin.h>
+#include <cpuid.h>
+#define TKLOG_HAVE_TSC 1
 #endif
 
 /* -------------------------------------------------------------------------
  *  Internal helpers / globals
  * ------------------------------------------------------------------------- */
-static pthread_mutex_t g_tklog_mutex = PTHREAD_MUTEX_INITIALIZER;   /* serialises _tklog() and memory db */
-static pthread_rwlock_t g_mem_rwlock = PTHREAD_RWLOCK_INITIALIZER;  /* guards the allocation map       */
+static pthread_mutex_t g_tklog_mutex = PTHREAD_MUTEX_INITIALIZER;   /* serialises _tklog()              */
 static uint64_t         g_start_ms   = 0;                           /* program start in ms             */
+static uint64_t         g_start_ns   = 0;                           /* program start in ns             */
+static int64_t          g_wall_offset_ns = 0;                       /* CLOCK_REALTIME - get_time_ns()  */
 
-/* Store original memory functions to avoid recursion */
+#define TKLOG_MSG_MAX 2048                                           /* one formatted log line          */
+
+/* Store original memory functions to avoid recursion.  Bare names are not  */
+/* expanded by tklog.h's function-like macros, so these are libc's; being   */
+/* static initialisers, they are set before any thread's first malloc.      */
 #ifdef TKLOG_MEMORY
-static void *(*original_malloc)(size_t) = NULL;
-static void *(*original_calloc)(size_t, size_t) = NULL;
-static void *(*original_realloc)(void *, size_t) = NULL;
-static char *(*original_strdup)(const char *) = NULL;
-static void (*original_free)(void *) = NULL;
+static void *(*original_malloc)(size_t) = malloc;
+static void *(*original_calloc)(size_t, size_t) = calloc;
+static void *(*original_realloc)(void *, size_t) = realloc;
+static void (*original_free)(void *) = free;
 #endif
 
 /* Forward declarations */
 static void tklog_init_once_impl(void);
 static void tklog_init_once(void);
+static void tklog_emit(tklog_level_t level, const char *msg, size_t len);
+static void tklog_vlog(uint32_t flags, tklog_level_t level, int line, const char *file, uint64_t suppressed, const char *fields, const char *fmt, va_list ap);
+
+/* crash dump on SIGSEGV & co. whenever there is tracked state to show */
+#if (defined(TKLOG_MEMORY) || defined(TKLOG_TIMER)) && !defined(_WIN32)
+    #define TKLOG_CRASH_HANDLER
+    static void crash_thread_init(void);
+#endif
+
+/* ==============================  FORMAT  ================================ */
+/*  Log headers and the common printf conversions are rendered here instead
+ *  of by snprintf: two decimal digits per table lookup, literal runs found
+ *  with strchr/strlen and copied with memcpy (all vectorised in libc).  A
+ *  conversion fmt_fast does not handle makes fmt_message fall back to
+ *  vsnprintf for the whole message; TKLOG_NO_FAST_FORMAT always does.
+ *  The output is byte-identical to glibc's vsnprintf.                   */
+static const char g_digits2[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Writes v in decimal to p (room for 20 bytes); returns the digit count. */
+static size_t fmt_u64(char *p, uint64_t v)
+{
+    char  tmp[20];
+    char *q = tmp + sizeof tmp;
+    while (v >= 100) {
+        q -= 2;
+        memcpy(q, g_digits2 + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        q -= 2;
+        memcpy(q, g_digits2 + v * 2, 2);
+    } else {
+        *--q = (char)('0' + v);
+    }
+    size_t n = (size_t)(tmp + sizeof tmp - q);
+    memcpy(p, q, n);
+    return n;
+}
+
+static size_t fmt_i64(char *p, int64_t v)
+{
+    if (v < 0) {
+        *p = '-';
+        return 1 + fmt_u64(p + 1, 0 - (uint64_t)v);
+    }
+    return fmt_u64(p, (uint64_t)v);
+}
+
+/* for fmt_fast and the crash dump */
+#if !defined(TKLOG_NO_FAST_FORMAT) || defined(TKLOG_CRASH_HANDLER)
+static size_t fmt_hex(char *p, uint64_t v, bool upper)
+{
+    const char *hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char  tmp[16];
+    char *q = tmp + sizeof tmp;
+    do {
+        *--q = hex[v & 15];
+        v >>= 4;
+    } while (v);
+    size_t n = (size_t)(tmp + sizeof tmp - q);
+    memcpy(p, q, n);
+    return n;
+}
+#endif
+
+/* Bit test, so it also holds under -ffast-math (-Ofast release builds). */
+static inline bool fmt_finite(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof bits);
+    return ((bits >> 52) & 0x7FF) != 0x7FF;
+}
+
+/* Copies up to n bytes while leaving room for the NUL; false once full. */
+static inline bool fmt_put(char *out, size_t *o, size_t cap, const char *s, size_t n)
+{
+    size_t room = cap - 1 - *o;
+    if (n > room) {
+        memcpy(out + *o, s, room);
+        *o += room;
+        return false;
+    }
+    memcpy(out + *o, s, n);
+    *o += n;
+    return true;
+}
+
+#ifndef TKLOG_NO_FAST_FORMAT
+    /* %.Nf for N <= 9 when the value is not within rounding error of a tie
+     * (glibc rounds the exact binary value); otherwise returns 0.        */
+    static size_t fmt_fixed(char *p, double x, int prec)
+    {
+        static const double   pow10f[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+        static const uint64_t pow10u[] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+                                           1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL };
+        if (prec > 9 || !fmt_finite(x)) {
+            return 0;
+        }
+        uint64_t bits;
+        memcpy(&bits, &x, sizeof bits);
+        bool   neg = bits >> 63;
+        double y   = (neg ? -x : x) * pow10f[prec];
+        if (y >= 4503599627370496.0) {  /* 2^52 */
+            return 0;
+        }
+        uint64_t ip   = (uint64_t)y;
+        double   frac = y - (double)ip;             /* exact */
+        double   dist = frac > 0.5 ? frac - 0.5 : 0.5 - frac;
+        if (dist <= y * 2.3e-16 + 1e-300) {         /* product error is <= y * 2^-53 */
+            return 0;
+        }
+        uint64_t r = ip + (frac > 0.5);
+        size_t   n = 0;
+        if (neg) p[n++] = '-';
+        n += fmt_u64(p + n, r / pow10u[prec]);
+        if (prec > 0) {
+            char     digits[20];
+            uint64_t f = r % pow10u[prec];
+            size_t   k = fmt_u64(digits, f);
+            p[n++] = '.';
+            memset(p + n, '0', (size_t)prec - k);
+            memcpy(p + n + prec - k, digits, k);
+            n += (size_t)prec;
+        }
+        return n;
+    }
+
+    /* Formats %d %i %u %x %X (with l, ll, z), %c, %s and %.Ns, %p, %f and
+     * %.Nf and %%.  Returns the length (output NUL-terminated and truncated
+     * like vsnprintf) or -1 when fmt needs something else. */
+    static int fmt_fast(char *out, size_t cap, const char *fmt, va_list ap)
+    {
+        size_t o = 0;
+        char   num[48];
+        if (cap == 0) {
+            return -1;
+        }
+        for (;;) {
+            const char *pct = strchr(fmt, '%');
+            if (!pct) pct = fmt + strlen(fmt);
+            if (!fmt_put(out, &o, cap, fmt, (size_t)(pct - fmt)) || !*pct) {
+                break;
+            }
+            const char *f = pct + 1;
+            int prec = -1;
+            if (*f == '.') {
+                prec = 0;
+                ++f;
+                while (*f >= '0' && *f <= '9') prec = prec * 10 + (*f++ - '0');
+            }
+            int lng = 0;            /* 1: l, 2: ll, 3: z */
+            if (*f == 'l') {
+                lng = 1;
+                if (*++f == 'l') { lng = 2; ++f; }
+            } else if (*f == 'z') {
+                lng = 3;
+                ++f;
+            }
+            const char *s;
+            size_t      n;
+            switch (*f) {
+                case 'd': case 'i': {
+                    if (prec >= 0) return -1;
+                    int64_t v = lng == 0 ? va_arg(ap, int)
+                              : lng == 1 ? va_arg(ap, long)
+                              : lng == 2 ? va_arg(ap, long long) : (int64_t)va_arg(ap, ssize_t);
+                    s = num;
+                    n = fmt_i64(num, v);
+                    break;
+                }
+                case 'u': case 'x': case 'X': {
+                    if (prec >= 0) return -1;
+                    uint64_t v = lng == 0 ? va_arg(ap, unsigned int)
+                               : lng == 1 ? va_arg(ap, unsigned long)
+                               : lng == 2 ? va_arg(ap, unsigned long long) : va_arg(ap, size_t);
+                    s = num;
+                    n = *f == 'u' ? fmt_u64(num, v) : fmt_hex(num, v, *f == 'X');
+                    break;
+                }
+                case 'c':
+                    if (prec >= 0 || lng) return -1;
+                    num[0] = (char)va_arg(ap, int);
+                    if (!num[0]) return -1;     /* would end the line early */
+                    s = num;
+                    n = 1;
+                    break;
+                case 's':
+                    if (lng) return -1;
+                    s = va_arg(ap, const char*);
+                    if (!s) {
+                        s = (prec < 0 || prec >= 6) ? "(null)" : "";
+                        n = strlen(s);
+                    } else {
+                        n = prec < 0 ? strlen(s) : strnlen(s, (size_t)prec);
+                    }
+                    break;
+                case 'p': {
+                    if (prec >= 0 || lng) return -1;
+                    const void *v = va_arg(ap, const void*);
+                    if (!v) {
+                        s = "(nil)";
+                        n = 5;
+                    } else {
+                        num[0] = '0';
+                        num[1] = 'x';
+                        s = num;
+                        n = 2 + fmt_hex(num + 2, (uint64_t)(uintptr_t)v, false);
+                    }
+                    break;
+                }
+                case 'f':
+                    if (lng > 1) return -1;
+                    s = num;
+                    n = fmt_fixed(num, va_arg(ap, double), prec < 0 ? 6 : prec);
+                    if (!n) return -1;
+                    break;
+                case '%':
+                    if (prec >= 0 || lng) return -1;
+                    s = "%";
+                    n = 1;
+                    break;
+                default:    /* flags, width, other conversions */
+                    return -1;
+            }
+            if (!fmt_put(out, &o, cap, s, n)) {
+                break;
+            }
+            fmt = f + 1;
+        }
+        out[o] = '\0';
+        return (int)o;
+    }
+#endif /* TKLOG_NO_FAST_FORMAT */
+
+/* vsnprintf-compatible; returns the length actually written. */
+static size_t fmt_message(char *out, size_t cap, const char *fmt, va_list ap)
+{
+#ifndef TKLOG_NO_FAST_FORMAT
+    va_list aq;
+    va_copy(aq, ap);
+    int n = fmt_fast(out, cap, fmt, aq);
+    va_end(aq);
+    if (n >= 0) {
+        return (size_t)n;
+    }
+#endif
+    if (cap == 0) {
+        return 0;
+    }
+    if (vsnprintf(out, cap, fmt, ap) < 0) {
+        out[0] = '\0';
+    }
+    return strlen(out);     /* a %c of 0 ends the line, as it always did */
+}
+
+/* ===============================  CLOCK  ================================ */
+/*  get_time_ns() is the single time source for log headers, the memory
+ *  tracker and TKLOG_TIMER:
+ *    TKLOG_CLOCK_TSC     x86‑64 with invariant TSC: rdtsc scaled by a factor
+ *                        calibrated against CLOCK_MONOTONIC over the first
+ *                        100 ms (CLOCK_MONOTONIC is used until then)
+ *    TKLOG_CLOCK_COARSE  CLOCK_MONOTONIC_COARSE (tick resolution, ~1‑4 ms)
+ *    default             CLOCK_MONOTONIC
+ *  Header time is relative ms, or TKLOG_TIME_US / TKLOG_TIME_NS; with
+ *  TKLOG_TIME_ISO8601 it is UTC wall time derived from the same clock.  */
+static uint64_t clock_mono_ns(void)
+{
+#ifdef _WIN32
+    /* Windows-specific high-resolution timing */
+    LARGE_INTEGER freq, count;
+    if (QueryPerformanceFrequency(&freq) && QueryPerformanceCounter(&count)) {
+        return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+    }
+    /* Fallback to GetTickCount64 if QueryPerformanceCounter fails */
+    return (uint64_t)GetTickCount64() * 1000000ULL;
+#else
+    /* POSIX timing - try clock_gettime first, fallback to gettimeofday */
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
+    /* Fallback to gettimeofday if clock_gettime fails */
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000ULL;
+#endif
+}
+
+#ifdef TKLOG_HAVE_TSC
+    #define TSC_CALIBRATE_NS 100000000ULL
+
+    enum { TSC_CALIBRATING, TSC_CLAIMED, TSC_READY };
+
+    static int      g_tsc_usable   = 0;     /* CPU advertises an invariant TSC */
+    static int      g_tsc_state    = TSC_CALIBRATING;
+    static uint64_t g_tsc_base_tsc = 0;
+    static uint64_t g_tsc_base_ns  = 0;
+    static uint64_t g_tsc_mult     = 0;     /* ns per tick, 32.32 fixed point */
+
+    static void tsc_init(void)
+    {
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1u << 8))) {
+            g_tsc_usable   = 1;
+            g_tsc_base_tsc = __rdtsc();
+            g_tsc_base_ns  = clock_mono_ns();
+        }
+    }
+
+    static uint64_t tsc_time_ns(void)
+    {
+        if (__atomic_load_n(&g_tsc_state, __ATOMIC_ACQUIRE) == TSC_READY) {
+            uint64_t ticks = __rdtsc() - g_tsc_base_tsc;
+            return g_tsc_base_ns + (uint64_t)(((unsigned __int128)ticks * g_tsc_mult) >> 32);
+        }
+        uint64_t now = clock_mono_ns();
+        if (g_tsc_usable && now - g_tsc_base_ns >= TSC_CALIBRATE_NS) {
+            int expected = TSC_CALIBRATING;
+            if (__atomic_compare_exchange_n(&g_tsc_state, &expected, TSC_CLAIMED, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                uint64_t tsc = __rdtsc();
+                now = clock_mono_ns();
+                g_tsc_mult     = (uint64_t)(((unsigned __int128)(now - g_tsc_base_ns) << 32) / (tsc - g_tsc_base_tsc));
+                g_tsc_base_tsc = tsc;
+                g_tsc_base_ns  = now;
+                __atomic_store_n(&g_tsc_state, TSC_READY, __ATOMIC_RELEASE);
+            }
+        }
+        return now;
+    }
+#endif /* TKLOG_HAVE_TSC */
+
+static uint64_t get_time_ns(void)
+{
+#if defined(TKLOG_HAVE_TSC)
+    return tsc_time_ns();
+#elif defined(TKLOG_CLOCK_COARSE) && defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0) {
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
+    return clock_mono_ns();
+#else
+    return clock_mono_ns();
+#endif
+}
+
+#ifdef TKLOG_BUFFERED
+static uint64_t get_time_ms(void) { return get_time_ns() / 1000000ULL; }
+#endif
+
+static void clock_init(void)
+{
+#ifdef TKLOG_HAVE_TSC
+    tsc_init();
+#endif
+    g_start_ns = get_time_ns();
+    g_start_ms = g_start_ns / 1000000ULL;
+#ifdef _WIN32
+    int64_t wall_ns = (int64_t)time(NULL) * 1000000000LL;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t wall_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+    g_wall_offset_ns = wall_ns - (int64_t)g_start_ns;
+}
+
+#ifdef TKLOG_TIME_ISO8601
+    /* "YYYY-MM-DDTHH:MM:SS" is re-rendered only when the second changes */
+    typedef struct ClockCache {
+        int64_t sec;
+        char    prefix[24];
+    } ClockCache;
+
+    static pthread_key_t g_tls_clock;  /* thread-local storage key */
+
+    static void clockcache_free(void *ptr)
+    {
+    #ifdef TKLOG_MEMORY
+        original_free(ptr);
+    #else
+        free(ptr);
+    #endif
+    }
+
+    static ClockCache *clockcache_get(void)
+    {
+        ClockCache *cc = pthread_getspecific(g_tls_clock);
+        if (!cc) {
+    #ifdef TKLOG_MEMORY
+            cc = (ClockCache*)original_malloc(sizeof *cc);
+    #else
+            cc = (ClockCache*)malloc(sizeof *cc);
+    #endif
+            if (!cc) return NULL;
+            cc->sec = -1;
+            pthread_setspecific(g_tls_clock, cc);
+        }
+        return cc;
+    }
+#endif /* TKLOG_TIME_ISO8601 */
+
+#if defined(TKLOG_TIME_NS)
+    #define TIME_FRAC_DIGITS 9
+#elif defined(TKLOG_TIME_US)
+    #define TIME_FRAC_DIGITS 6
+#else
+    #define TIME_FRAC_DIGITS 3
+#endif
+
+/* Writes the header time field ("…ms | " or ISO‑8601) for `now_ns`; returns its length. */
+static int time_render(char *p, size_t cap, uint64_t now_ns)
+{
+#ifdef TKLOG_TIME_ISO8601
+    int64_t  wall = (int64_t)now_ns + g_wall_offset_ns;
+    int64_t  sec  = wall / 1000000000LL;
+    uint32_t frac = (uint32_t)(wall % 1000000000LL);
+    char     tmp[24];
+    const char *prefix = tmp;
+    ClockCache *cc = clockcache_get();
+    if (cc && cc->sec == sec) {
+        prefix = cc->prefix;
+    } else {
+        time_t    t = (time_t)sec;
+        struct tm tm;
+    #ifdef _WIN32
+        gmtime_s(&tm, &t);
+    #else
+        gmtime_r(&t, &tm);
+    #endif
+        strftime(tmp, sizeof tmp, "%Y-%m-%dT%H:%M:%S", &tm);
+        if (cc) {
+            memcpy(cc->prefix, tmp, sizeof tmp);
+            cc->sec = sec;
+        }
+    }
+    /* prefix(19) '.' digits 'Z' " | " */
+    size_t need = 19 + 1 + TIME_FRAC_DIGITS + 1 + 3;
+    if (cap <= need) return 0;
+    memcpy(p, prefix, 19);
+    p[19] = '.';
+    for (int i = 9; i > TIME_FRAC_DIGITS; --i) frac /= 10;
+    for (int i = TIME_FRAC_DIGITS; i > 0; --i) {
+        p[19 + i] = (char)('0' + frac % 10);
+        frac /= 10;
+    }
+    memcpy(p + 20 + TIME_FRAC_DIGITS, "Z | ", 5);
+    return (int)need;
+#else
+    #if defined(TKLOG_TIME_NS)
+        uint64_t rel = now_ns - g_start_ns;
+        const char *unit = "ns | ";
+    #elif defined(TKLOG_TIME_US)
+        uint64_t rel = now_ns / 1000ULL - g_start_ns / 1000ULL;
+        const char *unit = "us | ";
+    #else
+        uint64_t rel = now_ns / 1000000ULL - g_start_ms;
+        const char *unit = "ms | ";
+    #endif
+    if (cap <= 20 + 5) return 0;
+    size_t n = fmt_u64(p, rel);
+    memcpy(p + n, unit, 6);
+    return (int)n + 5;
+#endif
+}
 
 /* ==============================  PATH TLS  ============================== */
+/*  Scope ids (TKLOG_MEMORY, TKLOG_TIMER): every distinct scope path is       */
+/*  interned as a node {parent, file, line}, so a tracked allocation or timer */
+/*  path records one integer and the path is only formatted when reported.   */
+/*  Id 0 is the empty path.  Nodes are published lock‑free and never removed; */
+/*  once TKLOG_MEMORY_SCOPES are in use, deeper new paths are recorded as     */
+/*  their deepest interned ancestor.                                          */
+#ifndef TKLOG_MEMORY_SCOPES
+    #define TKLOG_MEMORY_SCOPES 16384
+#endif
+#if (TKLOG_MEMORY_SCOPES & (TKLOG_MEMORY_SCOPES - 1)) != 0
+    #error "TKLOG_MEMORY_SCOPES must be a power of two"
+#endif
+
+typedef struct ScopeNode {
+    uint32_t        parent;
+    int             line;
+    const char     *file;
+} ScopeNode;
+
+typedef struct ScopeTable {
+    uint32_t        count;                              /* next free id */
+    ScopeNode       nodes[TKLOG_MEMORY_SCOPES];
+    uint32_t        slots[2 * TKLOG_MEMORY_SCOPES];     /* hash -> id, 0 = empty */
+} ScopeTable;
+
+static ScopeTable *g_scopes = NULL;    /* allocated on first intern */
+
+#if defined(TKLOG_MEMORY) || defined(TKLOG_TIMER)
+static uint32_t scope_intern(uint32_t parent, const char *file, int line)
+{
+    ScopeTable *t = __atomic_load_n(&g_scopes, __ATOMIC_ACQUIRE);
+    if (!t) {
+#ifdef TKLOG_MEMORY
+        ScopeTable *fresh = (ScopeTable*)original_calloc(1, sizeof *fresh);
+#else
+        ScopeTable *fresh = (ScopeTable*)calloc(1, sizeof *fresh);
+#endif
+        if (!fresh) {
+            return parent;
+        }
+        fresh->count = 1;
+        if (__atomic_compare_exchange_n(&g_scopes, &t, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            t = fresh;
+        } else {
+#ifdef TKLOG_MEMORY
+            original_free(fresh);
+#else
+            free(fresh);
+#endif
+        }
+    }
+
+    uint64_t h = (uint64_t)(uintptr_t)file ^ ((uint64_t)parent << 32) ^ (uint64_t)(unsigned)line * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    size_t mask = 2 * TKLOG_MEMORY_SCOPES - 1;
+    size_t i    = (size_t)h & mask;
+    for (size_t n = 0; n <= mask; ++n, i = (i + 1) & mask) {
+        uint32_t id = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+        if (!id) {
+            if (__atomic_load_n(&t->count, __ATOMIC_RELAXED) >= TKLOG_MEMORY_SCOPES) {
+                return parent;
+            }
+            uint32_t fresh = __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+            if (fresh >= TKLOG_MEMORY_SCOPES) {
+                return parent;
+            }
+            t->nodes[fresh] = (ScopeNode){ parent, line, file };
+            if (__atomic_compare_exchange_n(&t->slots[i], &id, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return fresh;
+            }
+            /* lost the slot; the node id stays unused */
+        }
+        const ScopeNode *nd = &t->nodes[id];
+        if (nd->parent == parent && nd->line == line && nd->file == file) {
+            return id;
+        }
+    }
+    return parent;
+}
+#endif
+
+/* appends "a.c:12 → b.c:88" for scope id to out[o..cap), returns the new length */
+static size_t scope_format(uint32_t id, char *out, size_t o, size_t cap)
+{
+    const ScopeTable *t = __atomic_load_n(&g_scopes, __ATOMIC_ACQUIRE);
+    size_t depth = 0;
+    for (uint32_t s = id; t && s; s = t->nodes[s].parent) {
+        depth += 1;
+    }
+    /* outermost first; quadratic in depth, but only run when dumping */
+    for (size_t k = 0; k < depth && o + 1 < cap; ++k) {
+        uint32_t s = id;
+        for (size_t up = depth - 1 - k; up; --up) {
+            s = t->nodes[s].parent;
+        }
+        int n = snprintf(out + o, cap - o, "%s%s:%d", k ? " → " : "", t->nodes[s].file, t->nodes[s].line);
+        o = n < 0 ? o : (o + (size_t)n < cap ? o + (size_t)n : cap - 1);
+    }
+    return o;
+}
+
 typedef struct PathStack {
     char   *buf;        /* formatted "a.c:12 → b.c:88 → …" string */
     size_t  len;        /* current length                        */
     size_t  cap;        /* allocated capacity                    */
     int     depth;      /* number of entries                     */
+    uint32_t scope;     /* interned id of the path (TKLOG_MEMORY, TKLOG_TIMER) */
+    int     unscoped;   /* pushes on top that found the scope table full */
 } PathStack;
 
 static pthread_key_t g_tls_path;  /* thread-local storage key */
@@ -73,6 +678,20 @@ static void pathstack_free(void *ptr)
     }
 }
 
+/* the tracked allocators read the key too, possibly before tklog_init_once() */
+static pthread_once_t g_path_once = PTHREAD_ONCE_INIT;
+
+static void pathstack_key_init(void)
+{
+    pthread_key_create(&g_tls_path, pathstack_free);
+}
+
+static inline PathStack *pathstack_peek(void)
+{
+    pthread_once(&g_path_once, pathstack_key_init);
+    return pthread_getspecific(g_tls_path);
+}
+
 static PathStack *pathstack_get(void)
 {
     PathStack *ps = pthread_getspecific(g_tls_path);
@@ -92,6 +711,9 @@ static PathStack *pathstack_get(void)
 #endif
         ps->buf[0] = '\0';
         pthread_setspecific(g_tls_path, ps);
+#ifdef TKLOG_CRASH_HANDLER
+        crash_thread_init();
+#endif
     }
     return ps;
 }
@@ -134,6 +756,13 @@ static void pathstack_push(const char *file, int line)
     ps->len += n;
     ps->buf[ps->len] = '\0';
     ps->depth += 1;
+#if defined(TKLOG_MEMORY) || defined(TKLOG_TIMER)
+    uint32_t scope = ps->unscoped ? ps->scope : scope_intern(ps->scope, file, line);
+    if (scope == ps->scope) {
+        ps->unscoped += 1;
+    }
+    ps->scope = scope;
+#endif
     // printf("push %s\n", ps->buf);
 }
 
@@ -166,405 +795,3698 @@ static void pathstack_pop(void)
         ps->len = strlen(ps->buf);
     }
     ps->depth -= 1;
+#if defined(TKLOG_MEMORY) || defined(TKLOG_TIMER)
+    if (ps->unscoped) {
+        ps->unscoped -= 1;
+    } else if (ps->scope) {
+        ps->scope = g_scopes->nodes[ps->scope].parent;
+    }
+#endif
 
     // printf("pop  %s\n", ps->buf);
 }
 
 /* =============================  MEM TRACK  ============================== */
+/*  Live allocations sit in TKLOG_MEMORY_SHARDS open‑addressing tables keyed  */
+/*  by pointer; the shard comes from the address hash, so threads freeing     */
+/*  unrelated blocks rarely meet on a lock.  Linear probing with backward‑    */
+/*  shift deletion keeps add/remove/update O(1) without tombstones.           */
+#ifndef TKLOG_MEMORY_SHARDS
+    #define TKLOG_MEMORY_SHARDS 64
+#endif
+#if (TKLOG_MEMORY_SHARDS & (TKLOG_MEMORY_SHARDS - 1)) != 0
+    #error "TKLOG_MEMORY_SHARDS must be a power of two"
+#endif
+
+/*  Per‑site aggregates for tklog_memory_report().  A site is file:line, or  */
+/*  the full scope path with TKLOG_MEMORY_SITE_SCOPE.  Sites are published    */
+/*  into a fixed lock‑free table and never removed; counters are relaxed      */
+/*  atomics, so a report is a consistent‑enough snapshot, not an exact one.   */
+#ifndef TKLOG_MEMORY_SITES
+    #define TKLOG_MEMORY_SITES 4096
+#endif
+#if (TKLOG_MEMORY_SITES & (TKLOG_MEMORY_SITES - 1)) != 0
+    #error "TKLOG_MEMORY_SITES must be a power of two"
+#endif
+#define MEM_SIZE_BUCKETS 40     /* bucket b holds sizes in [2^(b-1), 2^b), the last one everything above */
+#define MEM_LIFE_BUCKETS 44     /* same scheme in ns: < 1 ns up to 2^43 ns (~2.4 h) and above */
+
+/* A site whose blocks mostly die within this many ns is reported as an arena
+ * candidate, or a freelist candidate when they also share one size class. */
+#ifndef TKLOG_MEMORY_SHORT_LIVED_NS
+    #define TKLOG_MEMORY_SHORT_LIVED_NS 1000000
+#endif
+
+typedef struct MemSite {
+    uint64_t        hash;
+    const void     *caller;     /* return address (TKLOG_PRELOAD), else NULL */
+    const char     *file;
+    int             line;
+    uint32_t        scope;      /* TKLOG_MEMORY_SITE_SCOPE */
+    char            label[128];
+    uint64_t        allocs;
+    uint64_t        frees;
+    uint64_t        total_bytes;
+    uint64_t        live_bytes;
+    uint64_t        peak_bytes;
+    uint64_t        total_usable;   /* what the allocator actually reserved */
+    uint64_t        live_usable;
+    uint64_t        common_size;    /* majority vote over request sizes */
+    int64_t         common_votes;
+    uint64_t        sizes[MEM_SIZE_BUCKETS];
+    uint64_t        lifetimes[MEM_LIFE_BUCKETS];
+} MemSite;
+
+static MemSite *g_mem_sites[TKLOG_MEMORY_SITES];
+static MemSite  g_mem_site_other = { .label = "(other sites)" };    /* table full */
+
 typedef struct MemEntry {
-    void           *ptr;
+    union {
+        void            *ptr;
+        struct MemEntry *next_free;     /* while pooled */
+    };
     size_t          size;
-    uint64_t        t_ms;
+    uint64_t        t_ns;       /* allocated                             */
+    uint64_t        site_ns;    /* attributed to site (allocated/realloc'd) */
+    uint64_t        seq;        /* allocation order, newest dumped first */
     pthread_t       tid;
-    char            path[128];
-    struct MemEntry *next;
+    MemSite        *site;
+    const void     *caller;     /* return address (TKLOG_PRELOAD), else NULL */
+    const char     *file;
+    int             line;
+    uint32_t        scope;      /* scope id at allocation, formatted when dumped */
+    uint32_t        slack;      /* usable minus requested bytes */
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+    uint32_t        weight;     /* allocations this sample stands for */
+#endif
 } MemEntry;
 
-static MemEntry *g_mem_head = NULL;
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+    #define MEM_WEIGHT(e) ((uint64_t)(e)->weight)
+#else
+    #define MEM_WEIGHT(e) 1ULL
+#endif
+
+/*  MemEntry records come from slabs and are recycled through per‑thread     */
+/*  caches that trade batches with a global free list, so tracking a block   */
+/*  costs no allocation of its own in the steady state.                      */
+#define MEM_POOL_BATCH 64       /* records moved between a thread and the global list at once */
+#define MEM_POOL_SLAB  256      /* records carved from one slab allocation                    */
+
+typedef struct MemPoolCache {
+    MemEntry       *free;
+    unsigned        count;
+} MemPoolCache;
+
+static pthread_mutex_t g_mem_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static MemEntry       *g_mem_pool_free = NULL;
+static pthread_key_t   g_tls_mempool;
+static pthread_once_t  g_mem_pool_once = PTHREAD_ONCE_INIT;
 
-static uint64_t get_time_ms(void)
+/* moves up to max records from *list to the global list */
+static void mem_pool_give(MemEntry **list, unsigned max)
 {
-#ifdef _WIN32
-    /* Windows-specific high-resolution timing */
-    LARGE_INTEGER freq, count;
-    if (QueryPerformanceFrequency(&freq) && QueryPerformanceCounter(&count)) {
-        return (uint64_t)(count.QuadPart * 1000 / freq.QuadPart);
+    MemEntry *head = *list, *tail = head;
+    if (!head) {
+        return;
     }
-    /* Fallback to GetTickCount64 if QueryPerformanceCounter fails */
-    return (uint64_t)GetTickCount64();
-#else
-    /* POSIX timing - try clock_gettime first, fallback to gettimeofday */
-    struct timespec ts;
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
-        return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    for (unsigned n = 1; n < max && tail->next_free; ++n) {
+        tail = tail->next_free;
     }
-    /* Fallback to gettimeofday if clock_gettime fails */
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
-#endif
+    *list = tail->next_free;
+    pthread_mutex_lock(&g_mem_pool_lock);
+    tail->next_free = g_mem_pool_free;
+    g_mem_pool_free = head;
+    pthread_mutex_unlock(&g_mem_pool_lock);
 }
 
-static uint64_t get_time_us(void)
+static void mem_pool_cache_free(void *ptr)
 {
-#ifdef _WIN32
-    /* Windows-specific high-resolution timing */
-    LARGE_INTEGER freq, count;
-    if (QueryPerformanceFrequency(&freq) && QueryPerformanceCounter(&count)) {
-        return (uint64_t)(count.QuadPart * 1000000ULL / freq.QuadPart)
-    }
-    /* Fallback to GetTickCount64 if QueryPerformanceCounter fails */
-    return (uint64_t)GetTickCount64();
+    MemPoolCache *cache = (MemPoolCache*)ptr;
+    mem_pool_give(&cache->free, UINT_MAX);
+#ifdef TKLOG_MEMORY
+    original_free(cache);
 #else
-    /* POSIX timing - try clock_gettime first, fallback to gettimeofday */
-    struct timespec ts;
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
-        return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
-    }
-    /* Fallback to gettimeofday if clock_gettime fails */
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (uint64_t)tv.tv_sec * 1000000ULL + (uint64_t)tv.tv_usec;
+    free(cache);
 #endif
 }
 
-static void mem_add(void *ptr, size_t size, const char *file, int line)
+static void mem_pool_key_init(void)
 {
-    if (!ptr) return;
-    pthread_rwlock_wrlock(&g_mem_rwlock);
+    pthread_key_create(&g_tls_mempool, mem_pool_cache_free);
+}
+
+static MemPoolCache *mem_pool_cache(void)
+{
+    pthread_once(&g_mem_pool_once, mem_pool_key_init);
+    MemPoolCache *cache = pthread_getspecific(g_tls_mempool);
+    if (!cache) {
 #ifdef TKLOG_MEMORY
-    MemEntry *e = (MemEntry*)original_malloc(sizeof *e);
+        cache = (MemPoolCache*)original_calloc(1, sizeof *cache);
 #else
-    MemEntry *e = (MemEntry*)malloc(sizeof *e);
+        cache = (MemPoolCache*)calloc(1, sizeof *cache);
 #endif
-    if (e) {
-        e->ptr  = ptr;
-        e->size = size;
-        e->t_ms = get_time_ms();
-        e->tid  = pthread_self();
-        
-        // Get the full call path from PathStack
-        PathStack *ps = pathstack_get();
-        if (ps && ps->buf[0]) {
-            // Show call stack path + current file:line (same format as _tklog)
-            snprintf(e->path, sizeof e->path, "%s → %s:%d", ps->buf, file, line);
-        } else {
-            // Show just current file:line when no call stack
-            snprintf(e->path, sizeof e->path, "%s:%d", file, line);
+        if (cache) {
+            pthread_setspecific(g_tls_mempool, cache);
         }
-        
-        e->next = g_mem_head;
-        g_mem_head = e;
+#ifdef TKLOG_CRASH_HANDLER
+        crash_thread_init();
+#endif
     }
-    pthread_rwlock_unlock(&g_mem_rwlock);
+    return cache;
 }
-static void mem_update(void *oldptr, void *newptr, size_t newsize)
+
+static MemEntry *mem_entry_new(void)
 {
-    pthread_rwlock_wrlock(&g_mem_rwlock);
-    for (MemEntry *e = g_mem_head; e; e = e->next) {
-        if (e->ptr == oldptr) {
-            e->ptr  = newptr;
-            e->size = newsize;
-            break;
-        }
+    MemPoolCache *cache = mem_pool_cache();
+    if (!cache) {
+        return NULL;
     }
-    pthread_rwlock_unlock(&g_mem_rwlock);
-}
-static bool mem_remove(void *ptr)
-{
-    pthread_rwlock_wrlock(&g_mem_rwlock);
-    MemEntry **pp = &g_mem_head;
-    while (*pp) {
-        if ((*pp)->ptr == ptr) {
-            MemEntry *dead = *pp;
-            *pp = dead->next;
+    if (!cache->free) {
+        /* refill: a batch from the global list, else a fresh slab */
+        pthread_mutex_lock(&g_mem_pool_lock);
+        MemEntry *head = g_mem_pool_free, *tail = head;
+        unsigned  n    = head ? 1 : 0;
+        while (tail && n < MEM_POOL_BATCH && tail->next_free) {
+            tail = tail->next_free;
+            n += 1;
+        }
+        if (tail) {
+            g_mem_pool_free = tail->next_free;
+            tail->next_free = NULL;
+        }
+        pthread_mutex_unlock(&g_mem_pool_lock);
+
+        if (!head) {
 #ifdef TKLOG_MEMORY
-            original_free(dead);
+            MemEntry *slab = (MemEntry*)original_malloc(MEM_POOL_SLAB * sizeof *slab);
 #else
-            free(dead);
+            MemEntry *slab = (MemEntry*)malloc(MEM_POOL_SLAB * sizeof *slab);
 #endif
-            pthread_rwlock_unlock(&g_mem_rwlock);
-            return true;
+            if (!slab) {
+                return NULL;
+            }
+            for (unsigned k = 0; k + 1 < MEM_POOL_SLAB; ++k) {
+                slab[k].next_free = &slab[k + 1];
+            }
+            slab[MEM_POOL_SLAB - 1].next_free = NULL;
+            head = slab;
+            n    = MEM_POOL_SLAB;
         }
-        pp = &(*pp)->next;
+        cache->free  = head;
+        cache->count = n;
     }
-    pthread_rwlock_unlock(&g_mem_rwlock);
-    return false;
+    MemEntry *e = cache->free;
+    cache->free   = e->next_free;
+    cache->count -= 1;
+    return e;
 }
 
-/* ------------------------- Time tracing ----------------------------- */
-#ifdef TKLOG_TIMER
-    static void vt_free_str(char *str) { free(str); }
-    typedef struct CallPathTime {
-        uint64_t total_time_us;
-        uint64_t count;
-    } CallPathTime;
-    #define NAME call_path_time_table
-    #define KEY_TY char*
-    #define VAL_TY CallPathTime
-    #define HASH_FN vt_hash_string
-    #define CMPR_FN vt_cmpr_string
-    #define KEY_DTOR_FN vt_free_str
-    #include "verstable.h"
-    typedef struct TimeTracker {
-        uint64_t total_time_us;
-        uint64_t count;
-        call_path_time_table call_paths;
-    } TimeTracker;
-    static void vt_time_tracker_dtor(TimeTracker tracker) { call_path_time_table_cleanup(&tracker.call_paths); }
-    #define NAME time_tracker_table
-    #define KEY_TY char*
-    #define VAL_TY TimeTracker
-    #define HASH_FN vt_hash_string
-    #define CMPR_FN vt_cmpr_string
-    #define KEY_DTOR_FN vt_free_str
-    #define VAL_DTOR_FN vt_time_tracker_dtor
-    #include "verstable.h"
-    typedef struct TimerEntry {
-        char* location;
-        char* path;
-        uint64_t start_time;
-        struct TimerEntry* next;
-    } TimerEntry;
-    typedef struct TimerState {
-        time_tracker_table table;
-        TimerEntry* stack;
-    } TimerState;
-    static pthread_key_t g_tls_timer_state;
-    static void timer_state_free(void *ptr) {
-        TimerState *ts = (TimerState*)ptr;
-        if (ts) {
-            time_tracker_table_cleanup(&ts->table);
-            while (ts->stack) {
-                TimerEntry *top = ts->stack;
-                ts->stack = top->next;
-                free(top->location);
-                free(top->path);
-                free(top);
-            }
-            free(ts);
-        }
+static void mem_entry_delete(MemEntry *e)
+{
+    if (!e) {
+        return;
+    }
+    MemPoolCache *cache = mem_pool_cache();
+    if (!cache) {
+        mem_pool_give(&e, 1);
+        return;
+    }
+    e->next_free = cache->free;
+    cache->free  = e;
+    if (++cache->count > 2 * MEM_POOL_BATCH) {
+        mem_pool_give(&cache->free, MEM_POOL_BATCH);
+        cache->count -= MEM_POOL_BATCH;
+    }
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    MemEntry      **slots;      /* NULL = empty */
+    size_t          cap;        /* power of two, 0 until first insert */
+    size_t          count;
+} __attribute__((aligned(64))) MemShard;
+
+static MemShard g_mem_shards[TKLOG_MEMORY_SHARDS] = {
+    [0 ... TKLOG_MEMORY_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static uint64_t g_mem_seq = 0;
+
+static inline uint64_t mem_hash(const void *ptr)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ptr;     /* fmix64 */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed62ccd5ULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* "a.c:12 → b.c:88 → file:line", or "file:line" outside any scope */
+static void mem_format_path(uint32_t scope, const char *file, int line, char *out, size_t cap)
+{
+    size_t o = scope_format(scope, out, 0, cap);
+    snprintf(out + o, cap - o, "%s%s:%d", o ? " → " : "", file, line);
+}
+
+static inline uint64_t mem_str_hash(const char *str, uint64_t h)
+{
+    for (; *str; ++str) {
+        h = (h ^ (unsigned char)*str) * 0x100000001b3ULL;    /* FNV-1a */
+    }
+    return h;
+}
+
+static inline unsigned mem_log2_bucket(uint64_t v, unsigned buckets)
+{
+    unsigned b = v ? 64u - (unsigned)__builtin_clzll((unsigned long long)v) : 0u;
+    return b < buckets ? b : buckets - 1;
+}
+
+/* scope is part of the key only under TKLOG_MEMORY_SITE_SCOPE.  A non-NULL
+ * caller (TKLOG_PRELOAD) is the key on its own. */
+static MemSite *mem_site(const char *file, int line, uint32_t scope, const void *caller)
+{
+#ifndef TKLOG_MEMORY_SITE_SCOPE
+    scope = 0;
+#endif
+    uint64_t h = caller ? mem_hash(caller)
+                        : mem_str_hash(file, 0xcbf29ce484222325ULL ^ (uint64_t)(unsigned)line * 0x9E3779B97F4A7C15ULL
+                                                                   ^ (uint64_t)scope << 40);
+    size_t   mask = TKLOG_MEMORY_SITES - 1;
+    size_t   i    = (size_t)h & mask;
+    for (size_t n = 0; n <= mask; ++n, i = (i + 1) & mask) {
+        MemSite *site = __atomic_load_n(&g_mem_sites[i], __ATOMIC_ACQUIRE);
+        if (!site) {
+#ifdef TKLOG_MEMORY
+            MemSite *fresh = (MemSite*)original_calloc(1, sizeof *fresh);
+#else
+            MemSite *fresh = (MemSite*)calloc(1, sizeof *fresh);
+#endif
+            if (!fresh) {
+                break;
+            }
+            fresh->hash   = h;
+            fresh->caller = caller;
+            fresh->file   = file;
+            fresh->line   = line;
+            fresh->scope  = scope;
+            if (!caller) {  /* caller sites are symbolised when reported */
+                mem_format_path(scope, file, line, fresh->label, sizeof fresh->label);
+            }
+            if (__atomic_compare_exchange_n(&g_mem_sites[i], &site, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return fresh;
+            }
+#ifdef TKLOG_MEMORY
+            original_free(fresh);   /* lost the race; site now holds the winner */
+#else
+            free(fresh);
+#endif
+        }
+        if (site->hash != h || site->caller != caller) {
+            continue;
+        }
+        if (caller || (site->line == line && site->scope == scope && strcmp(site->file, file) == 0)) {
+            return site;
+        }
+    }
+    return &g_mem_site_other;
+}
+
+/* bytes the allocator reserved for ptr, which malloc may hand out beyond
+ * the request; the request itself where the platform cannot tell */
+static inline uint32_t mem_slack(void *ptr, size_t size)
+{
+#if defined(__linux__)
+    size_t usable = malloc_usable_size(ptr);
+#elif defined(__APPLE__)
+    size_t usable = malloc_size(ptr);
+#else
+    size_t usable = size;
+    (void)ptr;
+#endif
+    size_t slack = usable > size ? usable - size : 0;
+    return slack < UINT32_MAX ? (uint32_t)slack : UINT32_MAX;
+}
+
+/* counters are estimates under TKLOG_MEMORY_SAMPLE_BYTES: each sample adds its weight */
+static void mem_site_alloc(MemEntry *e)
+{
+    MemSite *site   = e->site;
+    uint64_t w      = MEM_WEIGHT(e);
+    uint64_t bytes  = e->size * w;
+    uint64_t usable = (e->size + e->slack) * w;
+    __atomic_fetch_add(&site->allocs, w, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->total_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->total_usable, usable, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->live_usable, usable, __ATOMIC_RELAXED);
+    /* Boyer-Moore majority vote; races only blur which size wins */
+    if (__atomic_load_n(&site->common_size, __ATOMIC_RELAXED) == e->size) {
+        __atomic_fetch_add(&site->common_votes, 1, __ATOMIC_RELAXED);
+    } else if (__atomic_load_n(&site->common_votes, __ATOMIC_RELAXED) <= 0) {
+        __atomic_store_n(&site->common_size, e->size, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->common_votes, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(&site->common_votes, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&site->sizes[mem_log2_bucket(e->size, MEM_SIZE_BUCKETS)], w, __ATOMIC_RELAXED);
+    uint64_t live = __atomic_add_fetch(&site->live_bytes, bytes, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&site->peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&site->peak_bytes, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void mem_site_free(MemEntry *e)
+{
+    uint64_t life = get_time_ns() - e->site_ns;
+    uint64_t w    = MEM_WEIGHT(e);
+    __atomic_fetch_add(&e->site->frees, w, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&e->site->live_bytes, e->size * w, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&e->site->live_usable, (e->size + e->slack) * w, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&e->site->lifetimes[mem_log2_bucket(life, MEM_LIFE_BUCKETS)], w, __ATOMIC_RELAXED);
+}
+
+/*  TKLOG_MEMORY_SAMPLE_BYTES=N tracks a byte‑weighted Poisson sample: a    */
+/*  point falls every N bytes on average and an allocation is tracked when  */
+/*  it covers one, i.e. with probability 1 - e^(-size/N).  Each sample      */
+/*  carries weight 1/p, so site counters stay unbiased estimates.  Every    */
+/*  other allocation only decrements a per‑thread countdown, and a free     */
+/*  only reads a counter filter of the sampled addresses.                   */
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+    #if TKLOG_MEMORY_SAMPLE_BYTES < 1
+        #error "TKLOG_MEMORY_SAMPLE_BYTES must be positive"
+    #endif
+    #define MEM_SAMPLE_FILTER (1u << 16)    /* live samples per address hash bucket */
+
+    static uint16_t g_mem_sample_filter[MEM_SAMPLE_FILTER];
+
+    /* initial-exec: the countdown must not allocate on first touch */
+    static __thread int64_t  t_mem_sample_left __attribute__((tls_model("initial-exec")));
+    static __thread uint64_t t_mem_sample_rng  __attribute__((tls_model("initial-exec")));
+
+    static inline void mem_filter_add(uint64_t h, int delta)
+    {
+        __atomic_fetch_add(&g_mem_sample_filter[h & (MEM_SAMPLE_FILTER - 1)], (uint16_t)delta, __ATOMIC_RELAXED);
+    }
+
+    static inline bool mem_filter_maybe(uint64_t h)
+    {
+        return __atomic_load_n(&g_mem_sample_filter[h & (MEM_SAMPLE_FILTER - 1)], __ATOMIC_RELAXED) != 0;
+    }
+
+    static uint64_t mem_sample_random(void)
+    {
+        uint64_t x = t_mem_sample_rng;
+        if (!x) {
+            x = mem_hash(&t_mem_sample_rng) ^ get_time_ns() ^ 0x9e3779b97f4a7c15ULL;
+        }
+        x ^= x >> 12;       /* xorshift64* */
+        x ^= x << 25;
+        x ^= x >> 27;
+        t_mem_sample_rng = x;
+        return x * 0x2545f4914f6cdd1dULL;
+    }
+
+    /* -ln(u) for u uniform in (0, 1], i.e. an Exp(1) draw, without libm */
+    static double mem_sample_exp(void)
+    {
+        uint64_t q  = (mem_sample_random() >> 11) + 1;  /* u = q / 2^53 */
+        int      e  = 63 - __builtin_clzll(q);          /* q = 2^e * m, m in [1, 2) */
+        double   m  = (double)q / (double)(1ULL << e);
+        double   t  = (m - 1.0) / (m + 1.0), t2 = t * t;
+        double   lm = 2.0 * t * (1.0 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 / 9))));
+        return (double)(53 - e) * 0.6931471805599453 - lm;
+    }
+
+    /* 1 - e^(-x) for x >= 0: series where it would cancel, squaring elsewhere */
+    static double mem_sample_prob(double x)
+    {
+        if (x < 0.03125) {
+            return x * (1.0 - x * (0.5 - x * (1.0 / 6 - x / 24)));
+        }
+        if (x > 40.0) {
+            return 1.0;
+        }
+        double y = x / 1024.0;
+        double r = 1.0 - y * (1.0 - y * (0.5 - y * (1.0 / 6 - y / 24)));
+        for (int i = 0; i < 10; ++i) {
+            r *= r;
+        }
+        return 1.0 - r;
+    }
+
+    static bool mem_sample_slow(size_t size, uint32_t *weight)
+    {
+        const double mean = (double)TKLOG_MEMORY_SAMPLE_BYTES;
+        if (!t_mem_sample_rng) {
+            /* first allocation of the thread: start the countdown as if it ran before */
+            t_mem_sample_left = (int64_t)(mem_sample_exp() * mean) - (int64_t)size;
+            if (t_mem_sample_left >= 0) {
+                return false;
+            }
+        }
+        if ((double)-t_mem_sample_left > 64.0 * mean) {
+            t_mem_sample_left = (int64_t)(mem_sample_exp() * mean);
+        } else {
+            while (t_mem_sample_left < 0) {
+                t_mem_sample_left += (int64_t)(mem_sample_exp() * mean) + 1;
+            }
+        }
+        /* round 1/p up or down at random so the weight stays unbiased */
+        double   w = 1.0 / mem_sample_prob((double)size / mean);
+        double   f = w < 4294967295.0 ? w : 4294967295.0;
+        uint32_t n = (uint32_t)f;
+        n += (double)(mem_sample_random() >> 11) * (1.0 / 9007199254740992.0) < f - (double)n;
+        *weight = n ? n : 1;
+        return true;
+    }
+
+    static inline bool mem_sample(size_t size, uint32_t *weight)
+    {
+        t_mem_sample_left -= (int64_t)size;
+        if (__builtin_expect(t_mem_sample_left >= 0, 1)) {
+            return false;
+        }
+        return mem_sample_slow(size, weight);
+    }
+#endif
+
+static inline MemShard *mem_shard(uint64_t h)
+{
+    return &g_mem_shards[h & (TKLOG_MEMORY_SHARDS - 1)];
+}
+
+/* slot holding ptr, or the empty slot that ends its probe run; caller holds the lock */
+static size_t mem_probe(const MemShard *sh, const void *ptr, uint64_t h)
+{
+    size_t mask = sh->cap - 1;
+    size_t i    = (size_t)(h >> 32) & mask;
+    while (sh->slots[i] && sh->slots[i]->ptr != ptr) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static bool mem_grow(MemShard *sh)
+{
+    size_t    newcap = sh->cap ? sh->cap * 2 : 64;
+#ifdef TKLOG_MEMORY
+    MemEntry **slots = (MemEntry**)original_calloc(newcap, sizeof *slots);
+#else
+    MemEntry **slots = (MemEntry**)calloc(newcap, sizeof *slots);
+#endif
+    if (!slots) {
+        return false;
+    }
+    MemEntry **old    = sh->slots;
+    size_t     oldcap = sh->cap;
+    sh->slots = slots;
+    __atomic_store_n(&sh->cap, newcap, __ATOMIC_RELEASE);   /* the crash dump reads without the lock */
+    for (size_t i = 0; i < oldcap; ++i) {
+        if (old[i]) {
+            sh->slots[mem_probe(sh, old[i]->ptr, mem_hash(old[i]->ptr))] = old[i];
+        }
+    }
+#ifdef TKLOG_MEMORY
+    original_free(old);
+#else
+    free(old);
+#endif
+    return true;
+}
+
+/* caller holds the lock; returns the entry it displaced for the same address
+ * (only possible for a block whose free was never seen), or e
+ * itself when the table cannot grow; NULL otherwise */
+static MemEntry *mem_insert(MemShard *sh, MemEntry *e, uint64_t h)
+{
+    if ((sh->count + 1) * 4 > sh->cap * 3 && !mem_grow(sh)) {
+        return e;
+    }
+    size_t    i   = mem_probe(sh, e->ptr, h);
+    MemEntry *old = sh->slots[i];
+    sh->slots[i] = e;
+    sh->count += old ? 0 : 1;
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+    if (!old) {
+        mem_filter_add(h, 1);
+    }
+#endif
+    return old;
+}
+
+/* caller holds the lock; unlinks slot i and closes the gap behind it */
+static void mem_erase(MemShard *sh, size_t i)
+{
+    size_t mask = sh->cap - 1;
+    size_t j    = i;
+    sh->slots[i] = NULL;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!sh->slots[j]) {
+            break;
+        }
+        size_t home = (size_t)(mem_hash(sh->slots[j]->ptr) >> 32) & mask;
+        /* move j back into the hole unless its home lies in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            sh->slots[i] = sh->slots[j];
+            sh->slots[j] = NULL;
+            i = j;
+        }
+    }
+    sh->count -= 1;
+}
+
+/* caller holds the lock */
+static MemEntry *mem_take(MemShard *sh, const void *ptr, uint64_t h)
+{
+    if (!sh->cap) {
+        return NULL;
+    }
+    size_t    i = mem_probe(sh, ptr, h);
+    MemEntry *e = sh->slots[i];
+    if (e) {
+        mem_erase(sh, i);
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+        mem_filter_add(h, -1);
+#endif
+    }
+    return e;
+}
+
+static void mem_add(void *ptr, size_t size, const char *file, int line, const void *caller)
+{
+    if (!ptr) return;
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+    uint32_t weight;
+    if (!mem_sample(size, &weight)) {
+        return;
+    }
+#endif
+    MemEntry *e = mem_entry_new();
+    if (!e) {
+        return;
+    }
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+    e->weight = weight;
+#endif
+    e->ptr  = ptr;
+    e->size = size;
+    e->slack = mem_slack(ptr, size);
+    e->t_ns = get_time_ns();
+    e->site_ns = e->t_ns;
+    e->seq  = __atomic_fetch_add(&g_mem_seq, 1, __ATOMIC_RELAXED);
+    e->tid  = pthread_self();
+    e->caller = caller;
+    e->file = file;
+    e->line = line;
+    e->scope = 0;
+    if (!caller) {
+        PathStack *ps = pathstack_peek();
+        e->scope = ps ? ps->scope : 0;
+    }
+    e->site = mem_site(file, line, e->scope, caller);
+    mem_site_alloc(e);
+
+    uint64_t  h  = mem_hash(ptr);
+    MemShard *sh = mem_shard(h);
+    pthread_mutex_lock(&sh->lock);
+    MemEntry *drop = mem_insert(sh, e, h);
+    pthread_mutex_unlock(&sh->lock);
+    if (drop) {
+        mem_site_free(drop);
+        mem_entry_delete(drop);
+    }
+}
+/* unlinks and returns the entry for ptr, NULL when it is not tracked */
+static MemEntry *mem_detach(void *ptr)
+{
+    uint64_t  h  = mem_hash(ptr);
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+    if (!mem_filter_maybe(h)) {
+        return NULL;    /* never sampled: skip the shard lock */
+    }
+#endif
+    MemShard *sh = mem_shard(h);
+    pthread_mutex_lock(&sh->lock);
+    MemEntry *e = mem_take(sh, ptr, h);
+    pthread_mutex_unlock(&sh->lock);
+    return e;
+}
+
+/* puts a detached entry back under its own address */
+static void mem_reattach(MemEntry *e)
+{
+    if (!e) {
+        return;
+    }
+    uint64_t  h  = mem_hash(e->ptr);
+    MemShard *sh = mem_shard(h);
+    pthread_mutex_lock(&sh->lock);
+    MemEntry *drop = mem_insert(sh, e, h);
+    pthread_mutex_unlock(&sh->lock);
+    if (drop) {
+        mem_site_free(drop);
+        mem_entry_delete(drop);
+    }
+}
+
+/* realloc counts as a free at the block's current site and an allocation at
+ * the realloc call.  The caller detaches the old entry before the realloc, so
+ * another thread handed the released address cannot lose its entry to us,
+ * and reattaches it when the realloc fails; newptr NULL drops it. */
+static void mem_update(MemEntry *e, void *newptr, size_t newsize, const char *file, int line, const void *caller)
+{
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+    /* the new block is a new draw; a sampled old block just leaves the sample */
+    if (e) {
+        mem_site_free(e);
+        mem_entry_delete(e);
+    }
+    mem_add(newptr, newsize, file, line, caller);
+#else
+    if (!e) {
+        return;
+    }
+    mem_site_free(e);
+    if (!newptr) {
+        mem_entry_delete(e);
+        return;
+    }
+    e->ptr  = newptr;
+    e->size = newsize;
+    e->slack = mem_slack(newptr, newsize);
+    e->site_ns = get_time_ns();
+    uint32_t scope = 0;
+    if (!caller) {
+        PathStack *ps = pathstack_peek();
+        scope = ps ? ps->scope : 0;
+    }
+    e->site = mem_site(file, line, scope, caller);
+    mem_site_alloc(e);
+    mem_reattach(e);
+#endif
+}
+static bool mem_remove(void *ptr)
+{
+    MemEntry *dead = mem_detach(ptr);
+    if (!dead) {
+        return false;
+    }
+    mem_site_free(dead);
+    mem_entry_delete(dead);
+    return true;
+}
+
+/* ------------------------- Trace recording -------------------------- */
+/*  TKLOG_TRACE: every finished timer span and scope is appended to a ring
+ *  of the recording thread as {start, duration, file, line}; only the owner
+ *  writes its ring, so recording takes no lock.  tklog_trace_write() turns
+ *  the rings into Chrome trace-event JSON.  A thread's ring outlives the
+ *  thread, up to TKLOG_TRACE_KEEP_EXITED exited rings, oldest freed first. */
+#ifdef TKLOG_TRACE
+    #ifndef TKLOG_TRACE_EVENTS
+        #define TKLOG_TRACE_EVENTS 16384    /* spans kept per thread, power of two */
+    #endif
+    #ifndef TKLOG_TRACE_DEPTH
+        #define TKLOG_TRACE_DEPTH 64        /* nested scopes traced per thread */
+    #endif
+    #ifndef TKLOG_TRACE_KEEP_EXITED
+        #define TKLOG_TRACE_KEEP_EXITED 64  /* rings of exited threads kept for writing */
+    #endif
+    #if (TKLOG_TRACE_EVENTS & (TKLOG_TRACE_EVENTS - 1)) != 0
+        #error "TKLOG_TRACE_EVENTS must be a power of two"
+    #endif
+
+    enum { TRACE_TIMER, TRACE_SCOPE };
+
+    typedef struct TraceEvent {
+        uint64_t    start_ns;
+        uint64_t    dur_ns;
+        const char *file;
+        uint32_t    line;
+        uint32_t    kind;       /* TRACE_* */
+    } TraceEvent;
+
+    typedef struct TraceOpen {
+        uint64_t    start_ns;
+        const char *file;
+        int         line;
+    } TraceOpen;
+
+    typedef struct TraceRing {
+        struct TraceRing *next;                     /* registry link, g_trace_lock */
+        uint64_t          thread;                   /* pthread_self(), as in log lines */
+        uint32_t          seq;                      /* trace tid */
+        int               exited;
+        uint64_t          head;                     /* events ever written */
+        unsigned          depth;                    /* open scopes, may exceed the stack */
+        TraceOpen         open[TKLOG_TRACE_DEPTH];
+        TraceEvent        events[TKLOG_TRACE_EVENTS];
+    } TraceRing;
+
+    static pthread_key_t   g_tls_trace;
+    static pthread_mutex_t g_trace_lock    = PTHREAD_MUTEX_INITIALIZER;
+    static TraceRing      *g_trace_rings   = NULL;     /* newest first */
+    static uint32_t        g_trace_seq     = 0;
+    static unsigned        g_trace_exited  = 0;
+
+    static void trace_ring_release(TraceRing *r)
+    {
+#ifdef TKLOG_MEMORY
+        original_free(r);
+#else
+        free(r);
+#endif
+    }
+
+    /* thread exit: keep the ring for tklog_trace_write(), drop the oldest
+     * exited ring once too many are kept */
+    static void trace_ring_free(void *ptr)
+    {
+        TraceRing *r = (TraceRing*)ptr;
+        TraceRing *drop = NULL;
+        pthread_mutex_lock(&g_trace_lock);
+        r->exited = 1;
+        if (++g_trace_exited > TKLOG_TRACE_KEEP_EXITED) {
+            TraceRing **link = NULL;
+            for (TraceRing **it = &g_trace_rings; *it; it = &(*it)->next) {
+                if ((*it)->exited) link = it;
+            }
+            drop  = *link;
+            *link = drop->next;
+            g_trace_exited--;
+        }
+        pthread_mutex_unlock(&g_trace_lock);
+        if (drop) {
+            trace_ring_release(drop);
+        }
+    }
+
+    static TraceRing *trace_ring(void)
+    {
+        TraceRing *r = pthread_getspecific(g_tls_trace);
+        if (__builtin_expect(r != NULL, 1)) {
+            return r;
+        }
+#ifdef TKLOG_MEMORY
+        r = (TraceRing*)original_calloc(1, sizeof(TraceRing));
+#else
+        r = (TraceRing*)calloc(1, sizeof(TraceRing));
+#endif
+        if (!r) {
+            printf("tklog: out of memory for TraceRing\n");
+            return NULL;
+        }
+        r->thread = (uint64_t)pthread_self();
+        pthread_mutex_lock(&g_trace_lock);
+        r->seq        = ++g_trace_seq;
+        r->next       = g_trace_rings;
+        g_trace_rings = r;
+        pthread_mutex_unlock(&g_trace_lock);
+        pthread_setspecific(g_tls_trace, r);
+        return r;
+    }
+
+    static void trace_span(TraceRing *r, uint32_t kind, const char *file, int line, uint64_t start_ns, uint64_t end_ns)
+    {
+        uint64_t    head = r->head;
+        TraceEvent *e    = &r->events[head & (TKLOG_TRACE_EVENTS - 1)];
+        /* tklog_trace_write() may be copying this slot: a copy that sees any
+         * of these stores (release) also sees the head that preceded them */
+        __atomic_store_n(&e->start_ns, start_ns, __ATOMIC_RELEASE);
+        __atomic_store_n(&e->dur_ns, end_ns > start_ns ? end_ns - start_ns : 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&e->file, file, __ATOMIC_RELEASE);
+        __atomic_store_n(&e->line, (uint32_t)line, __ATOMIC_RELEASE);
+        __atomic_store_n(&e->kind, kind, __ATOMIC_RELEASE);
+        __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    static void trace_scope_begin(const char *file, int line)
+    {
+        TraceRing *r = trace_ring();
+        if (!r) return;
+        if (r->depth < TKLOG_TRACE_DEPTH) {
+            r->open[r->depth] = (TraceOpen){ get_time_ns(), file, line };
+        }
+        r->depth++;
+    }
+
+    static void trace_scope_end(void)
+    {
+        TraceRing *r = pthread_getspecific(g_tls_trace);
+        if (!r || !r->depth) return;
+        if (--r->depth < TKLOG_TRACE_DEPTH) {
+            const TraceOpen *o = &r->open[r->depth];
+            trace_span(r, TRACE_SCOPE, o->file, o->line, o->start_ns, get_time_ns());
+        }
+    }
+#endif
+
+/* ------------------------- Time tracing ----------------------------- */
+/*  Every tklog_timer_start()/stop() expansion owns a static descriptor that
+ *  is given a small id on its first call.  A thread keeps a fixed stack of
+ *  (site, scope, start ns) frames and per-id totals; a call path - start
+ *  scope and site, stop scope and site - is interned into a global table
+ *  and counted by its id.  Start and stop therefore allocate nothing and
+ *  touch no strings; names are formatted only by tklog_timer_print().
+ *  Every thread's state is linked into a registry so tklog_timer_print_all()
+ *  can sum the live shards; a thread that exits folds its totals into
+ *  g_timer_exited first.  Only the owner writes a shard, with relaxed
+ *  atomic stores, so recording never takes a lock.
+ *  Each site and path also keeps exact min/max and a log-linear histogram:
+ *  16 linear sub-buckets per power of two of nanoseconds (<= 6.25% bucket
+ *  width), which sums bucket-wise across threads.  Histograms are handed
+ *  out in chunks allocated as sites and paths are first timed; a chunk is
+ *  published before any slot in it, so readers never see it move.
+ *  For flame graphs, each open timer is also interned as a stack node
+ *  {scope, site, enclosing node}; its time minus that of the timers
+ *  nested in it is its self time, written by tklog_timer_write_folded().  */
+#ifdef TKLOG_TIMER
+    #ifndef TKLOG_TIMER_SITES
+        #define TKLOG_TIMER_SITES 1024      /* start/stop macro sites, process-wide */
+    #endif
+    #ifndef TKLOG_TIMER_PATHS
+        #define TKLOG_TIMER_PATHS 4096      /* distinct call paths, power of two */
+    #endif
+    #ifndef TKLOG_TIMER_DEPTH
+        #define TKLOG_TIMER_DEPTH 64        /* nested timers per thread */
+    #endif
+    #if (TKLOG_TIMER_PATHS & (TKLOG_TIMER_PATHS - 1)) != 0
+        #error "TKLOG_TIMER_PATHS must be a power of two"
+    #endif
+    #ifndef TKLOG_TIMER_HISTOGRAMS          /* histograms per thread; later sites/paths get min/max only */
+        #define TKLOG_TIMER_HISTOGRAMS (TKLOG_TIMER_SITES + TKLOG_TIMER_PATHS)
+    #endif
+    #define TIMER_NO_ID UINT32_MAX          /* site table full */
+
+    #define TIMER_HIST_SUB_BITS 4
+    #define TIMER_HIST_SUB      (1u << TIMER_HIST_SUB_BITS)
+    #define TIMER_HIST_TOP      35          /* 2^36 ns ~ 69 s; longer lands in the last bucket */
+    #define TIMER_HIST_BUCKETS  ((TIMER_HIST_TOP - TIMER_HIST_SUB_BITS + 2) * TIMER_HIST_SUB)
+    #define TIMER_HIST_CHUNK    16          /* histograms per allocation */
+    #define TIMER_HIST_SLOTS    (TKLOG_TIMER_SITES + TKLOG_TIMER_PATHS)     /* one per stat at most */
+    #define TIMER_HIST_CHUNKS   ((TIMER_HIST_SLOTS + TIMER_HIST_CHUNK - 1) / TIMER_HIST_CHUNK)
+    #define TIMER_HIST_MAX      (TKLOG_TIMER_HISTOGRAMS < TIMER_HIST_SLOTS ? TKLOG_TIMER_HISTOGRAMS : TIMER_HIST_SLOTS)
+
+    typedef struct TimerHist {
+        uint64_t buckets[TIMER_HIST_BUCKETS];
+    } TimerHist;
+
+    /* values below 16 map to themselves; above, the top 5 significant bits */
+    static inline unsigned timer_hist_bucket(uint64_t ns)
+    {
+        if (ns < TIMER_HIST_SUB) {
+            return (unsigned)ns;
+        }
+        unsigned e = 63u - (unsigned)__builtin_clzll(ns);
+        if (e > TIMER_HIST_TOP) {
+            return TIMER_HIST_BUCKETS - 1;
+        }
+        return (e - TIMER_HIST_SUB_BITS + 1) * TIMER_HIST_SUB + (unsigned)((ns >> (e - TIMER_HIST_SUB_BITS)) & (TIMER_HIST_SUB - 1));
+    }
+
+    /* smallest value of bucket b */
+    static uint64_t timer_hist_low(unsigned b)
+    {
+        if (b < TIMER_HIST_SUB) {
+            return b;
+        }
+        unsigned shift = b / TIMER_HIST_SUB - 1;
+        return (TIMER_HIST_SUB + (uint64_t)(b % TIMER_HIST_SUB)) << shift;
+    }
+
+    /* midpoint of bucket b */
+    static uint64_t timer_hist_value(unsigned b)
+    {
+        return b < TIMER_HIST_SUB ? b : timer_hist_low(b) + ((UINT64_C(1) << (b / TIMER_HIST_SUB - 1)) >> 1);
+    }
+
+    static tklog_timer_site_t *g_timer_sites[TKLOG_TIMER_SITES];   /* by id; 0 is unused */
+    static uint32_t            g_timer_nsites = 1;
+    static pthread_mutex_t     g_timer_lock   = PTHREAD_MUTEX_INITIALIZER;
+
+    typedef struct TimerPath {
+        uint32_t start_scope;
+        uint32_t start_site;
+        uint32_t stop_scope;
+        uint32_t stop_site;
+    } TimerPath;
+
+    typedef struct TimerKeys {
+        uint32_t  count;                            /* next free id */
+        TimerPath keys[TKLOG_TIMER_PATHS];
+        uint32_t  slots[2 * TKLOG_TIMER_PATHS];     /* hash -> id, 0 = empty */
+    } TimerKeys;
+
+    static TimerKeys g_timer_paths  = { .count = 1 };
+    /* stack nodes reuse the key: { scope, site, enclosing node, 0 } */
+    static TimerKeys g_timer_stacks = { .count = 1 };
+
+    typedef struct TimerStat {
+        uint64_t total_ns;
+        uint64_t count;
+        uint64_t min_ns;
+        uint64_t max_ns;
+        uint32_t hist;      /* histogram slot of the owning TimerTotals, 0 = none */
+    } TimerStat;
+
+    typedef struct TimerFrame {
+        uint32_t site;
+        uint32_t scope;
+        uint64_t start_ns;
+        uint32_t node;          /* in g_timer_stacks, 0 = untracked */
+        uint64_t child_ns;      /* time of the timers nested in this one */
+    } TimerFrame;
+
+    typedef struct TimerTotals {
+        TimerStat  sites[TKLOG_TIMER_SITES];        /* by start site id */
+        TimerStat  paths[TKLOG_TIMER_PATHS];        /* by call path id  */
+        uint64_t   self_ns[TKLOG_TIMER_PATHS];      /* by stack node id */
+        uint32_t   nhist;                           /* slots 1..nhist handed out */
+        bool       interval;                        /* reporter delta: min/max without a histogram are lifetime */
+        TimerHist *chunks[TIMER_HIST_CHUNKS];       /* slot h lives in chunk (h - 1) / TIMER_HIST_CHUNK */
+    } TimerTotals;
+
+    /* per-thread memo of recently interned keys; ids never change */
+    #define TIMER_KEY_CACHE 64
+    typedef struct TimerKeyCache {
+        TimerPath key;
+        uint32_t  id;
+    } TimerKeyCache;
+
+    typedef struct TimerState {
+        struct TimerState *next;                    /* registry link, g_timer_lock */
+        struct TimerState *prev;
+        unsigned           depth;
+        unsigned           overflow;                /* starts beyond TKLOG_TIMER_DEPTH */
+        TimerFrame         stack[TKLOG_TIMER_DEPTH];
+        TimerKeyCache      path_cache[TIMER_KEY_CACHE];
+        TimerKeyCache      stack_cache[TIMER_KEY_CACHE];
+        TimerTotals        totals;
+    } TimerState;
+
+    static pthread_key_t g_tls_timer_state;
+    static TimerState   *g_timer_threads = NULL;   /* live shards,        g_timer_lock */
+    static TimerTotals   g_timer_exited;           /* from exited threads, g_timer_lock */
+
+    static inline TimerHist *timer_hist(const TimerTotals *t, uint32_t h)
+    {
+        TimerHist *chunk = __atomic_load_n(&t->chunks[(h - 1) / TIMER_HIST_CHUNK], __ATOMIC_ACQUIRE);
+        return &chunk[(h - 1) % TIMER_HIST_CHUNK];
+    }
+
+    /* a fresh zeroed histogram slot, 0 past max or when out of memory; the
+     * owner of t only, or a merge target under g_timer_lock */
+    static uint32_t timer_hist_slot(TimerTotals *t, uint32_t max)
+    {
+        if (t->nhist >= max) {
+            return 0;
+        }
+        uint32_t    h     = t->nhist + 1;
+        TimerHist **chunk = &t->chunks[(h - 1) / TIMER_HIST_CHUNK];
+        if (!*chunk) {
+#ifdef TKLOG_MEMORY
+            TimerHist *fresh = (TimerHist*)original_calloc(TIMER_HIST_CHUNK, sizeof(TimerHist));
+#else
+            TimerHist *fresh = (TimerHist*)calloc(TIMER_HIST_CHUNK, sizeof(TimerHist));
+#endif
+            if (!fresh) {
+                return 0;
+            }
+            __atomic_store_n(chunk, fresh, __ATOMIC_RELEASE);
+        }
+        t->nhist = h;
+        return h;
+    }
+
+    static void timer_hist_free(TimerTotals *t)
+    {
+        for (size_t c = 0; c < TIMER_HIST_CHUNKS && t->chunks[c]; ++c) {
+#ifdef TKLOG_MEMORY
+            original_free(t->chunks[c]);
+#else
+            free(t->chunks[c]);
+#endif
+        }
+    }
+
+    /* owner only */
+    static inline void timer_record(TimerTotals *t, TimerStat *st, uint64_t ns)
+    {
+        uint64_t count = __atomic_load_n(&st->count, __ATOMIC_RELAXED);
+        if (!count || ns < st->min_ns) __atomic_store_n(&st->min_ns, ns, __ATOMIC_RELAXED);
+        if (ns > st->max_ns)           __atomic_store_n(&st->max_ns, ns, __ATOMIC_RELAXED);
+        uint32_t h = st->hist;
+        if (__builtin_expect(!h, 0) && (h = timer_hist_slot(t, TIMER_HIST_MAX))) {
+            __atomic_store_n(&st->hist, h, __ATOMIC_RELEASE);
+        }
+        if (h) {
+            uint64_t *bucket = &timer_hist(t, h)->buckets[timer_hist_bucket(ns)];
+            __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&st->total_ns, __atomic_load_n(&st->total_ns, __ATOMIC_RELAXED) + ns, __ATOMIC_RELAXED);
+        /* release: a reader that sees the count also sees the interned path */
+        __atomic_store_n(&st->count, count + 1, __ATOMIC_RELEASE);
+    }
+
+    /* d += s; dst is private or guarded by g_timer_lock, src may be live */
+    static void timer_stat_merge(TimerTotals *dst, TimerStat *d, const TimerTotals *src, const TimerStat *s)
+    {
+        uint64_t count = __atomic_load_n(&s->count, __ATOMIC_ACQUIRE);
+        if (!count) {
+            return;
+        }
+        uint64_t min = __atomic_load_n(&s->min_ns, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+        if (!d->count || min < d->min_ns) d->min_ns = min;
+        if (max > d->max_ns)              d->max_ns = max;
+        d->total_ns += __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+        d->count    += count;
+
+        uint32_t sh = __atomic_load_n(&s->hist, __ATOMIC_ACQUIRE);
+        if (!sh) {
+            return;
+        }
+        if (!d->hist && !(d->hist = timer_hist_slot(dst, TIMER_HIST_SLOTS))) {
+            return;
+        }
+        uint64_t       *to   = timer_hist(dst, d->hist)->buckets;
+        const uint64_t *from = timer_hist(src, sh)->buckets;
+        for (unsigned b = 0; b < TIMER_HIST_BUCKETS; ++b) {
+            to[b] += __atomic_load_n(&from[b], __ATOMIC_RELAXED);
+        }
+    }
+
+    /* dst += src for every used site and path */
+    static void timer_totals_merge(TimerTotals *dst, const TimerTotals *src)
+    {
+        uint32_t nsites = __atomic_load_n(&g_timer_nsites, __ATOMIC_ACQUIRE);
+        uint32_t npaths = __atomic_load_n(&g_timer_paths.count, __ATOMIC_ACQUIRE);
+        npaths = npaths < TKLOG_TIMER_PATHS ? npaths : TKLOG_TIMER_PATHS;
+        for (uint32_t id = 1; id < nsites; ++id) {
+            timer_stat_merge(dst, &dst->sites[id], src, &src->sites[id]);
+        }
+        for (uint32_t p = 1; p < npaths; ++p) {
+            timer_stat_merge(dst, &dst->paths[p], src, &src->paths[p]);
+        }
+        uint32_t nstacks = __atomic_load_n(&g_timer_stacks.count, __ATOMIC_ACQUIRE);
+        nstacks = nstacks < TKLOG_TIMER_PATHS ? nstacks : TKLOG_TIMER_PATHS;
+        for (uint32_t n = 1; n < nstacks; ++n) {
+            dst->self_ns[n] += __atomic_load_n(&src->self_ns[n], __ATOMIC_ACQUIRE);
+        }
+    }
+
+    static void timer_state_free(void *ptr) {
+        TimerState *ts = (TimerState*)ptr;
+        pthread_mutex_lock(&g_timer_lock);
+        timer_totals_merge(&g_timer_exited, &ts->totals);
+        if (ts->prev) ts->prev->next = ts->next;
+        else          g_timer_threads = ts->next;
+        if (ts->next) ts->next->prev = ts->prev;
+        pthread_mutex_unlock(&g_timer_lock);
+        timer_hist_free(&ts->totals);
+#ifdef TKLOG_MEMORY
+        original_free(ts);
+#else
+        free(ts);
+#endif
+    }
+
+    static TimerState *get_timer_state(void) {
+        TimerState *ts = pthread_getspecific(g_tls_timer_state);
+        if (!ts) {
+#ifdef TKLOG_MEMORY
+            ts = (TimerState*)original_calloc(1, sizeof(TimerState));
+#else
+            ts = (TimerState*)calloc(1, sizeof(TimerState));
+#endif
+            if (!ts) {
+                printf("tklog: out of memory for TimerState\n");
+                return NULL;
+            }
+            pthread_mutex_lock(&g_timer_lock);
+            ts->next = g_timer_threads;
+            if (g_timer_threads) g_timer_threads->prev = ts;
+            g_timer_threads = ts;
+            pthread_mutex_unlock(&g_timer_lock);
+            pthread_setspecific(g_tls_timer_state, ts);
+        }
+        return ts;
+    }
+
+    static uint32_t timer_site_id(tklog_timer_site_t *site)
+    {
+        uint32_t id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+        if (__builtin_expect(id != 0, 1)) {
+            return id;
+        }
+        pthread_mutex_lock(&g_timer_lock);
+        id = site->id;
+        if (!id) {
+            id = g_timer_nsites < TKLOG_TIMER_SITES ? g_timer_nsites : TIMER_NO_ID;
+            if (id != TIMER_NO_ID) {
+                const char *file = strrchr(site->file, '/');
+                site->name = file ? file + 1 : site->file;
+                g_timer_sites[id] = site;
+                __atomic_store_n(&g_timer_nsites, id + 1, __ATOMIC_RELEASE);
+            }
+            __atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&g_timer_lock);
+        return id;
+    }
+
+    /* lock-free like scope_intern; 0 once the table is full */
+    static uint32_t timer_intern(TimerKeys *t, TimerPath key)
+    {
+        uint64_t h = ((uint64_t)key.start_scope << 32 | key.start_site) * 0x9E3779B97F4A7C15ULL
+                   ^ ((uint64_t)key.stop_scope  << 32 | key.stop_site);
+        h ^= h >> 29;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 32;
+        size_t mask = 2 * TKLOG_TIMER_PATHS - 1;
+        size_t i    = (size_t)h & mask;
+        for (size_t n = 0; n <= mask; ++n, i = (i + 1) & mask) {
+            uint32_t id = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+            if (!id) {
+                if (__atomic_load_n(&t->count, __ATOMIC_RELAXED) >= TKLOG_TIMER_PATHS) {
+                    return 0;
+                }
+                uint32_t fresh = __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+                if (fresh >= TKLOG_TIMER_PATHS) {
+                    return 0;
+                }
+                t->keys[fresh] = key;
+                if (__atomic_compare_exchange_n(&t->slots[i], &id, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    return fresh;
+                }
+                /* lost the slot; the id stays unused */
+            }
+            const TimerPath *p = &t->keys[id];
+            if (p->start_site == key.start_site && p->stop_site == key.stop_site &&
+                p->start_scope == key.start_scope && p->stop_scope == key.stop_scope) {
+                return id;
+            }
+        }
+        return 0;
+    }
+
+    static inline uint32_t timer_intern_cached(TimerKeys *t, TimerKeyCache *cache, TimerPath key)
+    {
+        TimerKeyCache *c = &cache[(key.start_site * 31u + key.stop_site * 7u + key.start_scope + key.stop_scope * 3u) & (TIMER_KEY_CACHE - 1)];
+        if (c->id && c->key.start_site == key.start_site && c->key.stop_site == key.stop_site &&
+            c->key.start_scope == key.start_scope && c->key.stop_scope == key.stop_scope) {
+            return c->id;
+        }
+        uint32_t id = timer_intern(t, key);
+        if (id) {
+            c->key = key;
+            c->id  = id;
+        }
+        return id;
+    }
+
+    static inline uint32_t timer_scope(void)
+    {
+        PathStack *ps = pthread_getspecific(g_tls_path);
+        return ps ? ps->scope : 0;
+    }
+
+    static void timer_stat_reset(TimerStat *st)
+    {
+        __atomic_store_n(&st->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->min_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->max_ns, 0, __ATOMIC_RELAXED);
+    }
+
+    /* owner only; print_all may be reading the totals concurrently, so
+     * histogram slots stay assigned and are only zeroed */
+    static void timer_reset(TimerState *ts)
+    {
+        ts->depth    = 0;
+        ts->overflow = 0;
+        for (size_t i = 0; i < TKLOG_TIMER_SITES; ++i) {
+            timer_stat_reset(&ts->totals.sites[i]);
+        }
+        for (size_t i = 0; i < TKLOG_TIMER_PATHS; ++i) {
+            timer_stat_reset(&ts->totals.paths[i]);
+            __atomic_store_n(&ts->totals.self_ns[i], 0, __ATOMIC_RELAXED);
+        }
+        for (uint32_t h = 1; h <= ts->totals.nhist; ++h) {
+            for (unsigned b = 0; b < TIMER_HIST_BUCKETS; ++b) {
+                __atomic_store_n(&timer_hist(&ts->totals, h)->buckets[b], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    void _tklog_timer_init() {
+        tklog_init_once();
+        TimerState *ts = get_timer_state();
+        if (ts) {
+            timer_reset(ts);
+        }
+    }
+    void _tklog_timer_start(tklog_timer_site_t *site) {
+        tklog_init_once();
+        TimerState *ts = get_timer_state();
+        if (!ts) return;
+        if (ts->depth == TKLOG_TIMER_DEPTH) {
+            ts->overflow++;
+            return;
+        }
+        uint32_t    id     = timer_site_id(site);
+        uint32_t    parent = ts->depth ? ts->stack[ts->depth - 1].node : 0;
+        bool        nested = ts->depth != 0;
+        TimerFrame *f      = &ts->stack[ts->depth++];
+        f->site     = id == TIMER_NO_ID ? 0 : id;
+        f->scope    = timer_scope();
+        f->node     = f->site && (parent || !nested) ? timer_intern_cached(&g_timer_stacks, ts->stack_cache, (TimerPath){ f->scope, f->site, parent, 0 }) : 0;
+        f->child_ns = 0;
+        f->start_ns = get_time_ns();
+    }
+    void _tklog_timer_stop(tklog_timer_site_t *site) {
+        uint64_t end_ns = get_time_ns();
+        tklog_init_once();
+        TimerState *ts = get_timer_state();
+        if (!ts) return;
+        if (ts->overflow) {
+            ts->overflow--;
+            return;
+        }
+        if (!ts->depth) {
+            printf("tklog: tklog_timer_stop is called without a corresponding tklog_timer_start beforehand\n");
+            return;
+        }
+        const TimerFrame *f = &ts->stack[--ts->depth];
+        uint64_t delta = end_ns > f->start_ns ? end_ns - f->start_ns : 0;
+        if (ts->depth) {
+            ts->stack[ts->depth - 1].child_ns += delta;
+        }
+        if (f->node) {
+            /* release: a reader that sees the time also sees the node */
+            uint64_t *self = &ts->totals.self_ns[f->node];
+            __atomic_store_n(self, *self + (delta > f->child_ns ? delta - f->child_ns : 0), __ATOMIC_RELEASE);
+        }
+        if (!f->site) {
+            return;
+        }
+        timer_record(&ts->totals, &ts->totals.sites[f->site], delta);
+#ifdef TKLOG_TRACE
+        TraceRing *r = trace_ring();
+        if (r) {
+            trace_span(r, TRACE_TIMER, g_timer_sites[f->site]->name, g_timer_sites[f->site]->line, f->start_ns, end_ns);
+        }
+#endif
+
+        uint32_t stop = timer_site_id(site);
+        if (stop == TIMER_NO_ID) {
+            return;
+        }
+        uint32_t path = timer_intern_cached(&g_timer_paths, ts->path_cache, (TimerPath){ f->scope, f->site, timer_scope(), stop });
+        if (path) {
+            timer_record(&ts->totals, &ts->totals.paths[path], delta);
+        }
+    }
+
+    /* "a.c:12 → b.c:88 → file:line" for a site reached under scope */
+    static size_t timer_format_site(uint32_t scope, uint32_t id, char *out, size_t o, size_t cap)
+    {
+        const tklog_timer_site_t *site = g_timer_sites[id];
+        size_t at = o;
+        o = scope_format(scope, out, o, cap);
+        int n = snprintf(out + o, cap - o, "%s%s:%d", o > at ? " → " : "", site->name, site->line);
+        return n < 0 ? o : (o + (size_t)n < cap ? o + (size_t)n : cap - 1);
+    }
+
+    static int timer_ns_label(char *out, size_t cap, uint64_t ns)
+    {
+        if (ns < 1000ULL)       return snprintf(out, cap, "%" PRIu64 "ns", ns);
+        if (ns < 1000000ULL)    return snprintf(out, cap, "%.4gus", (double)ns / 1e3);
+        if (ns < 1000000000ULL) return snprintf(out, cap, "%.4gms", (double)ns / 1e6);
+        return snprintf(out, cap, "%.4gs", (double)ns / 1e9);
+    }
+
+    /* "min … p50 … p90 … p99 … p99.9 … max … | "; without a histogram
+     * (TKLOG_TIMER_HISTOGRAMS used up, or out of memory) "percentiles n/a",
+     * and in an interval report min/max are then labelled lifetime values */
+    static size_t timer_put_latency(char *out, size_t o, size_t cap, const TimerTotals *t, const TimerStat *st)
+    {
+        static const struct { unsigned per_mille; const char *name; } q[] = {
+            { 500, "p50" }, { 900, "p90" }, { 990, "p99" }, { 999, "p99.9" } };
+        char label[24];
+        timer_ns_label(label, sizeof label, st->min_ns);
+        o += (size_t)snprintf(out + o, cap - o, "%smin %s ", t->interval && !st->hist ? "lifetime " : "", label);
+        if (!st->hist) {
+            o += (size_t)snprintf(out + o, cap - o, "percentiles n/a ");
+        } else {
+            const uint64_t *buckets = timer_hist(t, st->hist)->buckets;
+            uint64_t total = 0;
+            for (unsigned b = 0; b < TIMER_HIST_BUCKETS; ++b) {
+                total += buckets[b];
+            }
+            uint64_t seen = 0;
+            unsigned b = 0;
+            for (size_t i = 0; i < sizeof q / sizeof q[0] && total && o < cap; ++i) {
+                uint64_t rank = (total * q[i].per_mille + 999) / 1000;
+                while (b < TIMER_HIST_BUCKETS - 1 && seen + buckets[b] < rank) {
+                    seen += buckets[b++];
+                }
+                uint64_t v = timer_hist_value(b);
+                v = v < st->min_ns ? st->min_ns : (v > st->max_ns ? st->max_ns : v);
+                timer_ns_label(label, sizeof label, v);
+                o += (size_t)snprintf(out + o, cap - o, "%s %s ", q[i].name, label);
+            }
+        }
+        if (o < cap) {
+            timer_ns_label(label, sizeof label, st->max_ns);
+            o += (size_t)snprintf(out + o, cap - o, "max %s | ", label);
+        }
+        return o < cap ? o : cap - 1;
+    }
+
+    static void timer_print_totals(const TimerTotals *t) {
+        uint32_t nsites = __atomic_load_n(&g_timer_nsites, __ATOMIC_ACQUIRE);
+        uint32_t npaths = __atomic_load_n(&g_timer_paths.count, __ATOMIC_ACQUIRE);
+        npaths = npaths < TKLOG_TIMER_PATHS ? npaths : TKLOG_TIMER_PATHS;
+        uint64_t max_time_ms = 0;
+        uint64_t max_calls = 0;
+        for (uint32_t id = 1; id < nsites; ++id) {
+            uint64_t time_ms = t->sites[id].total_ns / 1000000;
+            if (time_ms > max_time_ms) max_time_ms = time_ms;
+            if (t->sites[id].count > max_calls) max_calls = t->sites[id].count;
+        }
+        int time_digits = snprintf(NULL, 0, "%" PRIu64, max_time_ms);
+        int calls_digits = snprintf(NULL, 0, "%" PRIu64, max_calls);
+        for (uint32_t id = 1; id < nsites; ++id) {
+            const TimerStat *st = &t->sites[id];
+            if (!st->count) {
+                continue;
+            }
+            char   linebuf[TKLOG_MSG_MAX];
+            size_t o = (size_t)snprintf(linebuf, sizeof linebuf, "%*" PRIu64 "ms | %*" PRIu64 " calls | %.3fms avg | ",
+                                        time_digits, st->total_ns / 1000000, calls_digits, st->count,
+                                        (double)st->total_ns / (double)st->count / 1e6);
+            o = timer_put_latency(linebuf, o, sizeof linebuf, t, st);
+            snprintf(linebuf + o, sizeof linebuf - o, "%s:%d\n", g_timer_sites[id]->name, g_timer_sites[id]->line);
+            tklog_emit(TKLOG_LEVEL_INFO, linebuf, strlen(linebuf));
+            for (uint32_t p = 1; p < npaths; ++p) {
+                const TimerPath *path = &g_timer_paths.keys[p];
+                const TimerStat *cp   = &t->paths[p];
+                if (!cp->count || path->start_site != id) {
+                    continue;
+                }
+                o = (size_t)snprintf(linebuf, sizeof linebuf, "%*" PRIu64 "ms | %*" PRIu64 " calls | %.3fms avg | ",
+                                     time_digits, cp->total_ns / 1000000, calls_digits, cp->count,
+                                     (double)cp->total_ns / (double)cp->count / 1e6);
+                o = timer_put_latency(linebuf, o, sizeof linebuf - 1, t, cp);
+                o += (size_t)snprintf(linebuf + o, sizeof linebuf - 1 - o, "    ");
+                o = timer_format_site(path->start_scope, path->start_site, linebuf, o, sizeof linebuf - 1);
+                o += (size_t)snprintf(linebuf + o, sizeof linebuf - 1 - o, " to ");
+                o = timer_format_site(path->stop_scope, path->stop_site, linebuf, o, sizeof linebuf - 1);
+                linebuf[o++] = '\n';
+                linebuf[o]   = '\0';
+                tklog_emit(TKLOG_LEVEL_INFO, linebuf, o);
+            }
+        }
+    }
+    void tklog_timer_print() {
+        TimerState *ts = get_timer_state();
+        if (!ts) return;
+        timer_print_totals(&ts->totals);
+    }
+    /* exited threads plus every live shard, read without stopping them */
+    static TimerTotals *timer_sum_all(void) {
+#ifdef TKLOG_MEMORY
+        TimerTotals *sum = (TimerTotals*)original_calloc(1, sizeof(TimerTotals));
+#else
+        TimerTotals *sum = (TimerTotals*)calloc(1, sizeof(TimerTotals));
+#endif
+        if (!sum) {
+            printf("tklog: out of memory for the merged timer totals\n");
+            return NULL;
+        }
+        pthread_mutex_lock(&g_timer_lock);
+        timer_totals_merge(sum, &g_timer_exited);
+        for (const TimerState *ts = g_timer_threads; ts; ts = ts->next) {
+            timer_totals_merge(sum, &ts->totals);
+        }
+        pthread_mutex_unlock(&g_timer_lock);
+        return sum;
+    }
+    static void timer_sum_free(TimerTotals *sum) {
+        timer_hist_free(sum);
+#ifdef TKLOG_MEMORY
+        original_free(sum);
+#else
+        free(sum);
+#endif
+    }
+    void tklog_timer_print_all() {
+        tklog_init_once();
+        TimerTotals *sum = timer_sum_all();
+        if (sum) {
+            timer_print_totals(sum);
+            timer_sum_free(sum);
+        }
+    }
+
+    /* "scope;scope;…;site" frames of a stack node, outermost first; only the
+     * scopes entered since the enclosing timer started are repeated */
+    static size_t timer_format_stack(uint32_t node, char *out, size_t o, size_t cap)
+    {
+        const TimerPath *k      = &g_timer_stacks.keys[node];
+        uint32_t         parent = k->stop_scope;    /* enclosing node */
+        uint32_t         outer  = 0;
+        if (parent) {
+            o = timer_format_stack(parent, out, o, cap);
+            if (o + 1 < cap) out[o++] = ';';
+            outer = g_timer_stacks.keys[parent].start_scope;
+        }
+        const ScopeTable *scopes = __atomic_load_n(&g_scopes, __ATOMIC_ACQUIRE);
+        uint32_t chain[64];
+        unsigned n = 0;
+        for (uint32_t id = k->start_scope; id && id != outer && n < 64; id = scopes->nodes[id].parent) {
+            chain[n++] = id;
+        }
+        while (n-- > 0) {
+            const ScopeNode *sn = &scopes->nodes[chain[n]];
+            int len = snprintf(out + o, cap - o, "%s:%d;", sn->file, sn->line);
+            o = len < 0 ? o : (o + (size_t)len < cap ? o + (size_t)len : cap - 1);
+        }
+        const tklog_timer_site_t *site = g_timer_sites[k->start_site];
+        int len = snprintf(out + o, cap - o, "%s:%d", site->name, site->line);
+        return len < 0 ? o : (o + (size_t)len < cap ? o + (size_t)len : cap - 1);
+    }
+
+    int tklog_timer_write_folded(const char *path) {
+        tklog_init_once();
+        FILE *f = fopen(path, "w");
+        if (!f) {
+            return -1;
+        }
+        TimerTotals *sum = timer_sum_all();
+        if (!sum) {
+            fclose(f);
+            return -1;
+        }
+        bool     ok      = true;
+        uint32_t nstacks = __atomic_load_n(&g_timer_stacks.count, __ATOMIC_ACQUIRE);
+        nstacks = nstacks < TKLOG_TIMER_PATHS ? nstacks : TKLOG_TIMER_PATHS;
+        for (uint32_t n = 1; n < nstacks && ok; ++n) {
+            uint64_t us = sum->self_ns[n] / 1000;
+            if (!us) {
+                continue;
+            }
+            char   line[TKLOG_MSG_MAX];
+            size_t o = timer_format_stack(n, line, 0, sizeof line - 24);
+            o += (size_t)snprintf(line + o, sizeof line - o, " %" PRIu64 "\n", us);
+            ok = fwrite(line, 1, o, f) == o;
+        }
+        timer_sum_free(sum);
+        return fclose(f) == 0 && ok ? 0 : -1;
+    }
+
+    /* TKLOG_TIMER_REPORT_MS: a background thread prints, every interval,
+     * what the timers of all threads recorded since the previous one.  It
+     * diffs merged totals against the last merge instead of resetting the
+     * shards, so recording threads are never paused.                    */
+#ifdef TKLOG_TIMER_REPORT_MS
+    static pthread_t       g_timer_report_thread;
+    static pthread_mutex_t g_timer_report_mutex   = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_cond_t  g_timer_report_wake    = PTHREAD_COND_INITIALIZER;
+    static bool            g_timer_report_running = false;
+    static TimerTotals    *g_timer_report_prev    = NULL;  /* reporter thread only */
+    static uint64_t        g_timer_report_ns      = 0;
+
+    /* a shard cleared in between makes a counter go back; count it anew */
+    static inline uint64_t timer_since(uint64_t cur, uint64_t prev)
+    {
+        return cur >= prev ? cur - prev : cur;
+    }
+
+    /* d = c - p; with a histogram, min/max are narrowed to the bounds of the
+     * interval's lowest and highest buckets, without one they stay the
+     * lifetime values and are printed as such */
+    static void timer_stat_delta(TimerTotals *dst, TimerStat *d, const TimerTotals *cur, const TimerStat *c,
+                                 const TimerTotals *prev, const TimerStat *p)
+    {
+        d->count    = timer_since(c->count, p ? p->count : 0);
+        d->total_ns = timer_since(c->total_ns, p ? p->total_ns : 0);
+        d->min_ns   = c->min_ns;
+        d->max_ns   = c->max_ns;
+        if (!d->count || !c->hist || !(d->hist = timer_hist_slot(dst, TIMER_HIST_SLOTS))) {
+            return;
+        }
+        const uint64_t *from = timer_hist(cur, c->hist)->buckets;
+        const uint64_t *base = p && p->hist ? timer_hist(prev, p->hist)->buckets : NULL;
+        uint64_t       *to   = timer_hist(dst, d->hist)->buckets;
+        unsigned        low  = TIMER_HIST_BUCKETS, high = 0;
+        for (unsigned b = 0; b < TIMER_HIST_BUCKETS; ++b) {
+            to[b] = timer_since(from[b], base ? base[b] : 0);
+            if (to[b]) {
+                low  = b < low ? b : low;
+                high = b;
+            }
+        }
+        if (low < TIMER_HIST_BUCKETS) {
+            uint64_t lo = timer_hist_low(low);
+            uint64_t hi = high + 1 < TIMER_HIST_BUCKETS ? timer_hist_low(high + 1) - 1 : UINT64_MAX;
+            d->min_ns = lo > c->min_ns ? lo : c->min_ns;
+            d->max_ns = hi < c->max_ns ? hi : c->max_ns;
+        }
+    }
+
+    static void timer_report_interval(void)
+    {
+        TimerTotals *cur = timer_sum_all();
+#ifdef TKLOG_MEMORY
+        TimerTotals *delta = (TimerTotals*)original_calloc(1, sizeof(TimerTotals));
+#else
+        TimerTotals *delta = (TimerTotals*)calloc(1, sizeof(TimerTotals));
+#endif
+        if (!cur || !delta) {
+            if (cur) timer_sum_free(cur);
+            if (delta) timer_sum_free(delta);
+            return;
+        }
+        delta->interval = true;
+        const TimerTotals *prev = g_timer_report_prev;
+        uint32_t nsites = __atomic_load_n(&g_timer_nsites, __ATOMIC_ACQUIRE);
+        uint32_t npaths = __atomic_load_n(&g_timer_paths.count, __ATOMIC_ACQUIRE);
+        npaths = npaths < TKLOG_TIMER_PATHS ? npaths : TKLOG_TIMER_PATHS;
+        bool any = false;
+        for (uint32_t id = 1; id < nsites; ++id) {
+            timer_stat_delta(delta, &delta->sites[id], cur, &cur->sites[id], prev, prev ? &prev->sites[id] : NULL);
+            any |= delta->sites[id].count != 0;
+        }
+        for (uint32_t p = 1; p < npaths; ++p) {
+            timer_stat_delta(delta, &delta->paths[p], cur, &cur->paths[p], prev, prev ? &prev->paths[p] : NULL);
+        }
+
+        uint64_t now = get_time_ns();
+        if (any) {
+            char linebuf[128];
+            snprintf(linebuf, sizeof linebuf, "tklog timers, last %.3fs:\n", (double)(now - g_timer_report_ns) / 1e9);
+            tklog_emit(TKLOG_LEVEL_INFO, linebuf, strlen(linebuf));
+            timer_print_totals(delta);
+        }
+        g_timer_report_ns = now;
+        timer_sum_free(delta);
+        if (g_timer_report_prev) {
+            timer_sum_free(g_timer_report_prev);
+        }
+        g_timer_report_prev = cur;
+    }
+
+    static void *timer_reporter(void *arg)
+    {
+        (void)arg;
+        pthread_mutex_lock(&g_timer_report_mutex);
+        while (g_timer_report_running) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            uint64_t ns = (uint64_t)until.tv_nsec + (uint64_t)(TKLOG_TIMER_REPORT_MS) % 1000 * 1000000ULL;
+            until.tv_sec  += (time_t)((TKLOG_TIMER_REPORT_MS) / 1000 + ns / 1000000000ULL);
+            until.tv_nsec  = (long)(ns % 1000000000ULL);
+            while (g_timer_report_running &&
+                   pthread_cond_timedwait(&g_timer_report_wake, &g_timer_report_mutex, &until) != ETIMEDOUT) {
+            }
+            pthread_mutex_unlock(&g_timer_report_mutex);
+            timer_report_interval();    /* the last, partial interval too */
+            pthread_mutex_lock(&g_timer_report_mutex);
+        }
+        pthread_mutex_unlock(&g_timer_report_mutex);
+        return NULL;
+    }
+
+    static void timer_report_stop(void)
+    {
+        pthread_mutex_lock(&g_timer_report_mutex);
+        g_timer_report_running = false;
+        pthread_cond_signal(&g_timer_report_wake);
+        pthread_mutex_unlock(&g_timer_report_mutex);
+        pthread_join(g_timer_report_thread, NULL);
+    }
+
+    static void timer_report_start(void)
+    {
+        g_timer_report_ns      = get_time_ns();
+        g_timer_report_running = true;
+        if (pthread_create(&g_timer_report_thread, NULL, timer_reporter, NULL) != 0) {
+            g_timer_report_running = false;
+            return;
+        }
+        atexit(timer_report_stop);
+    }
+#endif
+    void _tklog_timer_clear() {
+        printf("clearing tklog_timer data\n");
+        tklog_init_once();
+        TimerState *ts = get_timer_state();
+        if (ts) {
+            timer_reset(ts);
+        }
+    }
+#endif
+
+/* =============================  OUT BUFFER  ============================= */
+/*  TKLOG_BUFFERED: every thread appends finished lines to its own buffer and
+ *  hands whole batches to write(2).  The per‑buffer mutex is only contended
+ *  by tklog_flush(), which drains all live buffers, and by a flusher thread
+ *  that wakes every TKLOG_BUFFERED_FLUSH_MS and writes out buffers that
+ *  old, so the lines of a thread that went quiet still show up in time.   */
+#ifdef TKLOG_BUFFERED
+    #ifndef TKLOG_BUFFERED_FD
+        #define TKLOG_BUFFERED_FD STDOUT_FILENO
+    #endif
+    #ifndef TKLOG_BUFFERED_SIZE
+        #define TKLOG_BUFFERED_SIZE (64 * 1024)
+    #endif
+    #ifndef TKLOG_BUFFERED_FLUSH_MS
+        #define TKLOG_BUFFERED_FLUSH_MS 100     /* 0: flush every line, no flusher thread */
+    #endif
+
+    typedef struct OutBuf {
+        pthread_mutex_t  lock;
+        size_t           len;
+        uint64_t         last_flush_ms;
+        struct OutBuf   *prev, *next;       /* g_outbuf_list links */
+        char             data[TKLOG_BUFFERED_SIZE];
+    } OutBuf;
+
+    static pthread_key_t   g_tls_outbuf;   /* thread-local storage key */
+    static pthread_mutex_t g_outbuf_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static OutBuf         *g_outbuf_list = NULL;
+
+    static void fd_write_all(const char *p, size_t n)
+    {
+        while (n) {
+            ssize_t w = write(TKLOG_BUFFERED_FD, p, n);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return;     /* nowhere to report it; drop the batch */
+            }
+            p += w;
+            n -= (size_t)w;
+        }
+    }
+
+    static void outbuf_flush_locked(OutBuf *ob)
+    {
+        if (ob->len) {
+            fd_write_all(ob->data, ob->len);
+            ob->len = 0;
+        }
+        ob->last_flush_ms = get_time_ms();
+    }
+
+    static void outbuf_free(void *ptr)
+    {
+        OutBuf *ob = (OutBuf*)ptr;
+        if (!ob) return;
+        pthread_mutex_lock(&ob->lock);
+        outbuf_flush_locked(ob);
+        pthread_mutex_unlock(&ob->lock);
+
+        pthread_mutex_lock(&g_outbuf_list_mutex);
+        if (ob->prev) ob->prev->next = ob->next;
+        else          g_outbuf_list  = ob->next;
+        if (ob->next) ob->next->prev = ob->prev;
+        pthread_mutex_unlock(&g_outbuf_list_mutex);
+
+        pthread_mutex_destroy(&ob->lock);
+    #ifdef TKLOG_MEMORY
+        original_free(ob);
+    #else
+        free(ob);
+    #endif
+    }
+
+    static OutBuf *outbuf_get(void)
+    {
+        OutBuf *ob = pthread_getspecific(g_tls_outbuf);
+        if (!ob) {
+    #ifdef TKLOG_MEMORY
+            ob = (OutBuf*)original_calloc(1, sizeof *ob);
+    #else
+            ob = (OutBuf*)calloc(1, sizeof *ob);
+    #endif
+            if (!ob) return NULL; /* out‑of‑mem: caller writes unbuffered */
+            pthread_mutex_init(&ob->lock, NULL);
+            ob->last_flush_ms = get_time_ms();
+
+            pthread_mutex_lock(&g_outbuf_list_mutex);
+            ob->next = g_outbuf_list;
+            if (g_outbuf_list) g_outbuf_list->prev = ob;
+            g_outbuf_list = ob;
+            pthread_mutex_unlock(&g_outbuf_list_mutex);
+
+            pthread_setspecific(g_tls_outbuf, ob);
+        }
+        return ob;
+    }
+
+    static void outbuf_write(tklog_level_t level, const char *msg, size_t len)
+    {
+        OutBuf *ob = outbuf_get();
+        if (!ob) {
+            fd_write_all(msg, len);
+            return;
+        }
+        pthread_mutex_lock(&ob->lock);
+        if (ob->len + len > sizeof ob->data) {
+            outbuf_flush_locked(ob);
+        }
+        if (len > sizeof ob->data) {
+            fd_write_all(msg, len);
+        } else {
+            memcpy(ob->data + ob->len, msg, len);
+            ob->len += len;
+        }
+        if (level >= TKLOG_LEVEL_ERROR || get_time_ms() - ob->last_flush_ms >= TKLOG_BUFFERED_FLUSH_MS) {
+            outbuf_flush_locked(ob);
+        }
+        pthread_mutex_unlock(&ob->lock);
+    }
+
+    static void outbuf_flush_all(void)
+    {
+        pthread_mutex_lock(&g_outbuf_list_mutex);
+        for (OutBuf *ob = g_outbuf_list; ob; ob = ob->next) {
+            pthread_mutex_lock(&ob->lock);
+            outbuf_flush_locked(ob);
+            pthread_mutex_unlock(&ob->lock);
+        }
+        pthread_mutex_unlock(&g_outbuf_list_mutex);
+    }
+
+#if TKLOG_BUFFERED_FLUSH_MS > 0
+    static pthread_t       g_outbuf_flusher;
+    static pthread_mutex_t g_outbuf_flusher_mutex   = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_cond_t  g_outbuf_flusher_wake    = PTHREAD_COND_INITIALIZER;
+    static bool            g_outbuf_flusher_running = false;
+
+    /* buffers whose owner has not flushed them for TKLOG_BUFFERED_FLUSH_MS */
+    static void outbuf_flush_stale(void)
+    {
+        pthread_mutex_lock(&g_outbuf_list_mutex);
+        uint64_t now = get_time_ms();
+        for (OutBuf *ob = g_outbuf_list; ob; ob = ob->next) {
+            pthread_mutex_lock(&ob->lock);
+            if (ob->len && now - ob->last_flush_ms >= TKLOG_BUFFERED_FLUSH_MS) {
+                outbuf_flush_locked(ob);
+            }
+            pthread_mutex_unlock(&ob->lock);
+        }
+        pthread_mutex_unlock(&g_outbuf_list_mutex);
+    }
+
+    static void *outbuf_flusher(void *arg)
+    {
+        (void)arg;
+        pthread_mutex_lock(&g_outbuf_flusher_mutex);
+        while (g_outbuf_flusher_running) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            uint64_t ns = (uint64_t)until.tv_nsec + (uint64_t)(TKLOG_BUFFERED_FLUSH_MS) % 1000 * 1000000ULL;
+            until.tv_sec  += (time_t)((TKLOG_BUFFERED_FLUSH_MS) / 1000 + ns / 1000000000ULL);
+            until.tv_nsec  = (long)(ns % 1000000000ULL);
+            pthread_cond_timedwait(&g_outbuf_flusher_wake, &g_outbuf_flusher_mutex, &until);
+            pthread_mutex_unlock(&g_outbuf_flusher_mutex);
+            outbuf_flush_stale();
+            pthread_mutex_lock(&g_outbuf_flusher_mutex);
+        }
+        pthread_mutex_unlock(&g_outbuf_flusher_mutex);
+        return NULL;
+    }
+
+    static void outbuf_flusher_stop(void)
+    {
+        pthread_mutex_lock(&g_outbuf_flusher_mutex);
+        g_outbuf_flusher_running = false;
+        pthread_cond_signal(&g_outbuf_flusher_wake);
+        pthread_mutex_unlock(&g_outbuf_flusher_mutex);
+        pthread_join(g_outbuf_flusher, NULL);
+    }
+
+    static void outbuf_flusher_start(void)
+    {
+        g_outbuf_flusher_running = true;
+        if (pthread_create(&g_outbuf_flusher, NULL, outbuf_flusher, NULL) != 0) {
+            g_outbuf_flusher_running = false;   /* flushes on the owner's next line only */
+            return;
+        }
+        atexit(outbuf_flusher_stop);    /* runs before outbuf_flush_all */
+    }
+#endif
+#endif /* TKLOG_BUFFERED */
+
+/* =============================  MMAP SINK  ============================== */
+/*  tklog_output_mmap: lines are copied straight into a MAP_SHARED file
+ *  segment.  A writer reserves its bytes with one fetch-add on the segment
+ *  offset; the single writer whose reservation crosses the end becomes the
+ *  rotator: it maps the next segment, publishes it, waits until every
+ *  earlier reservation is copied and trims the file to the bytes written.
+ *  Time-based rotation seals a segment the same way, by reserving the rest
+ *  of it.  Data sits in the page cache as soon as it is copied, so it
+ *  survives a crash of the process (the unused tail then reads as NULs). */
+#ifndef _WIN32
+    #ifndef TKLOG_MMAP_PATH
+        #define TKLOG_MMAP_PATH "tklog.log"             /* segments are <path>.0, <path>.1, ... */
+    #endif
+    #ifndef TKLOG_MMAP_SEGMENT_SIZE
+        #define TKLOG_MMAP_SEGMENT_SIZE (64u << 20)
+    #endif
+    #ifndef TKLOG_MMAP_ROTATE_MS
+        #define TKLOG_MMAP_ROTATE_MS 0                  /* 0: rotate by size only */
+    #endif
+    #ifndef TKLOG_MMAP_KEEP
+        #define TKLOG_MMAP_KEEP 0                       /* segments kept on disk, 0: all */
+    #endif
+
+    typedef struct MmapSeg {
+        char            *base;
+        uint64_t         size;
+        uint64_t         offset;        /* next free byte; > size once sealed */
+        uint64_t         committed;     /* bytes completely copied            */
+        uint64_t         opened_ns;
+        uint64_t         seq;
+        int              fd;
+        struct MmapSeg  *older;         /* kept until the sink is closed      */
+    } MmapSeg;
+
+    struct tklog_mmap_sink {
+        MmapSeg  *cur;                  /* NULL once closed or after a failed rotation */
+        MmapSeg  *segs;                 /* newest first; written by the rotator only   */
+        uint64_t  seg_size;
+        uint64_t  rotate_ns;
+        unsigned  keep;
+        uint64_t  first_seq;            /* lower numbers belong to earlier runs */
+        int       closed;
+        char      path[];
+    };
+
+    static tklog_mmap_sink_t *g_mmap_default = NULL;
+    static pthread_once_t     g_mmap_once    = PTHREAD_ONCE_INIT;
+
+    /* One past the highest <path>.N already on disk, so a new run never */
+    /* reuses (or truncates) the segments of an earlier one.              */
+    static uint64_t mmap_next_seq(const char *path)
+    {
+        const char *slash = strrchr(path, '/');
+        const char *base  = slash ? slash + 1 : path;
+        char        dir[4096];
+        if (!slash) {
+            snprintf(dir, sizeof dir, ".");
+        } else {
+            snprintf(dir, sizeof dir, "%.*s", slash == path ? 1 : (int)(slash - path), path);
+        }
+        DIR *d = opendir(dir);
+        if (!d) {
+            return 0;
+        }
+        size_t   blen = strlen(base);
+        uint64_t next = 0;
+        for (struct dirent *de; (de = readdir(d)); ) {
+            const char *n = de->d_name;
+            if (strncmp(n, base, blen) != 0 || n[blen] != '.' || n[blen + 1] < '0' || n[blen + 1] > '9') {
+                continue;
+            }
+            char    *end;
+            uint64_t seq = strtoull(n + blen + 1, &end, 10);
+            if (*end == '\0' && seq + 1 > next) {
+                next = seq + 1;
+            }
+        }
+        closedir(d);
+        return next;
+    }
+
+    /* Opens the first free <path>.N from seq on; O_EXCL, so a segment that */
+    /* appeared meanwhile (another process logging to the same path) is    */
+    /* skipped rather than overwritten.                                    */
+    static MmapSeg *mmap_seg_open(tklog_mmap_sink_t *sink, uint64_t seq)
+    {
+        char name[4096];
+        int  fd = -1;
+        for (int tries = 0; fd < 0 && tries < 64; ++tries, ++seq) {
+            snprintf(name, sizeof name, "%s.%" PRIu64, sink->path, seq);
+            fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0 && errno != EEXIST) {
+                return NULL;
+            }
+        }
+        if (fd < 0) {
+            return NULL;
+        }
+        --seq;
+    #ifdef __linux__
+        /* allocate the blocks now: a full disk must fail here, not SIGBUS later */
+        int rc = posix_fallocate(fd, 0, (off_t)sink->seg_size);
+        if (rc == EINVAL || rc == EOPNOTSUPP) {
+            rc = ftruncate(fd, (off_t)sink->seg_size) ? errno : 0;
+        }
+    #else
+        int rc = ftruncate(fd, (off_t)sink->seg_size) ? errno : 0;
+    #endif
+        void *base = rc ? MAP_FAILED
+                        : mmap(NULL, (size_t)sink->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    #ifdef TKLOG_MEMORY
+        MmapSeg *seg = base == MAP_FAILED ? NULL : (MmapSeg*)original_calloc(1, sizeof *seg);
+    #else
+        MmapSeg *seg = base == MAP_FAILED ? NULL : (MmapSeg*)calloc(1, sizeof *seg);
+    #endif
+        if (!seg) {
+            if (base != MAP_FAILED) munmap(base, (size_t)sink->seg_size);
+            close(fd);
+            unlink(name);
+            return NULL;
+        }
+        seg->base      = (char*)base;
+        seg->size      = sink->seg_size;
+        seg->opened_ns = get_time_ns();
+        seg->seq       = seq;
+        seg->fd        = fd;
+        seg->older     = sink->segs;
+        sink->segs     = seg;
+
+        if (sink->keep && seq >= sink->first_seq + sink->keep) {    /* only this sink's own */
+            snprintf(name, sizeof name, "%s.%" PRIu64, sink->path, seq - sink->keep);
+            unlink(name);
+        }
+        return seg;
+    }
+
+    /* Called by the one writer that sealed `seg` at `end`. */
+    static void mmap_rotate(tklog_mmap_sink_t *sink, MmapSeg *seg, uint64_t end)
+    {
+        MmapSeg *next = NULL;
+        if (!__atomic_load_n(&sink->closed, __ATOMIC_SEQ_CST)) {
+            next = mmap_seg_open(sink, seg->seq + 1);
+            if (!next) {
+                fprintf(stderr, "tklog: cannot open log segment %s.%" PRIu64 ": %s\n",
+                        sink->path, seg->seq + 1, strerror(errno));
+            }
+        }
+        __atomic_store_n(&sink->cur, next, __ATOMIC_RELEASE);
+
+        while (__atomic_load_n(&seg->committed, __ATOMIC_ACQUIRE) < end) {
+            sched_yield();
+        }
+        munmap(seg->base, (size_t)seg->size);
+        seg->base = NULL;
+        if (ftruncate(seg->fd, (off_t)end) != 0) {
+            /* keeps the NUL tail; the data is intact */
+        }
+        close(seg->fd);
+        seg->fd = -1;
+    }
+
+    static bool mmap_write(tklog_mmap_sink_t *sink, const char *msg, size_t len)
+    {
+        if (len == 0 || len > sink->seg_size) {
+            return len == 0;
+        }
+        for (;;) {
+            MmapSeg *seg = __atomic_load_n(&sink->cur, __ATOMIC_ACQUIRE);
+            if (!seg) {
+                return false;
+            }
+            uint64_t off;
+            if (sink->rotate_ns && get_time_ns() - seg->opened_ns >= sink->rotate_ns) {
+                off = __atomic_fetch_add(&seg->offset, seg->size + 1, __ATOMIC_RELAXED);
+            } else {
+                off = __atomic_fetch_add(&seg->offset, len, __ATOMIC_RELAXED);
+                if (off + len <= seg->size) {
+                    memcpy(seg->base + off, msg, len);
+                    __atomic_fetch_add(&seg->committed, len, __ATOMIC_RELEASE);
+                    return true;
+                }
+            }
+            if (off <= seg->size) {
+                mmap_rotate(sink, seg, off);
+            } else {
+                while (__atomic_load_n(&sink->cur, __ATOMIC_ACQUIRE) == seg) {
+                    sched_yield();  /* another writer is rotating */
+                }
+            }
+        }
+    }
+
+    /* Seals the live segment and trims it; later writes return false. */
+    static void mmap_seal(tklog_mmap_sink_t *sink)
+    {
+        __atomic_store_n(&sink->closed, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            MmapSeg *seg = __atomic_load_n(&sink->cur, __ATOMIC_ACQUIRE);
+            if (!seg) {
+                return;
+            }
+            uint64_t off = __atomic_fetch_add(&seg->offset, seg->size + 1, __ATOMIC_RELAXED);
+            if (off <= seg->size) {
+                mmap_rotate(sink, seg, off);
+                return;
+            }
+            while (__atomic_load_n(&sink->cur, __ATOMIC_ACQUIRE) == seg) {
+                sched_yield();
+            }
+        }
+    }
+
+    tklog_mmap_sink_t *tklog_mmap_sink_open(const char *path, size_t segment_size, uint64_t rotate_ms, unsigned keep)
+    {
+        tklog_init_once();
+        size_t plen = strlen(path);
+    #ifdef TKLOG_MEMORY
+        tklog_mmap_sink_t *sink = (tklog_mmap_sink_t*)original_calloc(1, sizeof *sink + plen + 1);
+    #else
+        tklog_mmap_sink_t *sink = (tklog_mmap_sink_t*)calloc(1, sizeof *sink + plen + 1);
+    #endif
+        if (!sink) {
+            return NULL;
+        }
+        memcpy(sink->path, path, plen + 1);
+        sink->seg_size  = segment_size ? segment_size : TKLOG_MMAP_SEGMENT_SIZE;
+        sink->rotate_ns = rotate_ms * 1000000ULL;
+        sink->keep      = keep;
+        sink->first_seq = mmap_next_seq(path);
+        sink->cur       = mmap_seg_open(sink, sink->first_seq);
+        if (sink->cur) {
+            sink->first_seq = sink->cur->seq;
+        } else {
+    #ifdef TKLOG_MEMORY
+            original_free(sink);
+    #else
+            free(sink);
+    #endif
+            return NULL;
+        }
+        return sink;
+    }
+
+    void tklog_mmap_sink_close(tklog_mmap_sink_t *sink)
+    {
+        if (!sink) {
+            return;
+        }
+        mmap_seal(sink);
+        MmapSeg *seg = sink->segs;
+        while (seg) {
+            MmapSeg *older = seg->older;
+    #ifdef TKLOG_MEMORY
+            original_free(seg);
+    #else
+            free(seg);
+    #endif
+            seg = older;
+        }
+    #ifdef TKLOG_MEMORY
+        original_free(sink);
+    #else
+        free(sink);
+    #endif
+    }
+
+    static void mmap_default_open(void)
+    {
+        g_mmap_default = tklog_mmap_sink_open(TKLOG_MMAP_PATH, TKLOG_MMAP_SEGMENT_SIZE,
+                                              TKLOG_MMAP_ROTATE_MS, TKLOG_MMAP_KEEP);
+        if (!g_mmap_default) {
+            fprintf(stderr, "tklog: cannot open a log segment for %s: %s\n", TKLOG_MMAP_PATH, strerror(errno));
+        }
+    }
+
+    /* atexit: trims the default sink; the structs stay for late writers */
+    static void mmap_default_close(void)
+    {
+        if (g_mmap_default) {
+            mmap_seal(g_mmap_default);
+        }
+    }
+
+    bool tklog_output_mmap(const char *msg, void *user)
+    {
+        tklog_mmap_sink_t *sink = (tklog_mmap_sink_t*)user;
+        if (!sink) {
+            pthread_once(&g_mmap_once, mmap_default_open);
+            sink = g_mmap_default;
+            if (!sink) {
+                return false;
+            }
+        }
+        return mmap_write(sink, msg, strlen(msg));
+    }
+#endif /* !_WIN32 */
+
+/* Final stage shared by the inline and the TKLOG_ASYNC writer paths. */
+static void tklog_sink_write(tklog_level_t level, const char *msg, size_t len)
+{
+#ifdef TKLOG_BUFFERED
+    outbuf_write(level, msg, len);
+#else
+    (void)level;
+    (void)len;
+#ifndef _WIN32
+    if (TKLOG_OUTPUT_FN == tklog_output_mmap) {     /* lock-free sink */
+        TKLOG_OUTPUT_FN(msg, TKLOG_OUTPUT_USERPTR);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&g_tklog_mutex);
+    TKLOG_OUTPUT_FN(msg, TKLOG_OUTPUT_USERPTR);
+    pthread_mutex_unlock(&g_tklog_mutex);
+#endif
+}
+
+/* ==============================  ASYNC  ================================= */
+/*  Bounded MPMC ring (Vyukov): each slot carries a sequence number that says
+ *  whether it is free for position `pos` (seq == pos) or holds the message for
+ *  `pos` (seq == pos + 1).  Producers and the writer thread only contend on
+ *  one CAS each; the mutex/condvars are touched only when someone sleeps.    */
+#ifdef TKLOG_ASYNC
+    #ifndef TKLOG_ASYNC_CAPACITY
+        #define TKLOG_ASYNC_CAPACITY 1024
+    #endif
+    #ifndef TKLOG_ASYNC_FULL_POLICY
+        #define TKLOG_ASYNC_FULL_POLICY TKLOG_ASYNC_BLOCK
+    #endif
+    #if (TKLOG_ASYNC_CAPACITY & (TKLOG_ASYNC_CAPACITY - 1)) != 0
+        #error "TKLOG_ASYNC_CAPACITY must be a power of two"
+    #endif
+    #define ASYNC_MASK ((uint64_t)TKLOG_ASYNC_CAPACITY - 1)
+
+    enum { ASYNC_OFF, ASYNC_RUNNING, ASYNC_STOPPED };
+
+    typedef struct AsyncSlot {
+        uint64_t      seq;          /* see above                             */
+        tklog_level_t level;
+        uint32_t      len;
+        char          msg[TKLOG_MSG_MAX];
+    } AsyncSlot;
+
+    static AsyncSlot       g_async_ring[TKLOG_ASYNC_CAPACITY];
+    static uint64_t        g_async_head  __attribute__((aligned(64))) = 0;  /* next enqueue position  */
+    static uint64_t        g_async_tail  __attribute__((aligned(64))) = 0;  /* next dequeue position  */
+    static uint64_t        g_async_done  __attribute__((aligned(64))) = 0;  /* slots written/discarded */
+    static uint64_t        g_async_dropped  = 0;
+    static int             g_async_state    = ASYNC_OFF;
+    static int             g_async_sleeping = 0;    /* writer is (about to be) waiting        */
+    static int             g_async_waiters  = 0;    /* producers/flushers waiting on progress */
+    static pthread_t       g_async_thread;
+    static pthread_mutex_t g_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_cond_t  g_async_wake  = PTHREAD_COND_INITIALIZER;   /* writer: work available     */
+    static pthread_cond_t  g_async_space = PTHREAD_COND_INITIALIZER;   /* waiters: a slot was freed  */
+
+    static bool async_try_push(tklog_level_t level, const char *msg, size_t len)
+    {
+        uint64_t pos = __atomic_load_n(&g_async_head, __ATOMIC_RELAXED);
+        for (;;) {
+            AsyncSlot *s   = &g_async_ring[pos & ASYNC_MASK];
+            uint64_t   seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            int64_t    dif = (int64_t)(seq - pos);
+            if (dif == 0) {
+                if (__atomic_compare_exchange_n(&g_async_head, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    s->level = level;
+                    s->len   = (uint32_t)len;
+                    memcpy(s->msg, msg, len + 1);
+                    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;   /* full */
+            } else {
+                pos = __atomic_load_n(&g_async_head, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    /* Claims the oldest published slot; the caller owns it until async_release(). */
+    static AsyncSlot *async_claim(uint64_t *out_pos)
+    {
+        uint64_t pos = __atomic_load_n(&g_async_tail, __ATOMIC_RELAXED);
+        for (;;) {
+            AsyncSlot *s   = &g_async_ring[pos & ASYNC_MASK];
+            uint64_t   seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            int64_t    dif = (int64_t)(seq - (pos + 1));
+            if (dif == 0) {
+                if (__atomic_compare_exchange_n(&g_async_tail, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    *out_pos = pos;
+                    return s;
+                }
+            } else if (dif < 0) {
+                return NULL;    /* empty */
+            } else {
+                pos = __atomic_load_n(&g_async_tail, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    static void async_release(AsyncSlot *s, uint64_t pos)
+    {
+        __atomic_store_n(&s->seq, pos + TKLOG_ASYNC_CAPACITY, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&g_async_done, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&g_async_waiters, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&g_async_mutex);
+            pthread_cond_broadcast(&g_async_space);
+            pthread_mutex_unlock(&g_async_mutex);
+        }
+    }
+
+    static bool async_full(void)
+    {
+        uint64_t pos = __atomic_load_n(&g_async_head, __ATOMIC_SEQ_CST);
+        uint64_t seq = __atomic_load_n(&g_async_ring[pos & ASYNC_MASK].seq, __ATOMIC_SEQ_CST);
+        return (int64_t)(seq - pos) < 0;
+    }
+
+    static bool async_empty(void)
+    {
+        uint64_t pos = __atomic_load_n(&g_async_tail, __ATOMIC_SEQ_CST);
+        uint64_t seq = __atomic_load_n(&g_async_ring[pos & ASYNC_MASK].seq, __ATOMIC_SEQ_CST);
+        return (int64_t)(seq - (pos + 1)) < 0;
+    }
+
+    static void async_write_pending(void)
+    {
+        uint64_t   pos;
+        AsyncSlot *s;
+        while ((s = async_claim(&pos)) != NULL) {
+            tklog_sink_write(s->level, s->msg, s->len);
+            async_release(s, pos);
+        }
+    }
+
+    static void *async_writer(void *arg)
+    {
+        (void)arg;
+        for (;;) {
+            async_write_pending();
+            pthread_mutex_lock(&g_async_mutex);
+            __atomic_store_n(&g_async_sleeping, 1, __ATOMIC_SEQ_CST);
+            if (async_empty()) {
+                if (__atomic_load_n(&g_async_state, __ATOMIC_ACQUIRE) != ASYNC_RUNNING) {
+                    __atomic_store_n(&g_async_sleeping, 0, __ATOMIC_SEQ_CST);
+                    pthread_mutex_unlock(&g_async_mutex);
+                    break;
+                }
+                pthread_cond_wait(&g_async_wake, &g_async_mutex);
+            }
+            __atomic_store_n(&g_async_sleeping, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&g_async_mutex);
+        }
+        return NULL;
+    }
+
+    static void async_wake_writer(void)
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);    /* order the publish before reading the flag */
+        if (__atomic_load_n(&g_async_sleeping, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&g_async_mutex);
+            pthread_cond_signal(&g_async_wake);
+            pthread_mutex_unlock(&g_async_mutex);
+        }
+    }
+
+    /* Returns false when the writer is not running and the caller must write inline. */
+    static bool async_push(tklog_level_t level, const char *msg, size_t len)
+    {
+        if (__atomic_load_n(&g_async_state, __ATOMIC_ACQUIRE) != ASYNC_RUNNING) {
+            return false;
+        }
+        while (!async_try_push(level, msg, len)) {
+    #if TKLOG_ASYNC_FULL_POLICY == TKLOG_ASYNC_DROP_NEWEST
+            __atomic_add_fetch(&g_async_dropped, 1, __ATOMIC_RELAXED);
+            return true;
+    #elif TKLOG_ASYNC_FULL_POLICY == TKLOG_ASYNC_DROP_OLDEST
+            uint64_t   pos;
+            AsyncSlot *s = async_claim(&pos);
+            if (s) {
+                async_release(s, pos);
+                __atomic_add_fetch(&g_async_dropped, 1, __ATOMIC_RELAXED);
+            }
+    #else
+            pthread_mutex_lock(&g_async_mutex);
+            __atomic_add_fetch(&g_async_waiters, 1, __ATOMIC_SEQ_CST);
+            pthread_cond_signal(&g_async_wake);
+            while (async_full()) {
+                pthread_cond_wait(&g_async_space, &g_async_mutex);
+            }
+            __atomic_sub_fetch(&g_async_waiters, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&g_async_mutex);
+    #endif
+        }
+        async_wake_writer();
+        return true;
+    }
+
+    /* Waits until the writer has consumed everything enqueued before the call. */
+    static void async_drain(void)
+    {
+        if (__atomic_load_n(&g_async_state, __ATOMIC_ACQUIRE) != ASYNC_RUNNING) {
+            return;
+        }
+        uint64_t target = __atomic_load_n(&g_async_head, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&g_async_mutex);
+        __atomic_add_fetch(&g_async_waiters, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&g_async_done, __ATOMIC_SEQ_CST) < target) {
+            pthread_cond_signal(&g_async_wake);
+            pthread_cond_wait(&g_async_space, &g_async_mutex);
+        }
+        __atomic_sub_fetch(&g_async_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&g_async_mutex);
+    }
+
+    static void async_shutdown(void)
+    {
+        async_drain();
+        pthread_mutex_lock(&g_async_mutex);
+        __atomic_store_n(&g_async_state, ASYNC_STOPPED, __ATOMIC_RELEASE);
+        pthread_cond_signal(&g_async_wake);
+        pthread_mutex_unlock(&g_async_mutex);
+        pthread_join(g_async_thread, NULL);
+        async_write_pending();  /* anything pushed while the writer was stopping */
+
+        uint64_t dropped = __atomic_load_n(&g_async_dropped, __ATOMIC_RELAXED);
+        if (dropped) {
+            char linebuf[128];
+            snprintf(linebuf, sizeof linebuf, "tklog: %" PRIu64 " messages dropped because the async queue was full\n", dropped);
+            tklog_sink_write(TKLOG_LEVEL_WARNING, linebuf, strlen(linebuf));
+        }
+    }
+
+    static void async_start(void)
+    {
+        for (uint64_t i = 0; i < TKLOG_ASYNC_CAPACITY; ++i) {
+            g_async_ring[i].seq = i;
+        }
+        g_async_state = ASYNC_RUNNING;
+        if (pthread_create(&g_async_thread, NULL, async_writer, NULL) != 0) {
+            g_async_state = ASYNC_OFF;  /* fall back to writing inline */
+            return;
+        }
+        atexit(async_shutdown);
+    }
+
+    uint64_t tklog_async_dropped(void) { return __atomic_load_n(&g_async_dropped, __ATOMIC_RELAXED); }
+#else
+    uint64_t tklog_async_dropped(void) { return 0; }
+#endif /* TKLOG_ASYNC */
+
+/* =============================  CALLSITES  ============================== */
+/*  Runtime on/off switch for every tklog_<level>() site.  Filter rules sit
+ *  in a small table; each site's `enabled` byte caches the verdict and is
+ *  rewritten whenever the rules change.  Sites are found through the
+ *  "tklog_callsites" linker section on ELF and through g_cs_list for any
+ *  site that registers itself lazily (other targets, other DSOs).        */
+#ifndef TKLOG_FILTER_MAX_RULES
+    #define TKLOG_FILTER_MAX_RULES 64
+#endif
+#define TKLOG_FILTER_OFF (TKLOG_LEVEL_EMERGENCY + 1)   /* min level nothing reaches */
+
+typedef struct FilterRule {
+    char glob[64];      /* "" matches every file; contains '/' → matched against the full path */
+    int  line;          /* 0 = any line                */
+    int  min_level;     /* tklog_level_t or TKLOG_FILTER_OFF */
+} FilterRule;
+
+static pthread_mutex_t   g_cs_mutex  = PTHREAD_MUTEX_INITIALIZER;  /* rules + registry */
+static FilterRule        g_cs_rules[TKLOG_FILTER_MAX_RULES];
+static int               g_cs_nrules = 0;
+static tklog_callsite_t *g_cs_list   = NULL;                       /* sites outside the section */
+
+#if defined(__ELF__) && (defined(__GNUC__) || defined(__clang__))
+    /* provided by the linker; weak so a program without log calls still links */
+    extern tklog_callsite_t __start_tklog_callsites[] __attribute__((weak, visibility("hidden")));
+    extern tklog_callsite_t __stop_tklog_callsites[]  __attribute__((weak, visibility("hidden")));
+    #define CS_SECTION_BEGIN __start_tklog_callsites
+    #define CS_SECTION_END   __stop_tklog_callsites
+#else
+    #define CS_SECTION_BEGIN ((tklog_callsite_t*)NULL)
+    #define CS_SECTION_END   ((tklog_callsite_t*)NULL)
+#endif
+
+static void cs_set_name(tklog_callsite_t *cs)
+{
+    if (!cs->name) {
+        const char *file = strrchr(cs->file, '/');
+        cs->name = file ? file + 1 : cs->file;
+    }
+}
+
+static bool cs_rule_matches(const FilterRule *r, const tklog_callsite_t *cs)
+{
+    if (r->line && r->line != cs->line) return false;
+    if (!r->glob[0]) return true;
+    return fnmatch(r->glob, strchr(r->glob, '/') ? cs->file : cs->name, 0) == 0;
+}
+
+/* g_cs_mutex held */
+static uint8_t cs_verdict(const tklog_callsite_t *cs)
+{
+    bool on = true;
+    for (int i = 0; i < g_cs_nrules; ++i) {
+        if (cs_rule_matches(&g_cs_rules[i], cs)) {
+            on = (int)cs->level >= g_cs_rules[i].min_level;
+        }
+    }
+    return on ? TKLOG_CS_ENABLED : TKLOG_CS_DISABLED;
+}
+
+/* g_cs_mutex held */
+static void cs_apply_all(void)
+{
+    for (tklog_callsite_t *cs = CS_SECTION_BEGIN; cs < CS_SECTION_END; ++cs) {
+        cs_set_name(cs);
+        __atomic_store_n(&cs->enabled, cs_verdict(cs), __ATOMIC_RELEASE);
+    }
+    for (tklog_callsite_t *cs = g_cs_list; cs; cs = cs->next) {
+        __atomic_store_n(&cs->enabled, cs_verdict(cs), __ATOMIC_RELEASE);
+    }
+}
+
+/* g_cs_mutex held.  A rule that matches everything makes all earlier rules
+ * moot, and a rule for the same glob/line replaces the old one, so the table
+ * only grows with distinct targets; when it is full the oldest rule goes. */
+static void cs_add_rule(const FilterRule *r)
+{
+    if (!r->glob[0] && !r->line) {
+        g_cs_nrules = 0;
+    }
+    for (int i = 0; i < g_cs_nrules; ++i) {
+        if (g_cs_rules[i].line == r->line && strcmp(g_cs_rules[i].glob, r->glob) == 0) {
+            memmove(&g_cs_rules[i], &g_cs_rules[i + 1], (size_t)(g_cs_nrules - i - 1) * sizeof *r);
+            --g_cs_nrules;
+            break;
+        }
+    }
+    if (g_cs_nrules == TKLOG_FILTER_MAX_RULES) {
+        memmove(&g_cs_rules[0], &g_cs_rules[1], (size_t)(g_cs_nrules - 1) * sizeof *r);
+        --g_cs_nrules;
+    }
+    g_cs_rules[g_cs_nrules++] = *r;
+}
+
+static int cs_parse_level(const char *s, size_t n)
+{
+    static const char *names[] = {
+        "debug", "info", "notice", "warning", "error", "critical", "alert", "emergency" };
+    for (int i = 0; i < 8; ++i) {
+        if (strlen(names[i]) == n && strncasecmp(s, names[i], n) == 0) return i;
+    }
+    if (n == 2 && strncasecmp(s, "on", 2) == 0)  return TKLOG_LEVEL_DEBUG;
+    if (n == 3 && strncasecmp(s, "all", 3) == 0) return TKLOG_LEVEL_DEBUG;
+    if (n == 3 && strncasecmp(s, "off", 3) == 0) return TKLOG_FILTER_OFF;
+    return -1;
+}
+
+/* Parses a TKLOG_FILTER spec into `out`; returns the rule count or -1. */
+static int cs_parse(const char *spec, FilterRule *out, int max)
+{
+    int n = 0;
+    const char *p = spec;
+    for (;;) {
+        p += strspn(p, ",; \t\n");
+        if (!*p) return n;
+        size_t tok = strcspn(p, ",; \t\n");
+        if (n == max) return -1;
+
+        FilterRule r;
+        memset(&r, 0, sizeof r);
+        const char *eq = memchr(p, '=', tok);
+        const char *lvl = eq ? eq + 1 : p;
+        r.min_level = cs_parse_level(lvl, (size_t)(p + tok - lvl));
+        if (r.min_level < 0) return -1;
+
+        if (eq) {
+            size_t pat = (size_t)(eq - p);
+            /* trailing ":<digits>" selects a line */
+            const char *colon = NULL;
+            for (const char *c = p; c < eq; ++c) if (*c == ':') colon = c;
+            if (colon && colon + 1 < eq && strspn(colon + 1, "0123456789") >= (size_t)(eq - colon - 1)) {
+                r.line = atoi(colon + 1);
+                pat    = (size_t)(colon - p);
+            }
+            if (pat >= sizeof r.glob) return -1;
+            memcpy(r.glob, p, pat);
+            r.glob[pat] = '\0';
+            if (strcmp(r.glob, "*") == 0) r.glob[0] = '\0';
+        }
+        out[n++] = r;
+        p += tok;
+    }
+}
+
+static void callsite_init(void)
+{
+    const char *spec = getenv("TKLOG_FILTER");
+    FilterRule  rules[TKLOG_FILTER_MAX_RULES];
+    int         n = spec ? cs_parse(spec, rules, TKLOG_FILTER_MAX_RULES) : 0;
+    if (n < 0) {
+        fprintf(stderr, "tklog: ignoring malformed TKLOG_FILTER \"%s\"\n", spec);
+        n = 0;
+    }
+    pthread_mutex_lock(&g_cs_mutex);
+    for (int i = 0; i < n; ++i) cs_add_rule(&rules[i]);
+    cs_apply_all();
+    pthread_mutex_unlock(&g_cs_mutex);
+}
+
+/* First run of a site the section pass did not reach. */
+static void cs_register(tklog_callsite_t *cs)
+{
+    tklog_init_once();  /* tags every site in the section */
+    pthread_mutex_lock(&g_cs_mutex);
+    if (__atomic_load_n(&cs->enabled, __ATOMIC_RELAXED) == TKLOG_CS_UNREGISTERED) {
+        cs_set_name(cs);
+        cs->next  = g_cs_list;
+        g_cs_list = cs;
+        __atomic_store_n(&cs->enabled, cs_verdict(cs), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_cs_mutex);
+}
+
+/* The macro only skips disabled sites; this settles the first call and
+ * publishes cs->name. */
+static bool callsite_ready(tklog_callsite_t *cs)
+{
+    uint8_t state = __atomic_load_n(&cs->enabled, __ATOMIC_ACQUIRE);
+    if (state == TKLOG_CS_UNREGISTERED) {
+        cs_register(cs);
+        state = __atomic_load_n(&cs->enabled, __ATOMIC_ACQUIRE);
+    }
+    return state == TKLOG_CS_ENABLED;
+}
+
+static void cs_set(const FilterRule *r)
+{
+    tklog_init_once();
+    pthread_mutex_lock(&g_cs_mutex);
+    cs_add_rule(r);
+    cs_apply_all();
+    pthread_mutex_unlock(&g_cs_mutex);
+}
+
+int tklog_filter(const char *spec)
+{
+    FilterRule rules[TKLOG_FILTER_MAX_RULES];
+    int n = cs_parse(spec ? spec : "", rules, TKLOG_FILTER_MAX_RULES);
+    if (n < 0) {
+        return -1;
+    }
+    tklog_init_once();
+    pthread_mutex_lock(&g_cs_mutex);
+    for (int i = 0; i < n; ++i) cs_add_rule(&rules[i]);
+    cs_apply_all();
+    pthread_mutex_unlock(&g_cs_mutex);
+    return 0;
+}
+
+void tklog_set_level(tklog_level_t min_level)
+{
+    FilterRule r;
+    memset(&r, 0, sizeof r);
+    r.min_level = (int)min_level;
+    cs_set(&r);
+}
+
+void tklog_set_file_level(const char *file_glob, tklog_level_t min_level)
+{
+    FilterRule r;
+    memset(&r, 0, sizeof r);
+    snprintf(r.glob, sizeof r.glob, "%s", strcmp(file_glob, "*") ? file_glob : "");
+    r.min_level = (int)min_level;
+    cs_set(&r);
+}
+
+void tklog_set_site_enabled(const char *file, int line, bool enabled)
+{
+    FilterRule r;
+    memset(&r, 0, sizeof r);
+    snprintf(r.glob, sizeof r.glob, "%s", file);
+    r.line      = line;
+    r.min_level = enabled ? TKLOG_LEVEL_DEBUG : TKLOG_FILTER_OFF;
+    cs_set(&r);
+}
+
+static void callsite_vlog(uint32_t flags, tklog_callsite_t *cs, uint64_t suppressed, const char *fields, const char *fmt, va_list ap)
+{
+    if (callsite_ready(cs)) {
+        tklog_vlog(flags, cs->level, cs->line, cs->name, suppressed, fields, fmt, ap);
+    }
+}
+
+void _tklog_callsite(uint32_t flags, tklog_callsite_t *cs, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    callsite_vlog(flags, cs, 0, NULL, fmt, ap);
+    va_end(ap);
+}
+
+/* ==============================  BINARY  ================================ */
+/*  TKLOG_BINARY: no formatting on the logging thread.  The record layout is
+ *  documented next to TKLOG_BIN_MAGIC in tklog.h; records are appended to a
+ *  stdio stream under g_tklog_mutex, so stdio does the batching.          */
+#ifdef TKLOG_BINARY
+    #ifndef TKLOG_BINARY_PATH
+        #define TKLOG_BINARY_PATH "tklog.bin"
+    #endif
+
+    typedef struct BinBuf {
+        size_t len;
+        bool   full;        /* a fixed-size field did not fit */
+        char   data[TKLOG_MSG_MAX];
+    } BinBuf;
+
+    enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T, LEN_BIG_L };
+
+    static FILE     *g_bin_file    = NULL;
+    static uint32_t  g_bin_next_id = 1;     /* guarded by g_tklog_mutex */
+
+    static void bin_put(BinBuf *b, const void *src, size_t len)
+    {
+        if (b->len + len > sizeof b->data) {
+            b->full = true;
+            return;
+        }
+        memcpy(b->data + b->len, src, len);
+        b->len += len;
+    }
+    static void bin_put_u8 (BinBuf *b, uint8_t  v) { bin_put(b, &v, sizeof v); }
+    static void bin_put_u32(BinBuf *b, uint32_t v) { bin_put(b, &v, sizeof v); }
+    static void bin_put_u64(BinBuf *b, uint64_t v) { bin_put(b, &v, sizeof v); }
+
+    /* u16 length + bytes, truncated to what is left of the record */
+    static void bin_put_str(BinBuf *b, const char *str, long prec)
+    {
+        uint16_t len;
+        if (!str) {
+            len = TKLOG_BIN_NULL_STR;
+            bin_put(b, &len, sizeof len);
+            return;
+        }
+        size_t n    = prec >= 0 ? strnlen(str, (size_t)prec) : strlen(str);
+        size_t room = b->len + sizeof len < sizeof b->data ? sizeof b->data - b->len - sizeof len : 0;
+        if (n > room)   n = room;
+        if (n > 0xFFFE) n = 0xFFFE;
+        len = (uint16_t)n;
+        bin_put(b, &len, sizeof len);
+        bin_put(b, str, n);
+    }
+
+    /* Copies the arguments `fmt` describes; false when a conversion cannot be captured. */
+    static bool bin_pack_args(BinBuf *b, const char *fmt, va_list ap)
+    {
+        for (const char *f = fmt; *f; ++f) {
+            if (*f != '%') continue;
+            if (*++f == '%') continue;
+
+            while (*f && strchr("-+ #0'", *f)) ++f;
+            if (*f == '*') {
+                bin_put_u64(b, (uint64_t)(int64_t)va_arg(ap, int));
+                ++f;
+            } else {
+                while (*f >= '0' && *f <= '9') ++f;
+            }
+            long prec = -1;
+            if (*f == '.') {
+                ++f;
+                if (*f == '*') {
+                    int p = va_arg(ap, int);
+                    bin_put_u64(b, (uint64_t)(int64_t)p);
+                    prec = p < 0 ? -1 : p;
+                    ++f;
+                } else {
+                    prec = 0;
+                    while (*f >= '0' && *f <= '9') prec = prec * 10 + (*f++ - '0');
+                }
+            }
+            int len = LEN_NONE;
+            switch (*f) {
+                case 'h': len = (f[1] == 'h') ? (++f, LEN_HH) : LEN_H;  ++f; break;
+                case 'l': len = (f[1] == 'l') ? (++f, LEN_LL) : LEN_L;  ++f; break;
+                case 'j': len = LEN_J;     ++f; break;
+                case 'z': len = LEN_Z;     ++f; break;
+                case 't': len = LEN_T;     ++f; break;
+                case 'L': len = LEN_BIG_L; ++f; break;
+                default: break;
+            }
+            switch (*f) {
+                case 'd': case 'i': {
+                    int64_t v;
+                    switch (len) {
+                        case LEN_L:  v = va_arg(ap, long);      break;
+                        case LEN_LL: v = va_arg(ap, long long); break;
+                        case LEN_J:  v = va_arg(ap, intmax_t);  break;
+                        case LEN_Z:  v = (int64_t)va_arg(ap, size_t); break;
+                        case LEN_T:  v = va_arg(ap, ptrdiff_t); break;
+                        default:     v = va_arg(ap, int);       break;
+                    }
+                    bin_put_u64(b, (uint64_t)v);
+                    break;
+                }
+                case 'u': case 'o': case 'x': case 'X': {
+                    uint64_t v;
+                    switch (len) {
+                        case LEN_L:  v = va_arg(ap, unsigned long);      break;
+                        case LEN_LL: v = va_arg(ap, unsigned long long); break;
+                        case LEN_J:  v = va_arg(ap, uintmax_t);          break;
+                        case LEN_Z:  v = va_arg(ap, size_t);             break;
+                        case LEN_T:  v = (uint64_t)va_arg(ap, ptrdiff_t); break;
+                        default:     v = va_arg(ap, unsigned int);       break;
+                    }
+                    bin_put_u64(b, v);
+                    break;
+                }
+                case 'c':
+                    if (len != LEN_NONE) return false;
+                    bin_put_u64(b, (uint64_t)(int64_t)va_arg(ap, int));
+                    break;
+                case 'e': case 'E': case 'f': case 'F':
+                case 'g': case 'G': case 'a': case 'A': {
+                    if (len == LEN_BIG_L) return false;
+                    double v = va_arg(ap, double);
+                    bin_put(b, &v, sizeof v);
+                    break;
+                }
+                case 's':
+                    if (len != LEN_NONE) return false;
+                    bin_put_str(b, va_arg(ap, const char*), prec);
+                    break;
+                case 'p':
+                    bin_put_u64(b, (uint64_t)(uintptr_t)va_arg(ap, void*));
+                    break;
+                default:    /* %n, unknown conversions, or a truncated spec */
+                    return false;
+            }
+        }
+        return !b->full;
+    }
+
+    static void bin_open(void)
+    {
+        g_bin_file = fopen(TKLOG_BINARY_PATH, "wb");
+        if (!g_bin_file) {
+            return; /* _tklog_binary falls back to text output */
+        }
+        uint8_t time_fmt = TIME_FRAC_DIGITS == 9 ? TKLOG_BIN_TIME_NS
+                         : TIME_FRAC_DIGITS == 6 ? TKLOG_BIN_TIME_US : TKLOG_BIN_TIME_MS;
+    #ifdef TKLOG_TIME_ISO8601
+        time_fmt |= TKLOG_BIN_TIME_ISO8601;
+    #endif
+        fwrite(TKLOG_BIN_MAGIC, 1, 8, g_bin_file);
+        fwrite(&g_start_ns, sizeof g_start_ns, 1, g_bin_file);
+        fwrite(&g_wall_offset_ns, sizeof g_wall_offset_ns, 1, g_bin_file);
+        fwrite(&time_fmt, sizeof time_fmt, 1, g_bin_file);
+    }
+
+    static void bin_flush(void)
+    {
+        pthread_mutex_lock(&g_tklog_mutex);
+        if (g_bin_file) fflush(g_bin_file);
+        pthread_mutex_unlock(&g_tklog_mutex);
+    }
+
+    /* Writes the 'C' record the first time a call site fires. */
+    static uint32_t bin_register(tklog_callsite_t *cs)
+    {
+        pthread_mutex_lock(&g_tklog_mutex);
+        uint32_t id = cs->id;
+        if (!id) {
+            id = g_bin_next_id++;
+            const char *file = cs->name;
+            size_t file_len = strlen(file), fmt_len = strlen(cs->fmt);
+            if (file_len > 0xFFFF) file_len = 0xFFFF;
+            if (fmt_len  > 0xFFFF) fmt_len  = 0xFFFF;
+            uint16_t l16;
+            int32_t  line = cs->line;
+            fputc(TKLOG_BIN_REC_CALLSITE, g_bin_file);
+            fwrite(&id, sizeof id, 1, g_bin_file);
+            fputc((int)cs->level, g_bin_file);
+            fwrite(&line, sizeof line, 1, g_bin_file);
+            l16 = (uint16_t)file_len; fwrite(&l16, sizeof l16, 1, g_bin_file); fwrite(file, 1, file_len, g_bin_file);
+            l16 = (uint16_t)fmt_len;  fwrite(&l16, sizeof l16, 1, g_bin_file); fwrite(cs->fmt, 1, fmt_len, g_bin_file);
+            __atomic_store_n(&cs->id, id, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&g_tklog_mutex);
+        return id;
+    }
+
+    /* A suppressed count forces a text record: such lines are rare by design. */
+    static void bin_vlog(uint32_t flags, tklog_callsite_t *cs, uint64_t suppressed, const char *fields, const char *fmt, va_list ap)
+    {
+        if (!callsite_ready(cs)) {
+            return;
+        }
+        if (!g_bin_file) {
+            tklog_vlog(flags, cs->level, cs->line, cs->name, suppressed, fields, fmt, ap);
+            return;
+        }
+        uint32_t id = __atomic_load_n(&cs->id, __ATOMIC_ACQUIRE);
+        if (!id) {
+            id = bin_register(cs);
+        }
+
+        BinBuf b;
+        b.len  = 0;
+        b.full = false;
+        bin_put_u8 (&b, TKLOG_BIN_REC_LOG);
+        bin_put_u8 (&b, (uint8_t)flags);
+        bin_put_u32(&b, id);
+        bin_put_u64(&b, get_time_ns());
+        bin_put_u64(&b, (uint64_t)pthread_self());
+        const char *path = "";
+        if (flags & TKLOG_INIT_F_PATH) {
+            PathStack *ps = pathstack_get();
+            if (ps) path = ps->buf;
+        }
+        bin_put_str(&b, path, -1);
+
+        size_t   body_at = b.len;
+        uint16_t body_len = 0;
+        bin_put(&b, &body_len, sizeof body_len);
+        va_list ap2;
+        va_copy(ap2, ap);
+        if (suppressed || fields || !bin_pack_args(&b, fmt, ap)) {
+            /* format here instead and store the text */
+            b.data[0] = TKLOG_BIN_REC_TEXT;
+            b.len     = body_at + sizeof body_len;
+            b.full    = false;
+            int n = vsnprintf(b.data + b.len, sizeof b.data - b.len, fmt, ap2);
+            if (n > 0) {
+                b.len += ((size_t)n < sizeof b.data - b.len) ? (size_t)n : sizeof b.data - b.len - 1;
+            }
+            if (fields) {
+                n = snprintf(b.data + b.len, sizeof b.data - b.len, "%s", fields);
+                if (n > 0) {
+                    b.len += ((size_t)n < sizeof b.data - b.len) ? (size_t)n : sizeof b.data - b.len - 1;
+                }
+            }
+            if (suppressed) {
+                n = snprintf(b.data + b.len, sizeof b.data - b.len, " (suppressed %" PRIu64 " similar messages)", suppressed);
+                if (n > 0) {
+                    b.len += ((size_t)n < sizeof b.data - b.len) ? (size_t)n : sizeof b.data - b.len - 1;
+                }
+            }
+        }
+        va_end(ap2);
+        body_len = (uint16_t)(b.len - body_at - sizeof body_len);
+        memcpy(b.data + body_at, &body_len, sizeof body_len);
+
+        pthread_mutex_lock(&g_tklog_mutex);
+        fwrite(b.data, 1, b.len, g_bin_file);
+        pthread_mutex_unlock(&g_tklog_mutex);
     }
-    static TimerState *get_timer_state(void) {
-        TimerState *ts = pthread_getspecific(g_tls_timer_state);
-        if (!ts) {
-            ts = calloc(1, sizeof(TimerState));
-            if (!ts) {
-                printf("tklog: out of memory for TimerState\n");
-                return NULL;
+
+    void _tklog_binary(uint32_t flags, tklog_callsite_t *cs, const char *fmt, ...)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        bin_vlog(flags, cs, 0, NULL, fmt, ap);
+        va_end(ap);
+    }
+#else
+    #define bin_vlog callsite_vlog
+
+    void _tklog_binary(uint32_t flags, tklog_callsite_t *cs, const char *fmt, ...)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        callsite_vlog(flags, cs, 0, NULL, fmt, ap);
+        va_end(ap);
+    }
+#endif /* TKLOG_BINARY */
+
+/* ==============================  LIMITS  ================================ */
+/*  Admission checks for tklog_<level>_every_n/_ratelimit/_once.  Each one is
+ *  a single atomic update on the site's tklog_limit_t; `suppressed` is set
+ *  to the number of rejected calls the admitted line should report.      */
+static bool limit_result(tklog_limit_t *lim, bool pass, uint64_t *suppressed)
+{
+    if (!pass) {
+        __atomic_fetch_add(&lim->suppressed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    *suppressed = __atomic_load_n(&lim->suppressed, __ATOMIC_RELAXED)
+                ? __atomic_exchange_n(&lim->suppressed, 0, __ATOMIC_RELAXED) : 0;
+    return true;
+}
+
+bool _tklog_admit_every_n(tklog_limit_t *lim, uint64_t n, uint64_t *suppressed)
+{
+    uint64_t k = __atomic_fetch_add(&lim->state, 1, __ATOMIC_RELAXED);
+    return limit_result(lim, n <= 1 || k % n == 0, suppressed);
+}
+
+bool _tklog_admit_once(tklog_limit_t *lim, uint64_t *suppressed)
+{
+    bool first = __atomic_load_n(&lim->state, __ATOMIC_RELAXED) == 0
+              && __atomic_exchange_n(&lim->state, 1, __ATOMIC_RELAXED) == 0;
+    return limit_result(lim, first, suppressed);
+}
+
+/* Token bucket kept as one word (GCRA): `state` is the time at which the
+ * bucket is full again.  A call is admitted while that lies less than
+ * `burst` intervals ahead of now, and pushes it one interval further.   */
+bool _tklog_admit_ratelimit(tklog_limit_t *lim, double per_sec, uint32_t burst, uint64_t *suppressed)
+{
+    tklog_init_once();
+    if (!(per_sec > 0.0)) {
+        return limit_result(lim, false, suppressed);
+    }
+    uint64_t interval = per_sec < 1e9 ? (uint64_t)(1e9 / per_sec) : 1;
+    uint64_t window   = interval * (burst ? burst : 1);
+    uint64_t now      = get_time_ns();
+    uint64_t tat      = __atomic_load_n(&lim->state, __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t base = tat > now ? tat : now;
+        if (base + interval > now + window) {
+            return limit_result(lim, false, suppressed);
+        }
+        if (__atomic_compare_exchange_n(&lim->state, &tat, base + interval, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return limit_result(lim, true, suppressed);
+        }
+    }
+}
+
+void _tklog_limited(uint32_t flags, tklog_callsite_t *cs, uint64_t suppressed, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    bin_vlog(flags, cs, suppressed, NULL, fmt, ap);
+    va_end(ap);
+}
+
+/* =============================  STRUCTURED  ============================= */
+/*  JSON escaping, TKLOG_JSON line rendering and tklog_<level>_kv fields.
+ *  Output helpers append to `out` at offset `o` and never go past `cap`. */
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+
+/* Non-zero when one of the 8 bytes is a control character, '"' or '\\'. */
+static inline uint64_t json_special8(uint64_t w)
+{
+    uint64_t q  = w ^ (SWAR_ONES * '"');
+    uint64_t bs = w ^ (SWAR_ONES * '\\');
+    return (((w - SWAR_ONES * 0x20) & ~w)
+          | ((q  - SWAR_ONES)       & ~q)
+          | ((bs - SWAR_ONES)       & ~bs)) & SWAR_HIGHS;
+}
+
+static size_t out_put(char *out, size_t o, size_t cap, const char *s, size_t n)
+{
+    if (n > cap - o) n = cap - o;
+    memcpy(out + o, s, n);
+    return o + n;
+}
+
+static size_t out_put_u64(char *out, size_t o, size_t cap, uint64_t v)
+{
+    char tmp[20];
+    return out_put(out, o, cap, tmp, fmt_u64(tmp, v));
+}
+
+static size_t out_put_i64(char *out, size_t o, size_t cap, int64_t v)
+{
+    if (v < 0) {
+        o = out_put(out, o, cap, "-", 1);
+        return out_put_u64(out, o, cap, 0 - (uint64_t)v);
+    }
+    return out_put_u64(out, o, cap, (uint64_t)v);
+}
+
+/* Appends s[0..n) escaped for a JSON string.  Clean runs are found eight
+ * bytes at a time and copied with one memcpy.  When cap is reached the text
+ * is cut before an escape or a UTF-8 character that does not fit whole. */
+static size_t json_escape(char *out, size_t o, size_t cap, const char *s, size_t n)
+{
+    size_t i = 0;
+    while (i < n) {
+        size_t run = i;
+        while (run + 8 <= n) {
+            uint64_t w;
+            memcpy(&w, s + run, 8);
+            if (json_special8(w)) break;
+            run += 8;
+        }
+        while (run < n) {
+            unsigned char c = (unsigned char)s[run];
+            if (c < 0x20 || c == '"' || c == '\\') break;
+            ++run;
+        }
+        size_t take = run - i;
+        if (take > cap - o) {
+            take = cap - o;
+            while (take && ((unsigned char)s[i + take] & 0xC0) == 0x80) {
+                --take;     /* continuation byte: back up to the lead byte */
             }
-            time_tracker_table_init(&ts->table);
-            ts->stack = NULL;
-            pthread_setspecific(g_tls_timer_state, ts);
+            o = out_put(out, o, cap, s + i, take);
+            break;
         }
-        return ts;
+        o = out_put(out, o, cap, s + i, take);
+        i = run;
+        if (i == n) {
+            break;
+        }
+        unsigned char c = (unsigned char)s[i++];
+        char   esc[8];
+        size_t len = 2;
+        esc[0] = '\\';
+        switch (c) {
+            case '"':  esc[1] = '"';  break;
+            case '\\': esc[1] = '\\'; break;
+            case '\n': esc[1] = 'n';  break;
+            case '\r': esc[1] = 'r';  break;
+            case '\t': esc[1] = 't';  break;
+            case '\b': esc[1] = 'b';  break;
+            case '\f': esc[1] = 'f';  break;
+            default:
+                len = (size_t)snprintf(esc, sizeof esc, "\\u%04x", c);
+                break;
+        }
+        if (len > cap - o) {
+            break;
+        }
+        o = out_put(out, o, cap, esc, len);
     }
-    void _tklog_timer_init() {
-        tklog_init_once();
-        TimerState *ts = get_timer_state();
-        if (ts) {
-            time_tracker_table_cleanup(&ts->table);
-            while (ts->stack) {
-                TimerEntry *top = ts->stack;
-                ts->stack = top->next;
-                free(top->location);
-                free(top->path);
-                free(top);
+    return o;
+}
+
+/* Always a closed string: the closing quote is reserved before escaping.
+ * Writes nothing when not even "" fits. */
+static size_t json_string(char *out, size_t o, size_t cap, const char *s, size_t n)
+{
+    if (cap - o < 2) {
+        return o;
+    }
+    o = out_put(out, o, cap, "\"", 1);
+    o = json_escape(out, o, cap - 1, s, n);
+    return out_put(out, o, cap, "\"", 1);
+}
+
+/* A member that ran into cap may be cut anywhere: drop it back to start. */
+static inline size_t json_member(size_t start, size_t o, size_t cap)
+{
+    return o < cap ? o : start;
+}
+
+#ifdef TKLOG_JSON
+    /* {"level":…,"time_ms":…,"tid":…,"file":…,"line":…,"scope":…,"msg":…<fields>,"suppressed":N} */
+    static void json_vlog(uint32_t flags, tklog_level_t level, int line, const char *file,
+                          uint64_t suppressed, const char *fields, const char *fmt, va_list ap)
+    {
+        static const char *levelname[] = {
+            "DEBUG", "INFO", "NOTICE", "WARNING", "ERROR", "CRITICAL", "ALERT", "EMERGENCY" };
+
+        char   out[TKLOG_MSG_MAX];
+        char   tmp[TKLOG_MSG_MAX];
+        size_t cap = sizeof out - 3;    /* "}\n" + NUL */
+        size_t o   = out_put(out, 0, cap, "{", 1);
+
+        /* The line stays valid JSON however long it gets: the fields and the
+         * suppressed count are reserved first (_tklog_kv keeps them well short
+         * of TKLOG_MSG_MAX), the message is cut to what is left, and every
+         * other member is written whole or not at all.                      */
+        size_t tail = (fields ? strlen(fields) : 0) + (suppressed ? 14 + 20 : 0);
+        size_t room = cap - tail;           /* end of "msg" */
+        size_t hcap = room - 8;             /* end of the members before it: "msg":"" */
+        size_t m;
+
+        if (flags & TKLOG_INIT_F_LEVEL) {
+            m = o;
+            o = out_put(out, o, hcap, "\"level\":\"", 9);
+            o = out_put(out, o, hcap, levelname[level], strlen(levelname[level]));
+            o = out_put(out, o, hcap, "\",", 2);
+            o = json_member(m, o, hcap);
+        }
+        if (flags & TKLOG_INIT_F_TIME) {
+            int n = time_render(tmp, sizeof tmp, get_time_ns()) - 3;   /* drop " | " */
+            m = o;
+    #ifdef TKLOG_TIME_ISO8601
+            o = out_put(out, o, hcap, "\"time\":", 7);
+            o = json_string(out, o, hcap, tmp, n > 0 ? (size_t)n : 0);
+    #else
+            o = out_put(out, o, hcap, TIME_FRAC_DIGITS == 9 ? "\"time_ns\":"
+                                    : TIME_FRAC_DIGITS == 6 ? "\"time_us\":" : "\"time_ms\":", 10);
+            o = out_put(out, o, hcap, tmp, n > 2 ? (size_t)n - 2 : 0);  /* drop the unit */
+    #endif
+            o = out_put(out, o, hcap, ",", 1);
+            o = json_member(m, o, hcap);
+        }
+        if (flags & TKLOG_INIT_F_THREAD) {
+            m = o;
+            o = out_put(out, o, hcap, "\"tid\":", 6);
+            o = out_put_u64(out, o, hcap, (uint64_t)pthread_self());
+            o = out_put(out, o, hcap, ",", 1);
+            o = json_member(m, o, hcap);
+        }
+        if (flags & TKLOG_INIT_F_PATH) {
+            m = o;
+            o = out_put(out, o, hcap, "\"file\":", 7);
+            o = json_string(out, o, hcap, file, strlen(file));
+            o = out_put(out, o, hcap, ",\"line\":", 8);
+            o = out_put_i64(out, o, hcap, line);
+            o = out_put(out, o, hcap, ",", 1);
+            o = json_member(m, o, hcap);
+            PathStack *ps = pathstack_get();
+            if (ps && ps->buf[0]) {
+                m = o;
+                o = out_put(out, o, hcap, "\"scope\":", 8);
+                o = json_string(out, o, hcap, ps->buf, strlen(ps->buf));
+                o = out_put(out, o, hcap, ",", 1);
+                o = json_member(m, o, hcap);
             }
         }
+
+        size_t len = fmt_message(tmp, sizeof tmp, fmt, ap);
+        if (len && tmp[len - 1] == '\n') --len;
+        o = out_put(out, o, room, "\"msg\":", 6);
+        o = json_string(out, o, room, tmp, len);
+        if (fields) {
+            o = out_put(out, o, cap, fields, strlen(fields));
+        }
+        if (suppressed) {
+            o = out_put(out, o, cap, ",\"suppressed\":", 14);
+            o = out_put_u64(out, o, cap, suppressed);
+        }
+        memcpy(out + o, "}\n", 3);
+        tklog_emit(level, out, o + 2);
     }
-    void _tklog_timer_start(int line, const char* file) {
-        tklog_init_once();
-        TimerState *ts = get_timer_state();
-        if (!ts) return;
-        PathStack *ps = pathstack_get();
-        if (!ps) {
-            printf("tklog: internal error. pathstack_get failed\n");
-            return;
+#endif /* TKLOG_JSON */
+
+/* Field name as it precedes its value: ,"name": (JSON) or ` name=` (text). */
+static size_t kv_put_key(char *out, size_t o, size_t cap, const char *name)
+{
+#ifdef TKLOG_JSON
+    o = out_put(out, o, cap, ",", 1);
+    o = json_string(out, o, cap, name, strlen(name));
+    return out_put(out, o, cap, ":", 1);
+#else
+    o = out_put(out, o, cap, " ", 1);
+    o = out_put(out, o, cap, name, strlen(name));
+    return out_put(out, o, cap, "=", 1);
+#endif
+}
+
+static size_t kv_put_value(char *out, size_t o, size_t cap, const tklog_value_t *v)
+{
+    switch (v->type) {
+        case TKLOG_KV_I64:
+            return out_put_i64(out, o, cap, v->v.i);
+        case TKLOG_KV_U64:
+            return out_put_u64(out, o, cap, v->v.u);
+        case TKLOG_KV_BOOL:
+            return v->v.u ? out_put(out, o, cap, "true", 4) : out_put(out, o, cap, "false", 5);
+        case TKLOG_KV_F64: {
+            char num[32];
+    #ifdef TKLOG_JSON
+            if (!fmt_finite(v->v.f)) {
+                return out_put(out, o, cap, "null", 4);
+            }
+    #endif
+            int n = snprintf(num, sizeof num, "%.15g", v->v.f);
+            return out_put(out, o, cap, num, n > 0 ? (size_t)n : 0);
         }
-        char temp_location[128];
-        int n = snprintf(temp_location, sizeof temp_location, "%s:%d", file, line);
-        if (n < 0) {
-            printf("tklog: internal error. snprintf failed\n");
-            return;
+        case TKLOG_KV_STR: {
+            const char *s = v->v.s;
+            if (!s) {
+                return out_put(out, o, cap, "null", 4);
+            }
+            size_t n = strlen(s);
+    #ifndef TKLOG_JSON
+            /* logfmt: bare unless empty or containing blanks, '=' or quotes */
+            bool bare = n > 0;
+            for (size_t i = 0; bare && i < n; ++i) {
+                unsigned char c = (unsigned char)s[i];
+                bare = c > ' ' && c != '=' && c != '"' && c != '\\';
+            }
+            if (bare) {
+                return out_put(out, o, cap, s, n);
+            }
+    #endif
+            return json_string(out, o, cap, s, n);
         }
-        time_tracker_table_itr itr = time_tracker_table_get(&ts->table, temp_location);
-        if (time_tracker_table_is_end(itr)) {
-            char* key = strdup(temp_location);
-            if (!key) {
-                printf("tklog: out of memory for strdup\n");
-                return;
+    }
+    return o;
+}
+
+/* Rendered field names of a _kv site, built on its first call. */
+typedef struct KvKeys {
+    uint32_t n;
+    uint16_t off[TKLOG_KV_MAX + 1];     /* name i is buf[off[i] .. off[i+1]) */
+    char     buf[];
+} KvKeys;
+
+static const KvKeys *kv_intern(tklog_callsite_t *cs, va_list ap)
+{
+    const KvKeys *keys = __atomic_load_n((const KvKeys**)&cs->kv, __ATOMIC_ACQUIRE);
+    if (keys) {
+        return keys;
+    }
+    char     buf[TKLOG_MSG_MAX];
+    uint16_t off[TKLOG_KV_MAX + 1];
+    uint32_t n = 0;
+    size_t   o = 0;
+    va_list  aq;
+    va_copy(aq, ap);
+    for (const char *name; n < TKLOG_KV_MAX && (name = va_arg(aq, const char*)); ++n) {
+        (void)va_arg(aq, tklog_value_t);
+        off[n] = (uint16_t)o;
+        o = kv_put_key(buf, o, sizeof buf, name);
+    }
+    va_end(aq);
+    off[n] = (uint16_t)o;
+
+#ifdef TKLOG_MEMORY
+    KvKeys *fresh = (KvKeys*)original_malloc(sizeof *fresh + o);
+#else
+    KvKeys *fresh = (KvKeys*)malloc(sizeof *fresh + o);
+#endif
+    if (!fresh) {
+        return NULL;    /* render the names on every call instead */
+    }
+    fresh->n = n;
+    memcpy(fresh->off, off, sizeof fresh->off);
+    memcpy(fresh->buf, buf, o);
+    const void *expected = NULL;
+    if (!__atomic_compare_exchange_n(&cs->kv, &expected, (const void*)fresh, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+#ifdef TKLOG_MEMORY
+        original_free(fresh);
+#else
+        free(fresh);
+#endif
+        return (const KvKeys*)expected;
+    }
+    return fresh;
+}
+
+static void kv_emit(uint32_t flags, tklog_callsite_t *cs, const char *fields, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    bin_vlog(flags, cs, 0, fields, fmt, ap);
+    va_end(ap);
+}
+
+void _tklog_kv(uint32_t flags, tklog_callsite_t *cs, const char *msg, ...)
+{
+    if (!callsite_ready(cs)) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, msg);
+    const KvKeys *keys = kv_intern(cs, ap);
+
+    /* capped short of the line so the message and header still fit; a   */
+    /* field that runs into the cap is dropped, except a string value,    */
+    /* which json_string cuts and closes                                  */
+    char   fields[TKLOG_MSG_MAX];
+    size_t cap = sizeof fields - 256;
+    size_t o   = 0;
+    for (uint32_t i = 0; i < TKLOG_KV_MAX; ++i) {
+        const char *name = va_arg(ap, const char*);
+        if (!name) {
+            break;
+        }
+        tklog_value_t v = va_arg(ap, tklog_value_t);
+        size_t start = o;
+        if (keys && i < keys->n) {
+            o = out_put(fields, o, cap, keys->buf + keys->off[i], (size_t)(keys->off[i + 1] - keys->off[i]));
+        } else {
+            o = kv_put_key(fields, o, cap, name);
+        }
+        size_t key_end = o;
+        o = kv_put_value(fields, o, cap, &v);
+        if (o == cap) {
+            if (v.type != TKLOG_KV_STR || !v.v.s || o == key_end) {
+                o = start;
             }
-            TimeTracker tracker = {0};
-            tracker.total_time_us = 0;
-            tracker.count = 0;
-            call_path_time_table_init(&tracker.call_paths);
-            itr = time_tracker_table_insert(&ts->table, key, tracker);
-            if (time_tracker_table_is_end(itr)) {
-                printf("tklog: time_table is out of memory because time_tracker_table_insert failed\n");
-                free(key);
-                return;
+            break;
+        }
+    }
+    va_end(ap);
+    fields[o] = '\0';
+    kv_emit(flags, cs, fields, "%s", msg);
+}
+
+/* Hands a finished line (NUL‑terminated, `len` bytes) to the output stage. */
+static void tklog_emit(tklog_level_t level, const char *msg, size_t len)
+{
+#ifdef TKLOG_ASYNC
+    if (async_push(level, msg, len)) {
+        return;
+    }
+#endif
+    tklog_sink_write(level, msg, len);
+}
+
+void tklog_flush(void)
+{
+    tklog_init_once();
+#ifdef TKLOG_ASYNC
+    async_drain();
+#endif
+#ifdef TKLOG_BUFFERED
+    outbuf_flush_all();
+#endif
+#ifdef TKLOG_BINARY
+    bin_flush();
+#endif
+}
+
+/* ============================  CRASH DUMP  ============================= */
+/*  SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT (and SIGINT with TKLOG_MEMORY)
+ *  dump the tracked state using async‑signal‑safe steps only, so a crash
+ *  inside malloc or while g_tklog_mutex is held still produces it:
+ *    - text is assembled with fmt_u64/fmt_hex into a static buffer and
+ *      written with write(2) to a descriptor opened at init (a dup of
+ *      stderr, or the one given to tklog_set_crash_fd());
+ *    - the site table, the allocation shards and the crashing thread's
+ *      timers are read without taking their locks;
+ *    - the handler runs on a per‑thread alternate stack (installed when a
+ *      thread first logs or allocates through tklog), so a stack overflow
+ *      is reported too.
+ *  The default action is then restored and the signal re‑raised, so exit
+ *  status and core dumps are unchanged.  Only signals still at SIG_DFL
+ *  when tklog initialises are taken; handlers the program or a sanitizer
+ *  installed first, and ignored signals, are left as they are.           */
+#ifdef TKLOG_CRASH_HANDLER
+    #ifndef TKLOG_CRASH_BLOCKS
+        #define TKLOG_CRASH_BLOCKS 1024     /* live blocks listed, the rest are counted */
+    #endif
+    #ifndef TKLOG_CRASH_ALTSTACK
+        #define TKLOG_CRASH_ALTSTACK (64 * 1024)
+    #endif
+
+    static int            g_crash_fd = STDERR_FILENO;
+    static int            g_crash_fd_owned;     /* our dup, closed when replaced */
+    static int            g_crash_active;
+    static pthread_key_t  g_tls_crash_stack;
+    static char           g_crash_buf[4096];
+    static size_t         g_crash_len;
+
+    static void crash_flush(void)
+    {
+        const char *p = g_crash_buf;
+        while (g_crash_len) {
+            ssize_t n = write(__atomic_load_n(&g_crash_fd, __ATOMIC_RELAXED), p, g_crash_len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
             }
+            p           += n;
+            g_crash_len -= (size_t)n;
         }
-        TimerEntry* entry = malloc(sizeof(TimerEntry));
-        if (!entry) {
-            printf("tklog: out of memory for TimerEntry\n");
-            return;
+        g_crash_len = 0;
+    }
+
+    static void crash_put(const char *s, size_t n)
+    {
+        while (n) {
+            if (g_crash_len == sizeof g_crash_buf) {
+                crash_flush();
+            }
+            size_t k = sizeof g_crash_buf - g_crash_len;
+            k = n < k ? n : k;
+            memcpy(g_crash_buf + g_crash_len, s, k);
+            g_crash_len += k;
+            s += k;
+            n -= k;
         }
-        entry->location = strdup(temp_location);
-        if (!entry->location) {
-            printf("tklog: out of memory for strdup\n");
-            free(entry);
-            return;
+    }
+
+    static void crash_str(const char *s) { crash_put(s, strlen(s)); }
+    static void crash_u64(uint64_t v)    { char t[20]; crash_put(t, fmt_u64(t, v)); }
+    static void crash_hex(uint64_t v)    { char t[18] = "0x"; crash_put(t, 2 + fmt_hex(t + 2, v, false)); }
+
+    static const char *crash_signame(int sig)
+    {
+        switch (sig) {
+            case SIGSEGV: return "SIGSEGV";
+            case SIGBUS:  return "SIGBUS";
+            case SIGFPE:  return "SIGFPE";
+            case SIGILL:  return "SIGILL";
+            case SIGABRT: return "SIGABRT";
+            case SIGINT:  return "SIGINT";
+            default:      return "signal";
         }
-        entry->path = strdup(ps->buf ? ps->buf : "");
-        if (!entry->path) {
-            printf("tklog: out of memory for strdup\n");
-            free(entry->location);
-            free(entry);
+    }
+
+#ifdef TKLOG_MEMORY
+    /* outermost scope first, as scope_format prints it */
+    static void crash_scope(const ScopeTable *t, uint32_t id, int depth)
+    {
+        if (!t || !id || depth > 256) {
             return;
         }
-        entry->start_time = get_time_us();
-        entry->next = ts->stack;
-        ts->stack = entry;
+        crash_scope(t, t->nodes[id].parent, depth + 1);
+        crash_str(t->nodes[id].file);
+        crash_str(":");
+        crash_u64((uint64_t)t->nodes[id].line);
+        crash_str(" → ");
     }
-    void _tklog_timer_stop(int line, const char* file) {
-        tklog_init_once();
-        uint64_t end_time = get_time_us();
-        TimerState *ts = get_timer_state();
-        if (!ts) return;
-        if (!ts->stack) {
-            printf("tklog: tklog_timer_stop is called without a corresponding tklog_timer_start beforehand\n");
-            return;
+
+    static void crash_dump_memory(void)
+    {
+        crash_str("live memory by site:\n");
+        for (size_t i = 0; i <= TKLOG_MEMORY_SITES; ++i) {
+            const MemSite *site = i < TKLOG_MEMORY_SITES ? __atomic_load_n(&g_mem_sites[i], __ATOMIC_ACQUIRE) : &g_mem_site_other;
+            if (!site) {
+                continue;
+            }
+            uint64_t frees  = __atomic_load_n(&site->frees, __ATOMIC_RELAXED);
+            uint64_t allocs = __atomic_load_n(&site->allocs, __ATOMIC_RELAXED);
+            uint64_t live   = __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED);
+            if (!live && allocs <= frees) {
+                continue;
+            }
+            crash_str("\t");
+            crash_u64(live);
+            crash_str(" bytes | ");
+            crash_u64(allocs > frees ? allocs - frees : 0);
+            crash_str(" blocks | ");
+            crash_str(site->label);
+            crash_str("\n");
         }
-        TimerEntry *top = ts->stack;
-        ts->stack = top->next;
-        uint64_t delta = end_time - top->start_time;
-        PathStack *ps = pathstack_get();
-        if (!ps) {
-            printf("tklog: internal error. pathstack_get failed\n");
-            free(top->location);
-            free(top->path);
-            free(top);
-            return;
+
+        /* shard order, not newest first: sorting would need memory */
+        crash_str("unfreed memory:\n");
+        const ScopeTable *scopes = __atomic_load_n(&g_scopes, __ATOMIC_ACQUIRE);
+        size_t shown = 0, hidden = 0;
+        for (size_t s = 0; s < TKLOG_MEMORY_SHARDS; ++s) {
+            MemShard  *sh    = &g_mem_shards[s];
+            size_t     cap   = __atomic_load_n(&sh->cap, __ATOMIC_ACQUIRE);
+            MemEntry **slots = __atomic_load_n(&sh->slots, __ATOMIC_RELAXED);
+            for (size_t i = 0; slots && i < cap; ++i) {
+                const MemEntry *e = __atomic_load_n(&slots[i], __ATOMIC_RELAXED);
+                if (!e) {
+                    continue;
+                }
+                if (shown == TKLOG_CRASH_BLOCKS) {
+                    hidden += 1;
+                    continue;
+                }
+                shown += 1;
+                crash_str("\t");
+                crash_u64(e->t_ns / 1000000ULL - g_start_ms);
+                crash_str("ms | tid ");
+                crash_u64((unsigned long)e->tid);
+                crash_str(" | address ");
+                crash_hex((uint64_t)(uintptr_t)e->ptr);
+                crash_str(" | ");
+                crash_u64(e->size);
+                crash_str(" bytes | at ");
+                if (e->caller) {
+                    crash_hex((uint64_t)(uintptr_t)e->caller);
+                } else {
+                    crash_scope(scopes, e->scope, 0);
+                    crash_str(e->file);
+                    crash_str(":");
+                    crash_u64((uint64_t)e->line);
+                }
+                crash_str("\n");
+            }
         }
-        char stop_location[128];
-        int n = snprintf(stop_location, sizeof stop_location, "%s:%d", file, line);
-        if (n < 0) {
-            printf("tklog: internal error. snprintf failed\n");
-            free(top->location);
-            free(top->path);
-            free(top);
-            return;
+        if (hidden) {
+            crash_str("\t... ");
+            crash_u64(hidden);
+            crash_str(" more\n");
         }
-        size_t needed = strlen(top->path) + strlen(top->location) + strlen(ps->buf) + strlen(stop_location) + 20;
-        char* call_path = malloc(needed);
-        if (!call_path) {
-            printf("tklog: out of memory for call_path\n");
-            free(top->location);
-            free(top->path);
-            free(top);
+    }
+#endif
+
+#ifdef TKLOG_TIMER
+    /* the crashing thread's timers; other threads' tables are private to them */
+    static void crash_dump_timers(void)
+    {
+        TimerState *ts = pthread_getspecific(g_tls_timer_state);
+        if (!ts) {
             return;
         }
-        if (strlen(top->path) == 0 && strlen(ps->buf) == 0)
-            snprintf(call_path, needed, "%s to %s", top->location, stop_location);
-        else
-            snprintf(call_path, needed, "%s → %s to %s → %s", top->path, top->location, ps->buf, stop_location);
-        time_tracker_table_itr itr = time_tracker_table_get(&ts->table, top->location);
-        if (time_tracker_table_is_end(itr)) {
-            printf("tklog: internal error. no tracker for start location\n");
-            free(call_path);
-            free(top->location);
-            free(top->path);
-            free(top);
-            return;
+        crash_str("timers (crashing thread):\n");
+        uint32_t nsites = __atomic_load_n(&g_timer_nsites, __ATOMIC_ACQUIRE);
+        for (uint32_t id = 1; id < nsites; ++id) {
+            if (!ts->totals.sites[id].count) {
+                continue;
+            }
+            crash_str("\t");
+            crash_u64(ts->totals.sites[id].total_ns / 1000000);
+            crash_str("ms | ");
+            crash_u64(ts->totals.sites[id].count);
+            crash_str(" calls | ");
+            crash_str(g_timer_sites[id]->name);
+            crash_str(":");
+            crash_u64((uint64_t)g_timer_sites[id]->line);
+            crash_str("\n");
         }
-        TimeTracker* tracker = &itr.data->val;
-        tracker->total_time_us += delta;
-        tracker->count++;
-        call_path_time_table_itr cp_itr = call_path_time_table_get(&tracker->call_paths, call_path);
-        if (call_path_time_table_is_end(cp_itr)) {
-            CallPathTime cpt = {0};
-            cpt.total_time_us = delta;
-            cpt.count = 1;
-            cp_itr = call_path_time_table_insert(&tracker->call_paths, call_path, cpt);
-            if (call_path_time_table_is_end(cp_itr)) {
-                printf("tklog: call_paths is out of memory because call_path_time_table_insert failed\n");
-                free(call_path);
+        uint64_t now = get_time_ns();
+        for (unsigned d = ts->depth; d-- > 0;) {
+            const TimerFrame *open = &ts->stack[d];
+            crash_str("\topen for ");
+            crash_u64(now > open->start_ns ? (now - open->start_ns) / 1000000 : 0);
+            crash_str("ms | ");
+            if (open->site) {
+                crash_str(g_timer_sites[open->site]->name);
+                crash_str(":");
+                crash_u64((uint64_t)g_timer_sites[open->site]->line);
+            } else {
+                crash_str("?");
             }
-        } else {
-            CallPathTime* cpt = &cp_itr.data->val;
-            cpt->total_time_us += delta;
-            cpt->count++;
-            free(call_path);
+            crash_str("\n");
         }
-        free(top->location);
-        free(top->path);
-        free(top);
     }
-    void tklog_timer_print() {
-        TimerState *ts = get_timer_state();
-        if (!ts) return;
-        uint64_t max_time_ms = 0;
-        uint64_t max_calls = 0;
-        for (time_tracker_table_itr itr = time_tracker_table_first(&ts->table);
-             !time_tracker_table_is_end(itr);
-             itr = time_tracker_table_next(itr)) {
-            TimeTracker* tracker = &itr.data->val;
-            uint64_t time_ms = tracker->total_time_us / 1000;
-            if (time_ms > max_time_ms) max_time_ms = time_ms;
-            if (tracker->count > max_calls) max_calls = tracker->count;
-            for (call_path_time_table_itr cp_itr = call_path_time_table_first(&tracker->call_paths);
-                 !call_path_time_table_is_end(cp_itr);
-                 cp_itr = call_path_time_table_next(cp_itr)) {
-                CallPathTime* cpt = &cp_itr.data->val;
-                uint64_t cp_time_ms = cpt->total_time_us / 1000;
-                if (cp_time_ms > max_time_ms) max_time_ms = cp_time_ms;
-                if (cpt->count > max_calls) max_calls = cpt->count;
+#endif
+
+    static void crash_handler(int sig, siginfo_t *info, void *uctx)
+    {
+        (void)uctx;
+        if (__atomic_exchange_n(&g_crash_active, 1, __ATOMIC_ACQ_REL)) {
+            for (;;) {
+                pause();    /* another thread is dumping and will re-raise */
             }
         }
-        int time_digits = snprintf(NULL, 0, "%" PRIu64, max_time_ms);
-        int calls_digits = snprintf(NULL, 0, "%" PRIu64, max_calls);
-        for (time_tracker_table_itr itr = time_tracker_table_first(&ts->table);
-             !time_tracker_table_is_end(itr);
-             itr = time_tracker_table_next(itr)) 
-        {
-            const char* start_loc = itr.data->key;
-            TimeTracker* tracker = &itr.data->val;
-            double avg = tracker->count > 0 ? (double)tracker->total_time_us / tracker->count : 0.0;
-            printf("%*" PRIu64 "ms | %*" PRIu64 " calls | %.3fms avg | %s\n",
-                   time_digits, tracker->total_time_us/1000, calls_digits, tracker->count, avg/1000, start_loc);
-            for (call_path_time_table_itr cp_itr = call_path_time_table_first(&tracker->call_paths);
-                 !call_path_time_table_is_end(cp_itr);
-                 cp_itr = call_path_time_table_next(cp_itr)) {
-                const char* path = cp_itr.data->key;
-                CallPathTime* cpt = &cp_itr.data->val;
-                double cp_avg = cpt->count > 0 ? (double)cpt->total_time_us / cpt->count : 0.0;
-                printf("%*" PRIu64 "ms | %*" PRIu64 " calls | %.3fms avg |     %s\n",
-                       time_digits, cpt->total_time_us/1000, calls_digits, cpt->count, cp_avg/1000, path);
+        crash_str("\ntklog: caught ");
+        crash_str(crash_signame(sig));
+        if (sig == SIGSEGV || sig == SIGBUS || sig == SIGFPE || sig == SIGILL) {
+            crash_str(" at address ");
+            crash_hex((uint64_t)(uintptr_t)info->si_addr);
+        }
+        crash_str(", dumping state before exit:\n");
+#ifdef TKLOG_MEMORY
+        crash_dump_memory();
+#endif
+#ifdef TKLOG_TIMER
+        crash_dump_timers();
+#endif
+        crash_flush();
+        raise(sig);     /* SA_RESETHAND restored the default action */
+        _exit(EXIT_FAILURE);
+    }
+
+    static void crash_stack_free(void *ptr)
+    {
+        stack_t cur;
+        if (sigaltstack(NULL, &cur) == 0 && cur.ss_sp == ptr) {
+            stack_t off = { .ss_flags = SS_DISABLE };
+            sigaltstack(&off, NULL);
+        }
+#ifdef TKLOG_MEMORY
+        original_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+    /* first reached from a tracked allocation, possibly before crash_init() */
+    static pthread_once_t g_crash_stack_once = PTHREAD_ONCE_INIT;
+
+    static void crash_stack_key_init(void)
+    {
+        pthread_key_create(&g_tls_crash_stack, crash_stack_free);
+    }
+
+    /* one alternate stack per thread, unless the program installed its own */
+    static void crash_thread_init(void)
+    {
+        stack_t cur;
+        pthread_once(&g_crash_stack_once, crash_stack_key_init);
+        if (pthread_getspecific(g_tls_crash_stack) || sigaltstack(NULL, &cur) != 0 || !(cur.ss_flags & SS_DISABLE)) {
+            return;
+        }
+#ifdef TKLOG_MEMORY
+        void *mem = original_malloc(TKLOG_CRASH_ALTSTACK);
+#else
+        void *mem = malloc(TKLOG_CRASH_ALTSTACK);
+#endif
+        if (!mem) {
+            return;
+        }
+        stack_t ss = { .ss_sp = mem, .ss_size = TKLOG_CRASH_ALTSTACK, .ss_flags = 0 };
+        if (sigaltstack(&ss, NULL) != 0) {
+            crash_stack_free(mem);
+            return;
+        }
+        pthread_setspecific(g_tls_crash_stack, mem);
+    }
+
+    static void crash_init(void)
+    {
+        int fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+        if (fd >= 0) {
+            g_crash_fd       = fd;
+            g_crash_fd_owned = 1;
+        }
+        crash_thread_init();
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sa_sigaction = crash_handler;
+        sa.sa_flags     = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        static const int sigs[] = {
+            SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT,
+#ifdef TKLOG_MEMORY
+            SIGINT,     /* leak dump on Ctrl-C; timer-only builds leave it alone */
+#endif
+        };
+        for (size_t i = 0; i < sizeof sigs / sizeof sigs[0]; ++i) {
+            struct sigaction old;
+            if (sigaction(sigs[i], NULL, &old) != 0 || (old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL) {
+                continue;   /* the program (or a sanitizer) handles or ignores it */
             }
+            sigaction(sigs[i], &sa, NULL);
         }
     }
-    void _tklog_timer_clear() {
-        printf("clearing tklog_timer data\n");
+
+    void tklog_set_crash_fd(int fd)
+    {
         tklog_init_once();
-        TimerState *ts = get_timer_state();
-        if (ts) {
-            time_tracker_table_cleanup(&ts->table);
-            while (ts->stack) {
-                TimerEntry *top = ts->stack;
-                ts->stack = top->next;
-                free(top->location);
-                free(top->path);
-                free(top);
-            }
+        int old = __atomic_exchange_n(&g_crash_fd, fd, __ATOMIC_ACQ_REL);
+        if (g_crash_fd_owned && old != fd) {
+            close(old);
         }
+        g_crash_fd_owned = 0;
+    }
+#else
+    void tklog_set_crash_fd(int fd)
+    {
+        (void)fd;
     }
 #endif
 
 /* =============================  API impl  ============================== */
 
 
+#ifdef _WIN32
 static void signal_handler(int sig) {
     (void)sig;
     // Minimal message (async-safe: use write() instead of printf)
@@ -581,6 +4503,7 @@ static void signal_handler(int sig) {
     // Re-raise signal or exit to avoid infinite loops
     _exit(EXIT_FAILURE);
 }
+#endif
 
 bool tklog_output_stdio(const char *msg, void *user)
 {
@@ -597,100 +4520,227 @@ static void tklog_init_once(void)
 
 static void tklog_init_once_impl(void)
 {
-    pthread_key_create(&g_tls_path, pathstack_free);
-    g_start_ms = get_time_ms();
-    
-#ifdef TKLOG_MEMORY
-    /* Store original memory functions before they get redefined */
-    original_malloc = malloc;
-    original_calloc = calloc;
-    original_realloc = realloc;
-    original_strdup = strdup;
-    original_free = free;
+#ifndef _WIN32
+    atexit(mmap_default_close); /* registered first: runs after everything that may still log */
+#endif
+    pthread_once(&g_path_once, pathstack_key_init);
+    clock_init();
+    callsite_init();
+#ifdef TKLOG_TIME_ISO8601
+    pthread_key_create(&g_tls_clock, clockcache_free);
 #endif
     
+#ifdef TKLOG_BUFFERED
+    pthread_key_create(&g_tls_outbuf, outbuf_free);
+    atexit(outbuf_flush_all);   /* registered first: runs after the other exit hooks */
+    #if TKLOG_BUFFERED_FLUSH_MS > 0
+    outbuf_flusher_start();
+    #endif
+#endif
+
+#ifdef _WIN32
     (void)signal_handler;
-#ifdef TKLOG_MEMORY
+    #ifdef TKLOG_MEMORY
     signal(SIGSEGV, signal_handler);
     signal(SIGABRT, signal_handler);
     signal(SIGINT, signal_handler);
+    #endif
+#endif
+#ifdef TKLOG_MEMORY
     atexit(tklog_memory_dump);
 #endif
 
 #ifdef TKLOG_TIMER
     pthread_key_create(&g_tls_timer_state, timer_state_free);
 #endif
+#ifdef TKLOG_TRACE
+    pthread_key_create(&g_tls_trace, trace_ring_free);
+#endif
+
+#ifdef TKLOG_CRASH_HANDLER
+    crash_init();   /* after the keys whose state it dumps */
+#endif
+
+#ifdef TKLOG_BINARY
+    bin_open();
+#endif
+
+#ifdef TKLOG_ASYNC
+    async_start();  /* registered last so its atexit drain runs before the memory dump */
+#endif
+#if defined(TKLOG_TIMER) && defined(TKLOG_TIMER_REPORT_MS)
+    timer_report_start();   /* after async_start: its final report is drained at exit */
+#endif
 }
 
-void _tklog(uint32_t flags, tklog_level_t level, int line, const char *file, const char *fmt, ...)
+static void tklog_vlog(uint32_t flags, tklog_level_t level, int line, const char *file, uint64_t suppressed, const char *fields, const char *fmt, va_list ap)
 {
     tklog_init_once();
+#ifdef TKLOG_JSON
+    json_vlog(flags, level, line, file, suppressed, fields, fmt, ap);
+    return;
+#endif
 
-    static const char *levelstr[] = {
-        "DEBUG    ", "INFO     ", "NOTICE   ", "WARNING  ",
-        "ERROR    ", "CRITICAL ", "ALERT    ", "EMERGENCY" };
+    static const char levelstr[][13] = {
+        "DEBUG     | ", "INFO      | ", "NOTICE    | ", "WARNING   | ",
+        "ERROR     | ", "CRITICAL  | ", "ALERT     | ", "EMERGENCY | " };
 
-    char msgbuf[2048];
-    char *p = msgbuf;
-    size_t n = 0;
+    char   msgbuf[TKLOG_MSG_MAX];
+    char   num[24];
+    size_t o = 0;
 
     /* level */
     if (flags & TKLOG_INIT_F_LEVEL) {
-        n = snprintf(p, sizeof msgbuf, "%s | ", levelstr[level]);
-        p += n;
+        fmt_put(msgbuf, &o, sizeof msgbuf, levelstr[level], 12);
     }
 
     /* time */
     if (flags & TKLOG_INIT_F_TIME) {
-        uint64_t t_ms = get_time_ms() - g_start_ms;
-        n = snprintf(p, sizeof msgbuf - (p - msgbuf), "%" PRIu64 "ms | ", (uint64_t)t_ms);
-        p += n;
+        o += (size_t)time_render(msgbuf + o, sizeof msgbuf - o, get_time_ns());
     }
 
     /* thread */
     if (flags & TKLOG_INIT_F_THREAD) {
         pthread_t tid = pthread_self();
-        n = snprintf(p, sizeof msgbuf - (p - msgbuf), "tid %lld | ", (unsigned long long)tid);
-        p += n;
+        fmt_put(msgbuf, &o, sizeof msgbuf, "tid ", 4);
+        fmt_put(msgbuf, &o, sizeof msgbuf, num, fmt_i64(num, (int64_t)(unsigned long long)tid));
+        fmt_put(msgbuf, &o, sizeof msgbuf, " | ", 3);
     }
 
-    /* path */
+    /* path: call stack (if any) → current file:line */
     if (flags & TKLOG_INIT_F_PATH) {
         PathStack *ps = pathstack_get();
         if (ps && ps->buf[0]) {
-            /* Show call stack path + current file:line */
-            n = snprintf(p, sizeof msgbuf - (p - msgbuf), "%s → %s:%d | ", ps->buf, file, line);
-            p += n;
-        } else {
-            /* Show just current file:line when no call stack */
-            n = snprintf(p, sizeof msgbuf - (p - msgbuf), "%s:%d | ", file, line);
-            p += n;
+            fmt_put(msgbuf, &o, sizeof msgbuf, ps->buf, strlen(ps->buf));
+            fmt_put(msgbuf, &o, sizeof msgbuf, " → ", strlen(" → "));
         }
+        fmt_put(msgbuf, &o, sizeof msgbuf, file, strlen(file));
+        fmt_put(msgbuf, &o, sizeof msgbuf, ":", 1);
+        fmt_put(msgbuf, &o, sizeof msgbuf, num, fmt_i64(num, line));
+        fmt_put(msgbuf, &o, sizeof msgbuf, " | ", 3);
     }
 
     /* user message */
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(p, sizeof msgbuf - (p - msgbuf), fmt, ap);
-    va_end(ap);
+    size_t len = o + fmt_message(msgbuf + o, sizeof msgbuf - o, fmt, ap);
+
+    /* structured fields, then how many calls a rate‑limited site dropped */
+    if (fields) {
+        if (len && msgbuf[len - 1] == '\n') msgbuf[--len] = '\0';
+        snprintf(msgbuf + len, sizeof msgbuf - len, "%s", fields);
+        len = strlen(msgbuf);
+    }
+    if (suppressed) {
+        if (len && msgbuf[len - 1] == '\n') msgbuf[--len] = '\0';
+        snprintf(msgbuf + len, sizeof msgbuf - len, " (suppressed %" PRIu64 " similar messages)", suppressed);
+        len = strlen(msgbuf);
+    }
 
     /* ensure newline */
-    size_t len = strlen(msgbuf);
     if (len + 1 < sizeof msgbuf && msgbuf[len - 1] != '\n') {
         msgbuf[len]   = '\n';
         msgbuf[len+1] = '\0';
+        len += 1;
     }
 
-    /* lock, write, unlock */
-    pthread_mutex_lock(&g_tklog_mutex);
-    TKLOG_OUTPUT_FN(msgbuf, TKLOG_OUTPUT_USERPTR);
-    pthread_mutex_unlock(&g_tklog_mutex);
+    tklog_emit(level, msgbuf, len);
+}
+
+void _tklog(uint32_t flags, tklog_level_t level, int line, const char *file, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    tklog_vlog(flags, level, line, file, 0, NULL, fmt, ap);
+    va_end(ap);
 }
 
 /* -------------------------  Scope tracing  ----------------------------- */
 #ifdef TKLOG_SCOPE
+  #ifdef TKLOG_TRACE
+    void _tklog_scope_start(int line, const char *file) { tklog_init_once(); pathstack_push(file, line); trace_scope_begin(file, line); }
+    void _tklog_scope_end  (void)                       { trace_scope_end(); pathstack_pop(); }
+  #else
     void _tklog_scope_start(int line, const char *file) { tklog_init_once(); pathstack_push(file, line); }
     void _tklog_scope_end  (void)                       { pathstack_pop(); }
+  #endif
+#endif
+
+/* -------------------------  Trace export  ------------------------------ */
+/*  Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev): one
+ *  complete ("X") event per recorded span, timestamps in microseconds since
+ *  tklog started, one track per thread named after its log thread id.
+ *  Each ring is copied first; slots the owner overwrote meanwhile are
+ *  dropped by re-reading its head.  Open spans are not written.        */
+#ifdef TKLOG_TRACE
+    static bool trace_put(FILE *f, const char *buf, size_t len)
+    {
+        return fwrite(buf, 1, len, f) == len;
+    }
+
+    int tklog_trace_write(const char *path)
+    {
+        tklog_init_once();
+        FILE *f = fopen(path, "w");
+        if (!f) {
+            return -1;
+        }
+#ifdef TKLOG_MEMORY
+        TraceEvent *copy = (TraceEvent*)original_malloc(sizeof(TraceEvent) * TKLOG_TRACE_EVENTS);
+#else
+        TraceEvent *copy = (TraceEvent*)malloc(sizeof(TraceEvent) * TKLOG_TRACE_EVENTS);
+#endif
+        if (!copy) {
+            fclose(f);
+            return -1;
+        }
+        int  pid = (int)getpid();
+        char line[TKLOG_MSG_MAX];
+        int  n  = snprintf(line, sizeof line,
+                           "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                           "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"tklog\"}}", pid);
+        bool ok = trace_put(f, line, (size_t)n);
+
+        pthread_mutex_lock(&g_trace_lock);
+        for (const TraceRing *r = g_trace_rings; r && ok; r = r->next) {
+            n  = snprintf(line, sizeof line,
+                          ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%" PRIu32 ",\"args\":{\"name\":\"tid %" PRIu64 "%s\"}}",
+                          pid, r->seq, r->thread, r->exited ? " (exited)" : "");
+            ok = trace_put(f, line, (size_t)n);
+
+            uint64_t head  = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            uint64_t first = head > TKLOG_TRACE_EVENTS ? head - TKLOG_TRACE_EVENTS : 0;
+            for (uint64_t i = first; i < head; ++i) {
+                const TraceEvent *e = &r->events[i & (TKLOG_TRACE_EVENTS - 1)];
+                TraceEvent       *c = &copy[i - first];
+                c->start_ns = __atomic_load_n(&e->start_ns, __ATOMIC_ACQUIRE);
+                c->dur_ns   = __atomic_load_n(&e->dur_ns, __ATOMIC_ACQUIRE);
+                c->file     = __atomic_load_n(&e->file, __ATOMIC_ACQUIRE);
+                c->line     = __atomic_load_n(&e->line, __ATOMIC_ACQUIRE);
+                c->kind     = __atomic_load_n(&e->kind, __ATOMIC_ACQUIRE);
+            }
+            /* the owner may be rewriting the slot of index `now` - TKLOG_TRACE_EVENTS */
+            uint64_t now   = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            uint64_t valid = now + 1 > TKLOG_TRACE_EVENTS ? now + 1 - TKLOG_TRACE_EVENTS : 0;
+            for (uint64_t i = valid > first ? valid : first; i < head && ok; ++i) {
+                const TraceEvent *c = &copy[i - first];
+                size_t o = out_put(line, 0, sizeof line, ",\n{\"name\":\"", 11);
+                o = json_escape(line, o, sizeof line - 128, c->file, strlen(c->file));
+                uint64_t ts = c->start_ns > g_start_ns ? c->start_ns - g_start_ns : 0;
+                n = snprintf(line + o, sizeof line - o,
+                             ":%" PRIu32 "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%" PRIu32 "}",
+                             c->line, c->kind == TRACE_SCOPE ? "scope" : "timer",
+                             ts / 1000, (unsigned)(ts % 1000), c->dur_ns / 1000, (unsigned)(c->dur_ns % 1000), pid, r->seq);
+                ok = n > 0 && trace_put(f, line, o + (size_t)n);
+            }
+        }
+        pthread_mutex_unlock(&g_trace_lock);
+#ifdef TKLOG_MEMORY
+        original_free(copy);
+#else
+        free(copy);
+#endif
+        ok = ok && trace_put(f, "\n]}\n", 4);
+        return fclose(f) == 0 && ok ? 0 : -1;
+    }
 #endif
 
 /* -------------------------  Memory API  -------------------------------- */
@@ -698,14 +4748,14 @@ void _tklog(uint32_t flags, tklog_level_t level, int line, const char *file, con
     void *tklog_malloc(size_t size, const char *file, int line)
     {
         void *p = original_malloc(size);
-        mem_add(p, size, file, line);
+        mem_add(p, size, file, line, NULL);
         return p;
     }
 
     void *tklog_calloc(size_t nmemb, size_t size, const char *file, int line)
     {
         void *p = original_calloc(nmemb, size);
-        mem_add(p, nmemb * size, file, line);
+        mem_add(p, nmemb * size, file, line, NULL);
         return p;
     }
     void *tklog_realloc(void *ptr, size_t size, const char *file, int line)
@@ -717,9 +4767,12 @@ void _tklog(uint32_t flags, tklog_level_t level, int line, const char *file, con
         if (ptr == NULL) {
             return tklog_malloc(size, file, line);
         }
+        MemEntry *e = mem_detach(ptr);
         void *newp = original_realloc(ptr, size);
         if (newp != NULL) {
-            mem_update(ptr, newp, size);
+            mem_update(e, newp, size, file, line, NULL);
+        } else {
+            mem_reattach(e);    /* ptr is still live */
         }
         return newp;
     }
@@ -729,7 +4782,7 @@ void _tklog(uint32_t flags, tklog_level_t level, int line, const char *file, con
         char *p = (char *)original_malloc(len);
         if (p) {
             memcpy(p, str, len);
-            mem_add(p, len, file, line);
+            mem_add(p, len, file, line, NULL);
         }
         return p;
     }
@@ -743,6 +4796,9 @@ void _tklog(uint32_t flags, tklog_level_t level, int line, const char *file, con
         
         // Check if pointer exists in tracking (detects double-free)
         bool found = mem_remove(ptr);
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+        found = true;   /* unsampled blocks are not tracked */
+#endif
         if (!found) {
             _tklog(TKLOG_ACTIVE_FLAGS, TKLOG_LEVEL_ERROR, line, file, "you tried to free a pointer that was not allocated");
             exit(EXIT_FAILURE);
@@ -751,42 +4807,547 @@ void _tklog(uint32_t flags, tklog_level_t level, int line, const char *file, con
         original_free(ptr);
     }
 #endif 
-#if defined(TKLOG_MEMORY) && defined(TKLOG_MEMORY_PRINT_ON_EXIT)
+
+/* -------------------------  Preload hooks  ----------------------------- */
+/*  Entry points for tklog_preload.c.  It calls them with its reentrancy    */
+/*  guard raised, so the tracker's own allocations go straight to libc.    */
+#ifdef TKLOG_PRELOAD
+    void _tklog_preload_track(void *ptr, size_t size, const void *caller)
+    {
+        mem_add(ptr, size, NULL, 0, caller);
+    }
+    void *_tklog_preload_detach(void *ptr)
+    {
+        return mem_detach(ptr);
+    }
+    void _tklog_preload_retrack(void *held, void *newptr, size_t size, const void *caller)
+    {
+        mem_update((MemEntry *)held, newptr, size, NULL, 0, caller);
+    }
+    void _tklog_preload_reattach(void *held)
+    {
+        mem_reattach((MemEntry *)held);
+    }
+    bool _tklog_preload_untrack(void *ptr)
+    {
+        return mem_remove(ptr);
+    }
+
+    /* "function+0x1a (libfoo.so+0x4f21a)"; the module offset feeds addr2line */
+    static void mem_symbolize(const void *caller, char *out, size_t cap)
+    {
+        const char *pc = (const char *)caller - 1;  /* inside the call, not after it */
+        Dl_info     info;
+        if (!dladdr(pc, &info) || !info.dli_fname) {
+            snprintf(out, cap, "%p", caller);
+            return;
+        }
+        const char *module = strrchr(info.dli_fname, '/');
+        module = module ? module + 1 : info.dli_fname;
+        uintptr_t   off = (uintptr_t)pc - (uintptr_t)info.dli_fbase;
+        if (info.dli_sname && info.dli_saddr) {
+            snprintf(out, cap, "%s+0x%" PRIxPTR " (%s+0x%" PRIxPTR ")",
+                     info.dli_sname, (uintptr_t)pc - (uintptr_t)info.dli_saddr, module, off);
+        } else {
+            snprintf(out, cap, "%s+0x%" PRIxPTR, module, off);
+        }
+    }
+#endif /* TKLOG_PRELOAD */
+
+#if (defined(TKLOG_MEMORY) && defined(TKLOG_MEMORY_PRINT_ON_EXIT)) || defined(TKLOG_PRELOAD)
+    static int mem_cmp_newest(const void *a, const void *b)
+    {
+        uint64_t x = ((const MemEntry *)a)->seq, y = ((const MemEntry *)b)->seq;
+        return (x < y) - (x > y);
+    }
+
     void tklog_memory_dump(void)
     {
-        pthread_rwlock_rdlock(&g_mem_rwlock);
-        
+        tklog_init_once();
+
+        /* one shard locked at a time: its entries are copied out, then the   */
+        /* copy is sorted and emitted with no shard lock held                 */
+        MemEntry *all = NULL;
+        size_t    n   = 0, cap = 0;
+        for (size_t s = 0; s < TKLOG_MEMORY_SHARDS; ++s) {
+            MemShard *sh = &g_mem_shards[s];
+            pthread_mutex_lock(&sh->lock);
+            while (n + sh->count > cap) {     /* grown unlocked, so the count may move */
+                size_t want = (n + sh->count) * 2;
+                pthread_mutex_unlock(&sh->lock);
+#ifdef TKLOG_MEMORY
+                MemEntry *grown = (MemEntry*)original_realloc(all, want * sizeof *all);
+#else
+                MemEntry *grown = (MemEntry*)realloc(all, want * sizeof *all);
+#endif
+                pthread_mutex_lock(&sh->lock);
+                if (!grown) {
+                    break;                      /* dump what fits */
+                }
+                all = grown;
+                cap = want;
+            }
+            for (size_t i = 0; i < sh->cap && n < cap; ++i) {
+                if (sh->slots[i]) {
+                    all[n++] = *sh->slots[i];
+                }
+            }
+            pthread_mutex_unlock(&sh->lock);
+        }
+
+        /* newest first, as the allocation list used to be */
+        if (n > 1) {
+            qsort(all, n, sizeof *all, mem_cmp_newest);
+        }
+
         // Print header like debug.c does
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+        char header[96];
+        int  hlen = snprintf(header, sizeof header, "\nunfreed memory (sampled, one per %llu bytes on average):\n",
+                             (unsigned long long)(TKLOG_MEMORY_SAMPLE_BYTES));
+        tklog_emit(TKLOG_LEVEL_INFO, header, (size_t)hlen);
+#else
         char header[] = "\nunfreed memory:\n";
-        pthread_mutex_lock(&g_tklog_mutex);
-        TKLOG_OUTPUT_FN(header, TKLOG_OUTPUT_USERPTR);
-        pthread_mutex_unlock(&g_tklog_mutex);
+        tklog_emit(TKLOG_LEVEL_INFO, header, sizeof header - 1);
+#endif
         
         // Print each memory entry with time, thread, and full path
-        for (MemEntry *e = g_mem_head; e; e = e->next) {
+        for (size_t k = 0; k < n; ++k) {
+            const MemEntry *e = &all[k];
             char linebuf[512]; // Increased buffer size for longer paths
-            uint64_t t_ms = e->t_ms - g_start_ms;
+            uint64_t t_ms = e->t_ns / 1000000ULL - g_start_ms;
+            char path[128];
+            if (!e->caller) {
+                mem_format_path(e->scope, e->file, e->line, path, sizeof path);
+            }
+#ifdef TKLOG_PRELOAD
+            else {
+                mem_symbolize(e->caller, path, sizeof path);
+            }
+#endif
             snprintf(linebuf, sizeof linebuf, "\t%" PRIu64 "ms | tid %lu | address %p | %zu bytes | at %s\n",
-                                               t_ms, (unsigned long)e->tid, e->ptr, e->size, e->path);
-            pthread_mutex_lock(&g_tklog_mutex);
-            TKLOG_OUTPUT_FN(linebuf, TKLOG_OUTPUT_USERPTR);
-            pthread_mutex_unlock(&g_tklog_mutex);
+                                               t_ms, (unsigned long)e->tid, e->ptr, e->size, path);
+            tklog_emit(TKLOG_LEVEL_INFO, linebuf, strlen(linebuf));
         }
         
         // Print trailing newline like debug.c does
         char footer[] = "\n";
-        pthread_mutex_lock(&g_tklog_mutex);
-        TKLOG_OUTPUT_FN(footer, TKLOG_OUTPUT_USERPTR);
-        pthread_mutex_unlock(&g_tklog_mutex);
+        tklog_emit(TKLOG_LEVEL_INFO, footer, sizeof footer - 1);
         
-        pthread_rwlock_unlock(&g_mem_rwlock);
+#ifdef TKLOG_MEMORY
+        original_free(all);
+#else
+        free(all);
+#endif
     }
-#else /* TKLOG_MEMORY AND TKLOG_MEMORY_PRINT_ON_EXIT not defined */
+#else /* (TKLOG_MEMORY AND TKLOG_MEMORY_PRINT_ON_EXIT) or TKLOG_PRELOAD not defined */
     void tklog_memory_dump(void)
     {
         (void)mem_add;
         (void)mem_remove;
         (void)mem_update;
+        (void)mem_reattach;
         printf("tklog_memory_dump: TKLOG_MEMORY_PRINT_ON_EXIT must be defined to track and dump memory allocations\n");
     }
-#endif /* TKLOG_MEMORY */
\ No newline at end of file
+#endif /* TKLOG_MEMORY */
+#if defined(TKLOG_MEMORY) || defined(TKLOG_PRELOAD)
+    typedef struct {
+        uint64_t       key;
+        const MemSite *site;
+    } MemSiteRank;
+
+    static int mem_cmp_rank(const void *a, const void *b)
+    {
+        uint64_t x = ((const MemSiteRank *)a)->key, y = ((const MemSiteRank *)b)->key;
+        return (x < y) - (x > y);
+    }
+
+    /* "16", "4K", "2M" */
+    static int mem_size_label(char *out, size_t cap, uint64_t v)
+    {
+        static const char units[] = " KMGT";
+        int u = 0;
+        while (v >= 1024 && u < 4) {
+            v /= 1024;
+            u += 1;
+        }
+        return u ? snprintf(out, cap, "%" PRIu64 "%c", v, units[u]) : snprintf(out, cap, "%" PRIu64, v);
+    }
+
+    /* "512ns", "16us", "1ms", "34s", "9min", "2h" – rounded down */
+    static int mem_time_label(char *out, size_t cap, uint64_t ns)
+    {
+        if (ns < 1000ULL)              return snprintf(out, cap, "%" PRIu64 "ns",  ns);
+        if (ns < 1000000ULL)           return snprintf(out, cap, "%" PRIu64 "us",  ns / UINT64_C(1000));
+        if (ns < 1000000000ULL)        return snprintf(out, cap, "%" PRIu64 "ms",  ns / UINT64_C(1000000));
+        if (ns < 60000000000ULL)       return snprintf(out, cap, "%" PRIu64 "s",   ns / UINT64_C(1000000000));
+        if (ns < 3600000000000ULL)     return snprintf(out, cap, "%" PRIu64 "min", ns / UINT64_C(60000000000));
+        return snprintf(out, cap, "%" PRIu64 "h", ns / UINT64_C(3600000000000));
+    }
+
+    /* "\t\t<title>: <lower bound>:<count> ..." for the non-empty log2 buckets */
+    static size_t mem_put_hist(char *out, size_t cap, const char *title, const uint64_t *counts, unsigned buckets,
+                               int (*label_fn)(char *, size_t, uint64_t))
+    {
+        size_t o = (size_t)snprintf(out, cap, "\t\t%s:", title);
+        for (unsigned b = 0; b < buckets && o < cap - 64; ++b) {
+            uint64_t count = __atomic_load_n(&counts[b], __ATOMIC_RELAXED);
+            if (count) {
+                char label[16];
+                label_fn(label, sizeof label, b ? 1ULL << (b - 1) : 0);
+                o += (size_t)snprintf(out + o, cap - o, " %s:%" PRIu64, label, count);
+            }
+        }
+        out[o++] = '\n';
+        out[o]   = '\0';
+        return o;
+    }
+
+    /* file:line (or scope path), or the symbolised return address */
+    static const char *mem_site_label(const MemSite *site, char *sym, size_t cap)
+    {
+#ifdef TKLOG_PRELOAD
+        if (site->caller) {
+            mem_symbolize(site->caller, sym, cap);
+            return sym;
+        }
+#else
+        (void)sym;
+        (void)cap;
+#endif
+        return site->label;
+    }
+
+    /* usable size the allocator hands out for a request of size bytes */
+    static size_t mem_size_class(size_t size)
+    {
+#ifdef TKLOG_MEMORY
+        void *p = original_malloc(size);
+#else
+        void *p = malloc(size);
+#endif
+        if (!p) {
+            return size;
+        }
+        size_t usable = size + mem_slack(p, size);
+#ifdef TKLOG_MEMORY
+        original_free(p);
+#else
+        free(p);
+#endif
+        return usable;
+    }
+
+    /* "=> size class: requests of 40 bytes get 56; ask for 56 to use it all, or
+     * at most 24 for the class below" for the site's most common request; the
+     * classes are probed with real allocations, so any allocator works */
+    static void mem_report_size_class(const MemSite *site, char *linebuf, size_t cap)
+    {
+        size_t want = (size_t)__atomic_load_n(&site->common_size, __ATOMIC_RELAXED);
+        if (!want || __atomic_load_n(&site->common_votes, __ATOMIC_RELAXED) <= 0) {
+            return;
+        }
+        size_t got = mem_size_class(want);
+        if (got <= want) {
+            return;
+        }
+        int len = snprintf(linebuf, cap, "\t\t=> size class: requests of %zu bytes get %zu; ask for %zu to use it all", want, got, got);
+        /* largest request in a smaller class, worth it only if it trims at most a quarter */
+        size_t lo = want - want / 4, hi = want;
+        if (lo && mem_size_class(lo) < got) {
+            while (hi - lo > 1) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (mem_size_class(mid) < got) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            len += snprintf(linebuf + len, cap - (size_t)len, ", or at most %zu for the class below", lo);
+        }
+        linebuf[len++] = '\n';
+        linebuf[len]   = '\0';
+        tklog_emit(TKLOG_LEVEL_INFO, linebuf, (size_t)len);
+    }
+
+    void tklog_memory_report(tklog_memory_sort_t by)
+    {
+        tklog_init_once();
+#ifdef TKLOG_MEMORY
+        MemSiteRank *rank = (MemSiteRank*)original_malloc((TKLOG_MEMORY_SITES + 1) * sizeof *rank);
+#else
+        MemSiteRank *rank = (MemSiteRank*)malloc((TKLOG_MEMORY_SITES + 1) * sizeof *rank);
+#endif
+        if (!rank) {
+            return;
+        }
+        size_t n = 0;
+        for (size_t i = 0; i <= TKLOG_MEMORY_SITES; ++i) {
+            const MemSite *site = i < TKLOG_MEMORY_SITES ? __atomic_load_n(&g_mem_sites[i], __ATOMIC_ACQUIRE) : &g_mem_site_other;
+            if (!site || !__atomic_load_n(&site->allocs, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            rank[n].site = site;
+            rank[n].key  = by == TKLOG_MEMORY_BY_LIVE  ? __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED)
+                         : by == TKLOG_MEMORY_BY_COUNT ? __atomic_load_n(&site->allocs, __ATOMIC_RELAXED)
+                         : by == TKLOG_MEMORY_BY_SLACK ? __atomic_load_n(&site->total_usable, __ATOMIC_RELAXED)
+                                                         - __atomic_load_n(&site->total_bytes, __ATOMIC_RELAXED)
+                         :                               __atomic_load_n(&site->total_bytes, __ATOMIC_RELAXED);
+            n += 1;
+        }
+        qsort(rank, n, sizeof *rank, mem_cmp_rank);
+
+        static const char *const by_name[] = { "bytes", "live bytes", "allocations", "slack bytes" };
+        char linebuf[1024];
+#ifdef TKLOG_MEMORY_SAMPLE_BYTES
+        char sampled[96];
+        snprintf(sampled, sizeof sampled, ", estimated from one sample per %llu bytes", (unsigned long long)(TKLOG_MEMORY_SAMPLE_BYTES));
+#else
+        const char *sampled = "";
+#endif
+        int  len = snprintf(linebuf, sizeof linebuf, "\nmemory by site (sorted by %s%s):\n\t%12s %12s %14s %14s %14s | %s\n",
+                            by_name[by <= TKLOG_MEMORY_BY_SLACK ? by : 0], sampled, "allocs", "frees", "live", "peak", "total", "site");
+        tklog_emit(TKLOG_LEVEL_INFO, linebuf, (size_t)len);
+
+        for (size_t k = 0; k < n; ++k) {
+            const MemSite *site = rank[k].site;
+            char sym[128];
+            const char *label = mem_site_label(site, sym, sizeof sym);
+            len = snprintf(linebuf, sizeof linebuf, "\t%12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " | %s\n",
+                           __atomic_load_n(&site->allocs, __ATOMIC_RELAXED),
+                           __atomic_load_n(&site->frees, __ATOMIC_RELAXED),
+                           __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED),
+                           __atomic_load_n(&site->peak_bytes, __ATOMIC_RELAXED),
+                           __atomic_load_n(&site->total_bytes, __ATOMIC_RELAXED),
+                           label);
+            tklog_emit(TKLOG_LEVEL_INFO, linebuf, (size_t)len);
+
+            size_t o = mem_put_hist(linebuf, sizeof linebuf, "sizes", site->sizes, MEM_SIZE_BUCKETS, mem_size_label);
+            tklog_emit(TKLOG_LEVEL_INFO, linebuf, o);
+            if (__atomic_load_n(&site->frees, __ATOMIC_RELAXED)) {
+                o = mem_put_hist(linebuf, sizeof linebuf, "lifetimes", site->lifetimes, MEM_LIFE_BUCKETS, mem_time_label);
+                tklog_emit(TKLOG_LEVEL_INFO, linebuf, o);
+            }
+
+            /* pool hint: >= 90% of at least 100 freed blocks died young (whole buckets
+             * below the threshold); a freelist if >= 90% also share one size class */
+            uint64_t allocs = __atomic_load_n(&site->allocs, __ATOMIC_RELAXED);
+            uint64_t freed = 0, young = 0, same = 0;
+            for (unsigned b = 0; b < MEM_LIFE_BUCKETS; ++b) {
+                uint64_t count = __atomic_load_n(&site->lifetimes[b], __ATOMIC_RELAXED);
+                freed += count;
+                young += (1ULL << b) <= (uint64_t)TKLOG_MEMORY_SHORT_LIVED_NS ? count : 0;
+            }
+            for (unsigned b = 0; b < MEM_SIZE_BUCKETS; ++b) {
+                uint64_t count = __atomic_load_n(&site->sizes[b], __ATOMIC_RELAXED);
+                same = count > same ? count : same;
+            }
+            if (freed >= 100 && young * 10 >= freed * 9) {
+                char within[16];
+                mem_time_label(within, sizeof within, TKLOG_MEMORY_SHORT_LIVED_NS);
+                bool freelist = same * 10 >= allocs * 9;
+                len = snprintf(linebuf, sizeof linebuf, "\t\t=> %s candidate: %" PRIu64 "%% freed within %s, %" PRIu64 "%% in one size class\n",
+                               freelist ? "freelist" : "arena", young * 100 / freed, within, allocs ? same * 100 / allocs : 0);
+                tklog_emit(TKLOG_LEVEL_INFO, linebuf, (size_t)len);
+            }
+
+            uint64_t usable = __atomic_load_n(&site->total_usable, __ATOMIC_RELAXED);
+            uint64_t total  = __atomic_load_n(&site->total_bytes, __ATOMIC_RELAXED);
+            if (usable > total) {
+                uint64_t live = __atomic_load_n(&site->live_usable, __ATOMIC_RELAXED) - __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED);
+                len = snprintf(linebuf, sizeof linebuf, "\t\tslack: %" PRIu64 "%% (%" PRIu64 " of %" PRIu64 " usable bytes), %" PRIu64 " live\n",
+                               (usable - total) * 100 / usable, usable - total, usable, live);
+                tklog_emit(TKLOG_LEVEL_INFO, linebuf, (size_t)len);
+                if ((usable - total) * 8 >= usable) {
+                    mem_report_size_class(site, linebuf, sizeof linebuf);
+                }
+            }
+        }
+
+        char footer[] = "\n";
+        tklog_emit(TKLOG_LEVEL_INFO, footer, sizeof footer - 1);
+#ifdef TKLOG_MEMORY
+        original_free(rank);
+#else
+        free(rank);
+#endif
+    }
+
+    /*  A snapshot copies the counters of every published site; it never     */
+    /*  touches the shards, so allocating threads are not held up at all.    */
+    /*  Sites never move, so their table slot is a stable key for diffs.     */
+    typedef struct {
+        uint32_t       index;       /* slot in g_mem_sites, TKLOG_MEMORY_SITES = other */
+        const MemSite *site;
+        uint64_t       allocs;
+        uint64_t       frees;
+        uint64_t       live_bytes;
+    } MemSnapSite;
+
+    struct tklog_memory_snapshot {
+        uint64_t    t_ns;
+        size_t      count;
+        MemSnapSite sites[];        /* ascending index */
+    };
+
+    static inline const MemSite *mem_site_at(size_t i)
+    {
+        return i < TKLOG_MEMORY_SITES ? __atomic_load_n(&g_mem_sites[i], __ATOMIC_ACQUIRE) : &g_mem_site_other;
+    }
+
+    tklog_memory_snapshot_t *tklog_memory_snapshot(void)
+    {
+        tklog_init_once();
+        for (;;) {
+            size_t cap = 0;
+            for (size_t i = 0; i <= TKLOG_MEMORY_SITES; ++i) {
+                cap += mem_site_at(i) != NULL;
+            }
+#ifdef TKLOG_MEMORY
+            tklog_memory_snapshot_t *snap = (tklog_memory_snapshot_t*)original_malloc(sizeof *snap + cap * sizeof snap->sites[0]);
+#else
+            tklog_memory_snapshot_t *snap = (tklog_memory_snapshot_t*)malloc(sizeof *snap + cap * sizeof snap->sites[0]);
+#endif
+            if (!snap) {
+                return NULL;
+            }
+            snap->t_ns  = get_time_ns();
+            snap->count = 0;
+            size_t i = 0;
+            for (; i <= TKLOG_MEMORY_SITES && snap->count < cap; ++i) {
+                const MemSite *site = mem_site_at(i);
+                if (!site) {
+                    continue;
+                }
+                /* frees before allocs: a block is counted as allocated before it can be freed */
+                MemSnapSite *s = &snap->sites[snap->count++];
+                s->index      = (uint32_t)i;
+                s->site       = site;
+                s->frees      = __atomic_load_n(&site->frees, __ATOMIC_ACQUIRE);
+                s->allocs     = __atomic_load_n(&site->allocs, __ATOMIC_ACQUIRE);
+                s->live_bytes = __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED);
+            }
+            if (i > TKLOG_MEMORY_SITES) {
+                return snap;
+            }
+            tklog_memory_snapshot_free(snap);   /* sites were published meanwhile */
+        }
+    }
+
+    void tklog_memory_snapshot_free(tklog_memory_snapshot_t *snap)
+    {
+#ifdef TKLOG_MEMORY
+        original_free(snap);
+#else
+        free(snap);
+#endif
+    }
+
+    typedef struct {
+        int64_t        bytes;
+        int64_t        blocks;
+        int64_t        allocs;
+        int64_t        frees;
+        const MemSite *site;
+    } MemSiteDelta;
+
+    static int mem_cmp_delta(const void *a, const void *b)
+    {
+        const MemSiteDelta *x = a, *y = b;
+        if (x->bytes != y->bytes) {
+            return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+        }
+        return (x->blocks < y->blocks) - (x->blocks > y->blocks);
+    }
+
+    void tklog_memory_diff(const tklog_memory_snapshot_t *a, const tklog_memory_snapshot_t *b)
+    {
+        if (!a || !b) {
+            return;
+        }
+        tklog_init_once();
+#ifdef TKLOG_MEMORY
+        MemSiteDelta *delta = (MemSiteDelta*)original_malloc((a->count + b->count + 1) * sizeof *delta);
+#else
+        MemSiteDelta *delta = (MemSiteDelta*)malloc((a->count + b->count + 1) * sizeof *delta);
+#endif
+        if (!delta) {
+            return;
+        }
+        /* merge on the site index; a site missing from one side had no activity there */
+        static const MemSnapSite none = { 0 };
+        size_t  n = 0, i = 0, j = 0;
+        int64_t sum_bytes = 0, sum_blocks = 0;
+        while (i < a->count || j < b->count) {
+            const MemSnapSite *x = &none, *y = &none;
+            if (j >= b->count || (i < a->count && a->sites[i].index < b->sites[j].index)) {
+                x = &a->sites[i++];
+            } else if (i >= a->count || b->sites[j].index < a->sites[i].index) {
+                y = &b->sites[j++];
+            } else {
+                x = &a->sites[i++];
+                y = &b->sites[j++];
+            }
+            MemSiteDelta d;
+            d.site   = y->site ? y->site : x->site;
+            d.bytes  = (int64_t)(y->live_bytes - x->live_bytes);
+            d.blocks = (int64_t)((y->allocs - y->frees) - (x->allocs - x->frees));
+            d.allocs = (int64_t)(y->allocs - x->allocs);
+            d.frees  = (int64_t)(y->frees - x->frees);
+            if (d.bytes || d.blocks) {
+                delta[n++] = d;
+                sum_bytes  += d.bytes;
+                sum_blocks += d.blocks;
+            }
+        }
+        qsort(delta, n, sizeof *delta, mem_cmp_delta);
+
+        char span[16];
+        mem_time_label(span, sizeof span, b->t_ns > a->t_ns ? b->t_ns - a->t_ns : a->t_ns - b->t_ns);
+        char linebuf[1024];
+        int  len = snprintf(linebuf, sizeof linebuf, "\nmemory growth over %s (%+" PRId64 " bytes, %+" PRId64 " blocks):\n\t%14s %12s %12s %12s | %s\n",
+                            span, sum_bytes, sum_blocks, "bytes", "blocks", "allocs", "frees", "site");
+        tklog_emit(TKLOG_LEVEL_INFO, linebuf, (size_t)len);
+
+        for (size_t k = 0; k < n; ++k) {
+            char sym[128];
+            const char *label = mem_site_label(delta[k].site, sym, sizeof sym);
+            len = snprintf(linebuf, sizeof linebuf, "\t%+14" PRId64 " %+12" PRId64 " %12" PRId64 " %12" PRId64 " | %s\n",
+                           delta[k].bytes, delta[k].blocks, delta[k].allocs, delta[k].frees, label);
+            tklog_emit(TKLOG_LEVEL_INFO, linebuf, (size_t)len);
+        }
+
+        char footer[] = "\n";
+        tklog_emit(TKLOG_LEVEL_INFO, footer, sizeof footer - 1);
+#ifdef TKLOG_MEMORY
+        original_free(delta);
+#else
+        free(delta);
+#endif
+    }
+#else
+    void tklog_memory_report(tklog_memory_sort_t by)
+    {
+        (void)by;
+        printf("tklog_memory_report: TKLOG_MEMORY must be defined to collect per-site memory statistics\n");
+    }
+
+    struct tklog_memory_snapshot { int unused; };
+
+    tklog_memory_snapshot_t *tklog_memory_snapshot(void)
+    {
+        printf("tklog_memory_snapshot: TKLOG_MEMORY must be defined to collect per-site memory statistics\n");
+        return NULL;
+    }
+
+    void tklog_memory_snapshot_free(tklog_memory_snapshot_t *snap)
+    {
+        (void)snap;
+    }
+
+    void tklog_memory_diff(const tklog_memory_snapshot_t *a, const tklog_memory_snapshot_t *b)
+    {
+        (void)a;
+        (void)b;
+    }
+#endif /* TKLOG_MEMORY || TKLOG_PRELOAD */
@@ -27,12 +27,42 @@ typedef bool (*tklog_output_fn_t)(const char *msg, void *user);
     /* Default fallback writes to stderr; provided by log.c */
     bool tklog_output_stdio(const char *msg, void *user);
     #define TKLOG_OUTPUT_FN tklog_output_stdio
+#else
+    bool TKLOG_OUTPUT_FN(const char *msg, void *user);  /* user-supplied */
 #endif
 
 #ifndef TKLOG_OUTPUT_USERPTR
     #define TKLOG_OUTPUT_USERPTR  NULL
 #endif
 
+/* -------------------------------------------------------------------------
+ *  Memory‑mapped rotating file sink (POSIX) ------------------------------ */
+/*  -DTKLOG_OUTPUT_FN=tklog_output_mmap writes every line into a mmap'ed     */
+/*  file segment without locks or syscalls.  With TKLOG_OUTPUT_USERPTR left  */
+/*  NULL the sink is opened on first use from the compile‑time settings      */
+/*  TKLOG_MMAP_PATH ("tklog.log"), TKLOG_MMAP_SEGMENT_SIZE (64 MiB),         */
+/*  TKLOG_MMAP_ROTATE_MS (0 = by size only) and TKLOG_MMAP_KEEP (0 = all),   */
+/*  and trimmed at exit; or point TKLOG_OUTPUT_USERPTR at your own sink.     */
+/*  Segments are named <path>.N, numbered on from the highest N already on   */
+/*  disk, so earlier runs' segments are never overwritten.                   */
+#ifndef _WIN32
+    typedef struct tklog_mmap_sink tklog_mmap_sink_t;
+
+    tklog_mmap_sink_t *tklog_mmap_sink_open(const char *path, size_t segment_size, uint64_t rotate_ms, unsigned keep);
+    void               tklog_mmap_sink_close(tklog_mmap_sink_t *sink);  /* no concurrent writers */
+    bool               tklog_output_mmap(const char *msg, void *user);
+#endif
+
+/* -------------------------------------------------------------------------
+ *  Asynchronous output (TKLOG_ASYNC) -------------------------------------- */
+/*  Producers copy the formatted line into a bounded lock‑free ring and a     */
+/*  background thread calls TKLOG_OUTPUT_FN.  Tunables (compile‑time):        */
+/*      TKLOG_ASYNC_CAPACITY     ring slots, power of two (default 1024)       */
+/*      TKLOG_ASYNC_FULL_POLICY  one of the policies below (default BLOCK)     */
+#define TKLOG_ASYNC_BLOCK        0   /* wait for the writer to make room      */
+#define TKLOG_ASYNC_DROP_NEWEST  1   /* discard the message being logged      */
+#define TKLOG_ASYNC_DROP_OLDEST  2   /* discard the oldest queued message     */
+
 /* ---- Compose default flag word (compile‑time only) --------------------- */
 #ifdef TKLOG_SHOW_LOG_LEVEL
     #define TKLOG_INIT_F_LEVEL   1u << 0
@@ -103,6 +133,96 @@ void _tklog(uint32_t    flags,
           const char *fmt,
           ...) __attribute__((format(printf, 5, 6)));
 
+/* -------------------------------------------------------------------------
+ *  Call‑site descriptors -------------------------------------------------- */
+/*  Every tklog_<level>() expands to a static descriptor.  On ELF targets the  */
+/*  descriptors are collected in the "tklog_callsites" section so the library */
+/*  can switch every site on or off at runtime; elsewhere a site registers     */
+/*  itself the first time it runs.  A disabled site costs one relaxed load.    */
+#define TKLOG_CS_DISABLED      0
+#define TKLOG_CS_ENABLED       1
+#define TKLOG_CS_UNREGISTERED  2    /* initial state: filters not applied yet */
+
+typedef struct tklog_callsite {
+    tklog_level_t           level;
+    int                     line;
+    const char             *file;       /* __FILE__                             */
+    const char             *fmt;        /* format string (TKLOG_BINARY only)    */
+    const char             *name;       /* short file name, set on registration */
+    uint32_t                id;         /* TKLOG_BINARY record id, 0 until sent */
+    uint8_t                 enabled;    /* TKLOG_CS_*                           */
+    struct tklog_callsite  *next;       /* registry link for non‑ELF targets    */
+    const void             *kv;         /* interned field names (_kv sites)     */
+} tklog_callsite_t;
+
+#if defined(__ELF__) && (defined(__GNUC__) || defined(__clang__))
+    #define TKLOG_CALLSITE_ATTR  __attribute__((section("tklog_callsites"), used, aligned(8)))
+#else
+    #define TKLOG_CALLSITE_ATTR
+#endif
+
+#ifdef TKLOG_BINARY
+    #define TKLOG_CS_FMT(fmt)  fmt
+#else
+    #define TKLOG_CS_FMT(fmt)  NULL     /* keeps non‑literal formats legal */
+#endif
+
+#define TKLOG_CALLSITE_INIT(level, fmt) \
+    { (level), __LINE__, __FILE__, TKLOG_CS_FMT(fmt), NULL, 0, TKLOG_CS_UNREGISTERED, NULL, NULL }
+
+void _tklog_callsite(uint32_t          flags,
+                     tklog_callsite_t *cs,
+                     const char       *fmt,
+                     ...) __attribute__((format(printf, 3, 4)));
+
+/*  Runtime filters.  Rules apply in order, later rules win; the same syntax   */
+/*  is read from the TKLOG_FILTER environment variable at startup:             */
+/*      "warning"              minimum level for every site                    */
+/*      "net*.c=debug"         minimum level for files matching a glob         */
+/*      "db.c:120=off"         one site ("on" / "off" or a level)              */
+/*  e.g.  TKLOG_FILTER="warning,net*.c=debug,db.c:120=off"                     */
+/*  Returns 0, or ‑1 if the spec does not parse (nothing is applied then).    */
+int  tklog_filter(const char *spec);
+void tklog_set_level(tklog_level_t min_level);
+void tklog_set_file_level(const char *file_glob, tklog_level_t min_level);
+void tklog_set_site_enabled(const char *file, int line, bool enabled);
+
+/* -------------------------------------------------------------------------
+ *  Binary deferred formatting (TKLOG_BINARY) ------------------------------ */
+/*  Log calls append a compact record (call‑site id, time, thread, raw        */
+/*  argument bytes) to TKLOG_BINARY_PATH (default "tklog.bin") instead of     */
+/*  formatting.  Each call site's level, file, line and format string are     */
+/*  written once, the first time it fires; tklog_decode turns the file back   */
+/*  into the usual text.  The format string must be a string literal.         */
+void _tklog_binary(uint32_t          flags,
+                   tklog_callsite_t *cs,
+                   const char       *fmt,
+                   ...) __attribute__((format(printf, 3, 4)));
+
+/*  File layout (native byte order, fields unaligned):
+ *      header    TKLOG_BIN_MAGIC[8]  u64 start_ns  i64 wall_offset_ns  u8 time_fmt
+ *      'C'       u32 id  u8 level  i32 line  u16 len file  u16 len fmt
+ *      'L' / 'T' u8 flags  u32 id  u64 t_ns  u64 tid  u16 len path  u16 len body
+ *  An 'L' body holds one value per conversion (and per '*'): 8 bytes for
+ *  integers, pointers and doubles, u16 len + bytes for %s (len 0xFFFF = NULL).
+ *  A 'T' body is the message already formatted, used for conversions that
+ *  cannot be captured (%n, %lc, %ls, %L…).                                  */
+#define TKLOG_BIN_MAGIC          "TKLOGBN2"
+#define TKLOG_BIN_TIME_MS        0x00    /* time_fmt: header time resolution  */
+#define TKLOG_BIN_TIME_US        0x01
+#define TKLOG_BIN_TIME_NS        0x02
+#define TKLOG_BIN_TIME_ISO8601   0x10    /* flag: UTC wall clock              */
+#define TKLOG_BIN_REC_CALLSITE   'C'
+#define TKLOG_BIN_REC_LOG        'L'
+#define TKLOG_BIN_REC_TEXT       'T'
+#define TKLOG_BIN_NULL_STR       0xFFFFu
+
+/* Blocks until every message logged before the call has reached the output
+ * function.  Drained automatically at exit; a no‑op without TKLOG_ASYNC. */
+void     tklog_flush(void);
+/* Number of messages discarded by the TKLOG_ASYNC full‑queue policy. */
+uint64_t tklog_async_dropped(void);
+
 /* -------------------------------------------------------------------------
  *  Memory tracking (optional) -------------------------------------------- */
 #ifdef TKLOG_MEMORY
@@ -120,81 +240,303 @@ void _tklog(uint32_t    flags,
 #endif /* TKLOG_MEMORY */
     void tklog_memory_dump(void);
 
+    /* Per allocation site: counts, live/peak/total bytes, a power-of-two    */
+    /* size histogram and allocator slack, emitted like tklog_memory_dump().  */
+    typedef enum {
+        TKLOG_MEMORY_BY_BYTES,      /* total bytes ever allocated */
+        TKLOG_MEMORY_BY_LIVE,       /* bytes currently allocated  */
+        TKLOG_MEMORY_BY_COUNT,      /* number of allocations      */
+        TKLOG_MEMORY_BY_SLACK       /* usable minus requested bytes */
+    } tklog_memory_sort_t;
+    void tklog_memory_report(tklog_memory_sort_t by);
+
+    /* Per-site live bytes and blocks at one moment; diff two snapshots to see */
+    /* what grew in between.  Taking one copies counters only, without locks.  */
+    typedef struct tklog_memory_snapshot tklog_memory_snapshot_t;
+    tklog_memory_snapshot_t *tklog_memory_snapshot(void);
+    void tklog_memory_diff(const tklog_memory_snapshot_t *a, const tklog_memory_snapshot_t *b);
+    void tklog_memory_snapshot_free(tklog_memory_snapshot_t *snap);
+
+    /* With TKLOG_MEMORY or TKLOG_TIMER, fatal signals dump the tracked state */
+    /* with write(2) to a descriptor opened at init (a dup of stderr).  Pass  */
+    /* one opened at startup, e.g. a file, to send the dump elsewhere.  Only  */
+    /* signals still at SIG_DFL at init are taken; SIGINT needs TKLOG_MEMORY. */
+    void tklog_set_crash_fd(int fd);
+
+    /* LD_PRELOAD / -Wl,--wrap tracking (tklog_preload.c): sites are return   */
+    /* addresses, symbolised with dladdr only when dumped or reported.  The   */
+    /* --wrap build does not see allocations made inside libc (strdup, ...).  */
+#ifdef TKLOG_PRELOAD
+    /* realloc: detach the old block first, then retrack the entry to the  */
+    /* new one (NULL when realloc(p, 0) freed it) or reattach it on failure */
+    void  _tklog_preload_track   (void *ptr, size_t size, const void *caller);
+    void *_tklog_preload_detach  (void *ptr);
+    void  _tklog_preload_retrack (void *held, void *newptr, size_t size, const void *caller);
+    void  _tklog_preload_reattach(void *held);
+    bool  _tklog_preload_untrack (void *ptr);
+#endif
+
 /* -------------------------------------------------------------------------
  *  Helper macro: common call site (compile‑time flags only) -------------- */
-#define TKLOG_CALL(level, fmt, ...) _tklog(TKLOG_ACTIVE_FLAGS, (level), __LINE__, __TKLOG_FILE_NAME__, fmt, ##__VA_ARGS__)
+#ifdef TKLOG_BINARY
+    #define TKLOG_CALL_FN _tklog_binary
+#else
+    #define TKLOG_CALL_FN _tklog_callsite
+#endif
+#define TKLOG_CALL(level, fmt, ...)                                                           \
+    do {                                                                                      \
+        static tklog_callsite_t _tklog_cs TKLOG_CALLSITE_ATTR = TKLOG_CALLSITE_INIT(level, fmt); \
+        if (__builtin_expect(__atomic_load_n(&_tklog_cs.enabled, __ATOMIC_RELAXED) != 0, 1))  \
+            TKLOG_CALL_FN(TKLOG_ACTIVE_FLAGS, &_tklog_cs, fmt, ##__VA_ARGS__);                \
+    } while (0)
+
+/* -------------------------------------------------------------------------
+ *  Rate‑limited call sites ------------------------------------------------ */
+/*  tklog_<level>_every_n(n, fmt, …)          logs call 1, n+1, 2n+1, …        */
+/*  tklog_<level>_ratelimit(r, burst, fmt, …) at most r lines/s on average,    */
+/*                                             up to `burst` back to back      */
+/*  tklog_<level>_once(fmt, …)                logs the first call only         */
+/*  A rejected call costs one atomic update and evaluates no arguments; the    */
+/*  next line from the site ends in "(suppressed N similar messages)".         */
+/*  Under TKLOG_EXIT_ON_<LEVEL> the variants log and exit like the plain call. */
+typedef struct tklog_limit {
+    uint64_t state;         /* call count, fired flag or next allowed time (ns) */
+    uint64_t suppressed;    /* calls rejected since the last emitted line       */
+} tklog_limit_t;
+
+bool _tklog_admit_every_n  (tklog_limit_t *lim, uint64_t n, uint64_t *suppressed);
+bool _tklog_admit_ratelimit(tklog_limit_t *lim, double per_sec, uint32_t burst, uint64_t *suppressed);
+bool _tklog_admit_once     (tklog_limit_t *lim, uint64_t *suppressed);
+void _tklog_limited(uint32_t          flags,
+                    tklog_callsite_t *cs,
+                    uint64_t          suppressed,
+                    const char       *fmt,
+                    ...) __attribute__((format(printf, 4, 5)));
+
+#define TKLOG_CALL_LIMITED(level, admit, fmt, ...)                                            \
+    do {                                                                                      \
+        static tklog_callsite_t _tklog_cs TKLOG_CALLSITE_ATTR = TKLOG_CALLSITE_INIT(level, fmt); \
+        static tklog_limit_t    _tklog_lim = { 0, 0 };                                        \
+        uint64_t                _tklog_sup = 0;                                               \
+        if (__builtin_expect(__atomic_load_n(&_tklog_cs.enabled, __ATOMIC_RELAXED) != 0, 1)   \
+            && (admit))                                                                       \
+            _tklog_limited(TKLOG_ACTIVE_FLAGS, &_tklog_cs, _tklog_sup, fmt, ##__VA_ARGS__);   \
+    } while (0)
+
+#define TKLOG_CALL_EVERY_N(level, n, fmt, ...) \
+    TKLOG_CALL_LIMITED(level, _tklog_admit_every_n(&_tklog_lim, (n), &_tklog_sup), fmt, ##__VA_ARGS__)
+#define TKLOG_CALL_RATELIMIT(level, per_sec, burst, fmt, ...) \
+    TKLOG_CALL_LIMITED(level, _tklog_admit_ratelimit(&_tklog_lim, (per_sec), (burst), &_tklog_sup), fmt, ##__VA_ARGS__)
+#define TKLOG_CALL_ONCE(level, fmt, ...) \
+    TKLOG_CALL_LIMITED(level, _tklog_admit_once(&_tklog_lim, &_tklog_sup), fmt, ##__VA_ARGS__)
+
+/* -------------------------------------------------------------------------
+ *  Structured fields ------------------------------------------------------ */
+/*  tklog_<level>_kv("msg", "name", TKLOG_U64(x), "other", TKLOG_STR(s), …)   */
+/*  appends typed fields to the line: ` name=42 other="a b"` in text mode,    */
+/*  `,"name":42,"other":"a b"` with TKLOG_JSON, which also turns the header   */
+/*  (level, time, thread, file/line, scope) into one JSON object per line.    */
+/*  The message and field names must be string literals; every value must    */
+/*  be wrapped in one of the TKLOG_<TYPE>() macros.  Up to TKLOG_KV_MAX       */
+/*  fields; their rendered names are cached in the call‑site descriptor.     */
+#define TKLOG_KV_MAX 32
+
+typedef enum {
+    TKLOG_KV_I64, TKLOG_KV_U64, TKLOG_KV_F64, TKLOG_KV_BOOL, TKLOG_KV_STR
+} tklog_kv_type_t;
+
+typedef struct tklog_value {
+    tklog_kv_type_t type;
+    union { int64_t i; uint64_t u; double f; const char *s; } v;
+} tklog_value_t;
+
+static inline tklog_value_t tklog_value_i64(int64_t x)      { tklog_value_t r; r.type = TKLOG_KV_I64;  r.v.i = x; return r; }
+static inline tklog_value_t tklog_value_u64(uint64_t x)     { tklog_value_t r; r.type = TKLOG_KV_U64;  r.v.u = x; return r; }
+static inline tklog_value_t tklog_value_f64(double x)       { tklog_value_t r; r.type = TKLOG_KV_F64;  r.v.f = x; return r; }
+static inline tklog_value_t tklog_value_bool(bool x)        { tklog_value_t r; r.type = TKLOG_KV_BOOL; r.v.u = x; return r; }
+static inline tklog_value_t tklog_value_str(const char *x)  { tklog_value_t r; r.type = TKLOG_KV_STR;  r.v.s = x; return r; }
+
+#define TKLOG_I64(x)   tklog_value_i64((int64_t)(x))
+#define TKLOG_U64(x)   tklog_value_u64((uint64_t)(x))
+#define TKLOG_F64(x)   tklog_value_f64((double)(x))
+#define TKLOG_BOOL(x)  tklog_value_bool((x) ? true : false)
+#define TKLOG_STR(x)   tklog_value_str((x))
+
+/* name/value pairs terminated by a NULL name */
+void _tklog_kv(uint32_t flags, tklog_callsite_t *cs, const char *msg, ...);
+
+#define TKLOG_CALL_KV(level, msg, ...)                                                        \
+    do {                                                                                      \
+        static tklog_callsite_t _tklog_cs TKLOG_CALLSITE_ATTR = TKLOG_CALLSITE_INIT(level, msg); \
+        if (__builtin_expect(__atomic_load_n(&_tklog_cs.enabled, __ATOMIC_RELAXED) != 0, 1))  \
+            _tklog_kv(TKLOG_ACTIVE_FLAGS, &_tklog_cs, msg, ##__VA_ARGS__, (const char*)0);    \
+    } while (0)
+
+#if defined(TKLOG_JSON) && defined(TKLOG_BINARY)
+    #error "TKLOG_JSON renders at log time; TKLOG_BINARY output is rendered by tklog_decode"
+#endif
 
 /* -------------------------------------------------------------------------
  *  Per‑level wrappers (enable/disable via TKLOG_<LEVEL>) ------------------- */
 #ifdef TKLOG_DEBUG
     #define tklog_debug(fmt, ...)   TKLOG_CALL(TKLOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+    #define tklog_debug_every_n(n, fmt, ...)                 TKLOG_CALL_EVERY_N(TKLOG_LEVEL_DEBUG, n, fmt, ##__VA_ARGS__)
+    #define tklog_debug_ratelimit(per_sec, burst, fmt, ...)  TKLOG_CALL_RATELIMIT(TKLOG_LEVEL_DEBUG, per_sec, burst, fmt, ##__VA_ARGS__)
+    #define tklog_debug_once(fmt, ...)                       TKLOG_CALL_ONCE(TKLOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+    #define tklog_debug_kv(msg, ...)                         TKLOG_CALL_KV(TKLOG_LEVEL_DEBUG, msg, ##__VA_ARGS__)
 #else
     #define tklog_debug(fmt, ...)   ((void)0)
+    #define tklog_debug_every_n(n, fmt, ...)                 ((void)0)
+    #define tklog_debug_ratelimit(per_sec, burst, fmt, ...)  ((void)0)
+    #define tklog_debug_once(fmt, ...)                       ((void)0)
+    #define tklog_debug_kv(msg, ...)                         ((void)0)
 #endif
 
 #ifdef TKLOG_INFO
     #define tklog_info(fmt, ...)    TKLOG_CALL(TKLOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+    #define tklog_info_every_n(n, fmt, ...)                 TKLOG_CALL_EVERY_N(TKLOG_LEVEL_INFO, n, fmt, ##__VA_ARGS__)
+    #define tklog_info_ratelimit(per_sec, burst, fmt, ...)  TKLOG_CALL_RATELIMIT(TKLOG_LEVEL_INFO, per_sec, burst, fmt, ##__VA_ARGS__)
+    #define tklog_info_once(fmt, ...)                       TKLOG_CALL_ONCE(TKLOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+    #define tklog_info_kv(msg, ...)                         TKLOG_CALL_KV(TKLOG_LEVEL_INFO, msg, ##__VA_ARGS__)
 #else
     #define tklog_info(fmt, ...)    ((void)0)
+    #define tklog_info_every_n(n, fmt, ...)                 ((void)0)
+    #define tklog_info_ratelimit(per_sec, burst, fmt, ...)  ((void)0)
+    #define tklog_info_once(fmt, ...)                       ((void)0)
+    #define tklog_info_kv(msg, ...)                         ((void)0)
 #endif
 
 #ifdef TKLOG_NOTICE
     #define tklog_notice(fmt, ...)  TKLOG_CALL(TKLOG_LEVEL_NOTICE, fmt, ##__VA_ARGS__)
+    #define tklog_notice_every_n(n, fmt, ...)                 TKLOG_CALL_EVERY_N(TKLOG_LEVEL_NOTICE, n, fmt, ##__VA_ARGS__)
+    #define tklog_notice_ratelimit(per_sec, burst, fmt, ...)  TKLOG_CALL_RATELIMIT(TKLOG_LEVEL_NOTICE, per_sec, burst, fmt, ##__VA_ARGS__)
+    #define tklog_notice_once(fmt, ...)                       TKLOG_CALL_ONCE(TKLOG_LEVEL_NOTICE, fmt, ##__VA_ARGS__)
+    #define tklog_notice_kv(msg, ...)                         TKLOG_CALL_KV(TKLOG_LEVEL_NOTICE, msg, ##__VA_ARGS__)
 #else
     #define tklog_notice(fmt, ...)  ((void)0)
+    #define tklog_notice_every_n(n, fmt, ...)                 ((void)0)
+    #define tklog_notice_ratelimit(per_sec, burst, fmt, ...)  ((void)0)
+    #define tklog_notice_once(fmt, ...)                       ((void)0)
+    #define tklog_notice_kv(msg, ...)                         ((void)0)
 #endif
 
 /* -------------------------------------------------------------------------
  *  Exit‑on‑level helpers (TKLOG_EXIT_ON_<LEVEL>) ------------------------------ */
 #define TKLOG_EXIT_ON_TEMPLATE(lvl, label, code, fmt, ...)              \
     do {                                                              \
-        _tklog(TKLOG_ACTIVE_FLAGS, (lvl), __LINE__, __TKLOG_FILE_NAME__, label " | " fmt, ##__VA_ARGS__); \
+        TKLOG_CALL((lvl), label " | " fmt, ##__VA_ARGS__);             \
+        exit(code);                                                  \
+    } while (0)
+
+#define TKLOG_EXIT_ON_KV_TEMPLATE(lvl, label, code, msg, ...)           \
+    do {                                                              \
+        TKLOG_CALL_KV((lvl), label " | " msg, ##__VA_ARGS__);          \
         exit(code);                                                  \
     } while (0)
 
 /* Warning */
 #ifdef TKLOG_EXIT_ON_WARNING
     #define tklog_warning(fmt, ...) TKLOG_EXIT_ON_TEMPLATE(TKLOG_LEVEL_WARNING, "TKLOG_EXIT_ON_WARNING", -1, fmt, ##__VA_ARGS__)
+    #define tklog_warning_every_n(n, fmt, ...)                 tklog_warning(fmt, ##__VA_ARGS__)
+    #define tklog_warning_ratelimit(per_sec, burst, fmt, ...)  tklog_warning(fmt, ##__VA_ARGS__)
+    #define tklog_warning_once(fmt, ...)                       tklog_warning(fmt, ##__VA_ARGS__)
+    #define tklog_warning_kv(msg, ...)                         TKLOG_EXIT_ON_KV_TEMPLATE(TKLOG_LEVEL_WARNING, "TKLOG_EXIT_ON_WARNING", -1, msg, ##__VA_ARGS__)
 #elif defined(TKLOG_WARNING)
     #define tklog_warning(fmt, ...) TKLOG_CALL(TKLOG_LEVEL_WARNING, fmt, ##__VA_ARGS__)
+    #define tklog_warning_every_n(n, fmt, ...)                 TKLOG_CALL_EVERY_N(TKLOG_LEVEL_WARNING, n, fmt, ##__VA_ARGS__)
+    #define tklog_warning_ratelimit(per_sec, burst, fmt, ...)  TKLOG_CALL_RATELIMIT(TKLOG_LEVEL_WARNING, per_sec, burst, fmt, ##__VA_ARGS__)
+    #define tklog_warning_once(fmt, ...)                       TKLOG_CALL_ONCE(TKLOG_LEVEL_WARNING, fmt, ##__VA_ARGS__)
+    #define tklog_warning_kv(msg, ...)                         TKLOG_CALL_KV(TKLOG_LEVEL_WARNING, msg, ##__VA_ARGS__)
 #else
     #define tklog_warning(fmt, ...) ((void)0)
+    #define tklog_warning_every_n(n, fmt, ...)                 ((void)0)
+    #define tklog_warning_ratelimit(per_sec, burst, fmt, ...)  ((void)0)
+    #define tklog_warning_once(fmt, ...)                       ((void)0)
+    #define tklog_warning_kv(msg, ...)                         ((void)0)
 #endif
 
 /* Error */
 #ifdef TKLOG_EXIT_ON_ERROR
     #define tklog_error(fmt, ...)   TKLOG_EXIT_ON_TEMPLATE(TKLOG_LEVEL_ERROR, "TKLOG_EXIT_ON_ERROR", -1, fmt, ##__VA_ARGS__)
+    #define tklog_error_every_n(n, fmt, ...)                 tklog_error(fmt, ##__VA_ARGS__)
+    #define tklog_error_ratelimit(per_sec, burst, fmt, ...)  tklog_error(fmt, ##__VA_ARGS__)
+    #define tklog_error_once(fmt, ...)                       tklog_error(fmt, ##__VA_ARGS__)
+    #define tklog_error_kv(msg, ...)                         TKLOG_EXIT_ON_KV_TEMPLATE(TKLOG_LEVEL_ERROR, "TKLOG_EXIT_ON_ERROR", -1, msg, ##__VA_ARGS__)
 #elif defined(TKLOG_ERROR)
     #define tklog_error(fmt, ...)   TKLOG_CALL(TKLOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+    #define tklog_error_every_n(n, fmt, ...)                 TKLOG_CALL_EVERY_N(TKLOG_LEVEL_ERROR, n, fmt, ##__VA_ARGS__)
+    #define tklog_error_ratelimit(per_sec, burst, fmt, ...)  TKLOG_CALL_RATELIMIT(TKLOG_LEVEL_ERROR, per_sec, burst, fmt, ##__VA_ARGS__)
+    #define tklog_error_once(fmt, ...)                       TKLOG_CALL_ONCE(TKLOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+    #define tklog_error_kv(msg, ...)                         TKLOG_CALL_KV(TKLOG_LEVEL_ERROR, msg, ##__VA_ARGS__)
 #else
     #define tklog_error(fmt, ...)   ((void)0)
+    #define tklog_error_every_n(n, fmt, ...)                 ((void)0)
+    #define tklog_error_ratelimit(per_sec, burst, fmt, ...)  ((void)0)
+    #define tklog_error_once(fmt, ...)                       ((void)0)
+    #define tklog_error_kv(msg, ...)                         ((void)0)
 #endif
 
 /* Critical */
 #ifdef TKLOG_EXIT_ON_CRITICAL
     #define tklog_critical(fmt, ...) TKLOG_EXIT_ON_TEMPLATE(TKLOG_LEVEL_CRITICAL, "TKLOG_EXIT_ON_CRITICAL", -1, fmt, ##__VA_ARGS__)
+    #define tklog_critical_every_n(n, fmt, ...)                 tklog_critical(fmt, ##__VA_ARGS__)
+    #define tklog_critical_ratelimit(per_sec, burst, fmt, ...)  tklog_critical(fmt, ##__VA_ARGS__)
+    #define tklog_critical_once(fmt, ...)                       tklog_critical(fmt, ##__VA_ARGS__)
+    #define tklog_critical_kv(msg, ...)                         TKLOG_EXIT_ON_KV_TEMPLATE(TKLOG_LEVEL_CRITICAL, "TKLOG_EXIT_ON_CRITICAL", -1, msg, ##__VA_ARGS__)
 #elif defined(TKLOG_CRITICAL)
     #define tklog_critical(fmt, ...) TKLOG_CALL(TKLOG_LEVEL_CRITICAL, fmt, ##__VA_ARGS__)
+    #define tklog_critical_every_n(n, fmt, ...)                 TKLOG_CALL_EVERY_N(TKLOG_LEVEL_CRITICAL, n, fmt, ##__VA_ARGS__)
+    #define tklog_critical_ratelimit(per_sec, burst, fmt, ...)  TKLOG_CALL_RATELIMIT(TKLOG_LEVEL_CRITICAL, per_sec, burst, fmt, ##__VA_ARGS__)
+    #define tklog_critical_once(fmt, ...)                       TKLOG_CALL_ONCE(TKLOG_LEVEL_CRITICAL, fmt, ##__VA_ARGS__)
+    #define tklog_critical_kv(msg, ...)                         TKLOG_CALL_KV(TKLOG_LEVEL_CRITICAL, msg, ##__VA_ARGS__)
 #else
     #define tklog_critical(fmt, ...) ((void)0)
+    #define tklog_critical_every_n(n, fmt, ...)                 ((void)0)
+    #define tklog_critical_ratelimit(per_sec, burst, fmt, ...)  ((void)0)
+    #define tklog_critical_once(fmt, ...)                       ((void)0)
+    #define tklog_critical_kv(msg, ...)                         ((void)0)
 #endif
 
 /* Alert */
 #ifdef TKLOG_EXIT_ON_ALERT
     #define tklog_alert(fmt, ...)   TKLOG_EXIT_ON_TEMPLATE(TKLOG_LEVEL_ALERT, "TKLOG_EXIT_ON_ALERT", -1, fmt, ##__VA_ARGS__)
+    #define tklog_alert_every_n(n, fmt, ...)                 tklog_alert(fmt, ##__VA_ARGS__)
+    #define tklog_alert_ratelimit(per_sec, burst, fmt, ...)  tklog_alert(fmt, ##__VA_ARGS__)
+    #define tklog_alert_once(fmt, ...)                       tklog_alert(fmt, ##__VA_ARGS__)
+    #define tklog_alert_kv(msg, ...)                         TKLOG_EXIT_ON_KV_TEMPLATE(TKLOG_LEVEL_ALERT, "TKLOG_EXIT_ON_ALERT", -1, msg, ##__VA_ARGS__)
 #elif defined(TKLOG_ALERT)
     #define tklog_alert(fmt, ...)   TKLOG_CALL(TKLOG_LEVEL_ALERT, fmt, ##__VA_ARGS__)
+    #define tklog_alert_every_n(n, fmt, ...)                 TKLOG_CALL_EVERY_N(TKLOG_LEVEL_ALERT, n, fmt, ##__VA_ARGS__)
+    #define tklog_alert_ratelimit(per_sec, burst, fmt, ...)  TKLOG_CALL_RATELIMIT(TKLOG_LEVEL_ALERT, per_sec, burst, fmt, ##__VA_ARGS__)
+    #define tklog_alert_once(fmt, ...)                       TKLOG_CALL_ONCE(TKLOG_LEVEL_ALERT, fmt, ##__VA_ARGS__)
+    #define tklog_alert_kv(msg, ...)                         TKLOG_CALL_KV(TKLOG_LEVEL_ALERT, msg, ##__VA_ARGS__)
 #else
     #define tklog_alert(fmt, ...)   ((void)0)
+    #define tklog_alert_every_n(n, fmt, ...)                 ((void)0)
+    #define tklog_alert_ratelimit(per_sec, burst, fmt, ...)  ((void)0)
+    #define tklog_alert_once(fmt, ...)                       ((void)0)
+    #define tklog_alert_kv(msg, ...)                         ((void)0)
 #endif
 
 /* Emergency */
 #ifdef TKLOG_EXIT_ON_EMERGENCY
     #define tklog_emergency(fmt, ...) TKLOG_EXIT_ON_TEMPLATE(TKLOG_LEVEL_EMERGENCY, "TKLOG_EXIT_ON_EMERGENCY", -1, fmt, ##__VA_ARGS__)
+    #define tklog_emergency_every_n(n, fmt, ...)                 tklog_emergency(fmt, ##__VA_ARGS__)
+    #define tklog_emergency_ratelimit(per_sec, burst, fmt, ...)  tklog_emergency(fmt, ##__VA_ARGS__)
+    #define tklog_emergency_once(fmt, ...)                       tklog_emergency(fmt, ##__VA_ARGS__)
+    #define tklog_emergency_kv(msg, ...)                         TKLOG_EXIT_ON_KV_TEMPLATE(TKLOG_LEVEL_EMERGENCY, "TKLOG_EXIT_ON_EMERGENCY", -1, msg, ##__VA_ARGS__)
 #elif defined(TKLOG_EMERGENCY)
     #define tklog_emergency(fmt, ...) TKLOG_CALL(TKLOG_LEVEL_EMERGENCY, fmt, ##__VA_ARGS__)
+    #define tklog_emergency_every_n(n, fmt, ...)                 TKLOG_CALL_EVERY_N(TKLOG_LEVEL_EMERGENCY, n, fmt, ##__VA_ARGS__)
+    #define tklog_emergency_ratelimit(per_sec, burst, fmt, ...)  TKLOG_CALL_RATELIMIT(TKLOG_LEVEL_EMERGENCY, per_sec, burst, fmt, ##__VA_ARGS__)
+    #define tklog_emergency_once(fmt, ...)                       TKLOG_CALL_ONCE(TKLOG_LEVEL_EMERGENCY, fmt, ##__VA_ARGS__)
+    #define tklog_emergency_kv(msg, ...)                         TKLOG_CALL_KV(TKLOG_LEVEL_EMERGENCY, msg, ##__VA_ARGS__)
 #else
     #define tklog_emergency(fmt, ...) ((void)0)
+    #define tklog_emergency_every_n(n, fmt, ...)                 ((void)0)
+    #define tklog_emergency_ratelimit(per_sec, burst, fmt, ...)  ((void)0)
+    #define tklog_emergency_once(fmt, ...)                       ((void)0)
+    #define tklog_emergency_kv(msg, ...)                         ((void)0)
 #endif
 
 /* -------------------------------------------------------------------------
@@ -208,24 +550,52 @@ void _tklog(uint32_t    flags,
 #endif /* TKLOG_SCOPE */
 
 #ifdef TKLOG_TIMER
+    /*  Each tklog_timer_start()/stop() expansion owns one of these; the id is
+     *  assigned on first use, after which start/stop only index arrays. */
+    typedef struct tklog_timer_site {
+        const char *file;   /* __FILE__                             */
+        const char *name;   /* short file name, set on registration */
+        int         line;
+        uint32_t    id;     /* 0 until registered                   */
+    } tklog_timer_site_t;
+
     void _tklog_timer_init(void);
-    void _tklog_timer_start(int line, const char* file);
-    void _tklog_timer_stop(int line, const char* file);
+    void _tklog_timer_start(tklog_timer_site_t *site);
+    void _tklog_timer_stop(tklog_timer_site_t *site);
     void _tklog_timer_print();
+    void _tklog_timer_print_all();
+    int  _tklog_timer_write_folded(const char *path);
     void _tklog_timer_clear();
+    #define TKLOG_TIMER_SITE_CALL(fn) do { \
+        static tklog_timer_site_t _tklog_ts = { __FILE__, NULL, __LINE__, 0 }; \
+        fn(&_tklog_ts); \
+    } while (0)
     #define tklog_timer_init() _tklog_timer_init()
-    #define tklog_timer_start() _tklog_timer_start(__LINE__, __TKLOG_FILE_NAME__)
-    #define tklog_timer_stop() _tklog_timer_stop(__LINE__, __TKLOG_FILE_NAME__)
+    #define tklog_timer_start() TKLOG_TIMER_SITE_CALL(_tklog_timer_start)
+    #define tklog_timer_stop() TKLOG_TIMER_SITE_CALL(_tklog_timer_stop)
     #define tklog_timer_print() _tklog_timer_print()
+    #define tklog_timer_print_all() _tklog_timer_print_all()
+    #define tklog_timer_write_folded(path) _tklog_timer_write_folded(path)
     #define tklog_timer_clear() _tklog_timer_clear()
 #else
     #define tklog_timer_init() 
     #define tklog_timer_start() 
     #define tklog_timer_stop() 
     #define tklog_timer_print() 
+    #define tklog_timer_print_all()
+    static inline int tklog_timer_write_folded(const char *path) { (void)path; return -1; }
     #define tklog_timer_clear()
 #endif // TKLOG_TIMER
 
+/*  TKLOG_TRACE: timer spans and scopes are kept in per-thread rings and
+ *  written as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ *  Returns 0, or -1 if the file could not be written. */
+#ifdef TKLOG_TRACE
+    int tklog_trace_write(const char *path);
+#else
+    static inline int tklog_trace_write(const char *path) { (void)path; return -1; }
+#endif // TKLOG_TRACE
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
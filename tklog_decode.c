@@ -0,0 +1,367 @@
+// tklog_decode.c - turns a TKLOG_BINARY log file back into tklog's text layout
+// Compile with: gcc tklog_decode.c -o tklog_decode
+// Run: ./tklog_decode tklog.bin > tklog.txt
+// The file must come from a machine with the same byte order and type sizes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "tklog.h"
+
+#define MSG_MAX 2048    /* same line limit as _tklog() */
+
+/* Header bits as written by _tklog_binary(); TKLOG_INIT_F_* collapse to 0
+ * unless the matching TKLOG_SHOW_* is defined, so spell them out here. */
+#define F_LEVEL   (1u << 0)
+#define F_TIME    (1u << 1)
+#define F_THREAD  (1u << 2)
+#define F_PATH    (1u << 3)
+
+typedef struct Callsite {
+    tklog_level_t level;
+    int32_t       line;
+    char         *file;
+    char         *fmt;
+} Callsite;
+
+static Callsite *g_sites     = NULL;
+static uint32_t  g_sites_cap = 0;
+
+static const char *levelstr[] = {
+    "DEBUG    ", "INFO     ", "NOTICE   ", "WARNING  ",
+    "ERROR    ", "CRITICAL ", "ALERT    ", "EMERGENCY" };
+
+/* ---------------------------------------------------------------------------
+ *  Input helpers
+ * ------------------------------------------------------------------------- */
+static int read_exact(FILE *in, void *dst, size_t n)
+{
+    return fread(dst, 1, n, in) == n;
+}
+
+static char *read_str16(FILE *in)
+{
+    uint16_t len;
+    if (!read_exact(in, &len, sizeof len)) return NULL;
+    char *s = (char*)malloc((size_t)len + 1);
+    if (!s) return NULL;
+    if (!read_exact(in, s, len)) { free(s); return NULL; }
+    s[len] = '\0';
+    return s;
+}
+
+typedef struct Cursor {
+    const unsigned char *p;
+    const unsigned char *end;
+} Cursor;
+
+static uint64_t take_u64(Cursor *c)
+{
+    uint64_t v = 0;
+    if (c->end - c->p >= (ptrdiff_t)sizeof v) memcpy(&v, c->p, sizeof v);
+    c->p += sizeof v;
+    return v;
+}
+
+static double take_f64(Cursor *c)
+{
+    double v = 0;
+    if (c->end - c->p >= (ptrdiff_t)sizeof v) memcpy(&v, c->p, sizeof v);
+    c->p += sizeof v;
+    return v;
+}
+
+/* ---------------------------------------------------------------------------
+ *  Message formatting: replays each conversion of the call site's format
+ *  string with the captured value, mirroring bin_pack_args() in tklog.c.
+ * ------------------------------------------------------------------------- */
+enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T, LEN_BIG_L };
+
+static size_t format_message(char *out, size_t cap, const char *fmt, Cursor *c)
+{
+    size_t n = 0;
+    #define ADVANCE(k) do { if ((k) > 0) n += ((size_t)(k) < cap - n) ? (size_t)(k) : cap - n - 1; } while (0)
+
+    for (const char *f = fmt; *f && n + 1 < cap; ++f) {
+        if (*f != '%') {
+            out[n++] = *f;
+            continue;
+        }
+        if (f[1] == '%') {
+            out[n++] = '%';
+            ++f;
+            continue;
+        }
+
+        /* rebuild the spec with '*' replaced by the captured numbers */
+        char spec[64];
+        size_t sl = 0;
+        spec[sl++] = *f++;
+        while (*f && strchr("-+ #0'", *f) && sl < 16) spec[sl++] = *f++;
+        if (*f == '*') {
+            sl += (size_t)snprintf(spec + sl, sizeof spec - sl, "%d", (int)(int64_t)take_u64(c));
+            ++f;
+        } else {
+            while (*f >= '0' && *f <= '9' && sl < 32) spec[sl++] = *f++;
+        }
+        if (*f == '.') {
+            spec[sl++] = *f++;
+            if (*f == '*') {
+                int p = (int)(int64_t)take_u64(c);
+                if (p < 0) --sl;   /* negative precision means none */
+                else sl += (size_t)snprintf(spec + sl, sizeof spec - sl, "%d", p);
+                ++f;
+            } else {
+                while (*f >= '0' && *f <= '9' && sl < 48) spec[sl++] = *f++;
+            }
+        }
+        int len = LEN_NONE;
+        switch (*f) {
+            case 'h': len = (f[1] == 'h') ? LEN_HH : LEN_H; break;
+            case 'l': len = (f[1] == 'l') ? LEN_LL : LEN_L; break;
+            case 'j': len = LEN_J;     break;
+            case 'z': len = LEN_Z;     break;
+            case 't': len = LEN_T;     break;
+            case 'L': len = LEN_BIG_L; break;
+            default: break;
+        }
+        if (len != LEN_NONE) {
+            spec[sl++] = *f++;
+            if (len == LEN_HH || len == LEN_LL) spec[sl++] = *f++;
+        }
+        if (!*f) break;
+        spec[sl++] = *f;
+        spec[sl]   = '\0';
+
+        int k = 0;
+        switch (*f) {
+            case 'd': case 'i': {
+                int64_t v = (int64_t)take_u64(c);
+                switch (len) {
+                    case LEN_L:  k = snprintf(out + n, cap - n, spec, (long)v);      break;
+                    case LEN_LL: k = snprintf(out + n, cap - n, spec, (long long)v); break;
+                    case LEN_J:  k = snprintf(out + n, cap - n, spec, (intmax_t)v);  break;
+                    case LEN_Z:  k = snprintf(out + n, cap - n, spec, (ssize_t)v);   break;
+                    case LEN_T:  k = snprintf(out + n, cap - n, spec, (ptrdiff_t)v); break;
+                    default:     k = snprintf(out + n, cap - n, spec, (int)v);       break;
+                }
+                break;
+            }
+            case 'u': case 'o': case 'x': case 'X': {
+                uint64_t v = take_u64(c);
+                switch (len) {
+                    case LEN_L:  k = snprintf(out + n, cap - n, spec, (unsigned long)v);      break;
+                    case LEN_LL: k = snprintf(out + n, cap - n, spec, (unsigned long long)v); break;
+                    case LEN_J:  k = snprintf(out + n, cap - n, spec, (uintmax_t)v);          break;
+                    case LEN_Z:  k = snprintf(out + n, cap - n, spec, (size_t)v);             break;
+                    case LEN_T:  k = snprintf(out + n, cap - n, spec, (ptrdiff_t)v);          break;
+                    default:     k = snprintf(out + n, cap - n, spec, (unsigned int)v);       break;
+                }
+                break;
+            }
+            case 'c':
+                k = snprintf(out + n, cap - n, spec, (int)(int64_t)take_u64(c));
+                break;
+            case 'e': case 'E': case 'f': case 'F':
+            case 'g': case 'G': case 'a': case 'A':
+                k = snprintf(out + n, cap - n, spec, take_f64(c));
+                break;
+            case 's': {
+                uint16_t slen = 0;
+                if (c->end - c->p >= (ptrdiff_t)sizeof slen) memcpy(&slen, c->p, sizeof slen);
+                c->p += sizeof slen;
+                if (slen == TKLOG_BIN_NULL_STR) {
+                    const char *null_str = NULL;
+                    k = snprintf(out + n, cap - n, spec, null_str);
+                    break;
+                }
+                if (c->end - c->p < (ptrdiff_t)slen) slen = (uint16_t)(c->p < c->end ? c->end - c->p : 0);
+                char *tmp = (char*)malloc((size_t)slen + 1);
+                if (!tmp) break;
+                memcpy(tmp, c->p, slen);
+                tmp[slen] = '\0';
+                c->p += slen;
+                k = snprintf(out + n, cap - n, spec, tmp);
+                free(tmp);
+                break;
+            }
+            case 'p':
+                k = snprintf(out + n, cap - n, spec, (void*)(uintptr_t)take_u64(c));
+                break;
+            default:
+                break;
+        }
+        ADVANCE(k);
+    }
+    out[n] = '\0';
+    #undef ADVANCE
+    return n;
+}
+
+/* ---------------------------------------------------------------------------
+ *  Records
+ * ------------------------------------------------------------------------- */
+static int read_callsite(FILE *in)
+{
+    uint32_t id;
+    uint8_t  level;
+    int32_t  line;
+    if (!read_exact(in, &id, sizeof id) || !read_exact(in, &level, sizeof level) ||
+        !read_exact(in, &line, sizeof line)) {
+        return 0;
+    }
+    if (id >= g_sites_cap) {
+        uint32_t cap = g_sites_cap ? g_sites_cap : 64;
+        while (cap <= id) cap *= 2;
+        Callsite *grown = (Callsite*)realloc(g_sites, cap * sizeof *grown);
+        if (!grown) return 0;
+        memset(grown + g_sites_cap, 0, (cap - g_sites_cap) * sizeof *grown);
+        g_sites     = grown;
+        g_sites_cap = cap;
+    }
+    Callsite *cs = &g_sites[id];
+    cs->level = level <= TKLOG_LEVEL_EMERGENCY ? (tklog_level_t)level : TKLOG_LEVEL_EMERGENCY;
+    cs->line  = line;
+    cs->file  = read_str16(in);
+    cs->fmt   = read_str16(in);
+    return cs->file && cs->fmt;
+}
+
+typedef struct FileHeader {
+    uint64_t start_ns;
+    int64_t  wall_offset_ns;
+    uint8_t  time_fmt;
+} FileHeader;
+
+/* Header time field, same text as time_render() in tklog.c */
+static int render_time(char *p, size_t cap, const FileHeader *h, uint64_t t_ns)
+{
+    int res = h->time_fmt & 0x0F;
+    if (h->time_fmt & TKLOG_BIN_TIME_ISO8601) {
+        int64_t  wall = (int64_t)t_ns + h->wall_offset_ns;
+        time_t   sec  = (time_t)(wall / 1000000000LL);
+        uint32_t frac = (uint32_t)(wall % 1000000000LL);
+        struct tm tm;
+        char      prefix[24];
+        gmtime_r(&sec, &tm);
+        strftime(prefix, sizeof prefix, "%Y-%m-%dT%H:%M:%S", &tm);
+        if (res == TKLOG_BIN_TIME_NS) return snprintf(p, cap, "%s.%09" PRIu32 "Z | ", prefix, frac);
+        if (res == TKLOG_BIN_TIME_US) return snprintf(p, cap, "%s.%06" PRIu32 "Z | ", prefix, frac / 1000);
+        return snprintf(p, cap, "%s.%03" PRIu32 "Z | ", prefix, frac / 1000000);
+    }
+    if (res == TKLOG_BIN_TIME_NS) return snprintf(p, cap, "%" PRIu64 "ns | ", t_ns - h->start_ns);
+    if (res == TKLOG_BIN_TIME_US) return snprintf(p, cap, "%" PRIu64 "us | ", t_ns / 1000 - h->start_ns / 1000);
+    return snprintf(p, cap, "%" PRIu64 "ms | ", t_ns / 1000000 - h->start_ns / 1000000);
+}
+
+static int read_log(FILE *in, int tag, const FileHeader *hdr)
+{
+    uint8_t  flags;
+    uint32_t id;
+    uint64_t t_ns, tid;
+    if (!read_exact(in, &flags, sizeof flags) || !read_exact(in, &id, sizeof id) ||
+        !read_exact(in, &t_ns, sizeof t_ns) || !read_exact(in, &tid, sizeof tid)) {
+        return 0;
+    }
+    char *path = read_str16(in);
+    uint16_t body_len;
+    if (!path || !read_exact(in, &body_len, sizeof body_len)) {
+        free(path);
+        return 0;
+    }
+    unsigned char body[0x10000];
+    if (!read_exact(in, body, body_len)) {
+        free(path);
+        return 0;
+    }
+    if (id >= g_sites_cap || !g_sites[id].fmt) {
+        fprintf(stderr, "tklog_decode: record for unknown call site %" PRIu32 "\n", id);
+        free(path);
+        return 1;
+    }
+    const Callsite *cs = &g_sites[id];
+
+    char   msgbuf[MSG_MAX];
+    size_t n = 0;
+    #define APPEND(...) do { int k_ = snprintf(msgbuf + n, sizeof msgbuf - n, __VA_ARGS__); \
+                             if (k_ > 0) n += ((size_t)k_ < sizeof msgbuf - n) ? (size_t)k_ : sizeof msgbuf - n - 1; } while (0)
+    if (flags & F_LEVEL)  APPEND("%s | ", levelstr[cs->level]);
+    if (flags & F_TIME) {
+        int k = render_time(msgbuf + n, sizeof msgbuf - n, hdr, t_ns);
+        if (k > 0) n += ((size_t)k < sizeof msgbuf - n) ? (size_t)k : sizeof msgbuf - n - 1;
+    }
+    if (flags & F_THREAD) APPEND("tid %lld | ", (long long)tid);
+    if (flags & F_PATH) {
+        if (path[0]) APPEND("%s → %s:%d | ", path, cs->file, (int)cs->line);
+        else         APPEND("%s:%d | ", cs->file, (int)cs->line);
+    }
+    #undef APPEND
+
+    if (tag == TKLOG_BIN_REC_TEXT) {
+        size_t k = body_len < sizeof msgbuf - n - 1 ? body_len : sizeof msgbuf - n - 1;
+        memcpy(msgbuf + n, body, k);
+        msgbuf[n + k] = '\0';
+    } else {
+        Cursor c = { body, body + body_len };
+        format_message(msgbuf + n, sizeof msgbuf - n, cs->fmt, &c);
+    }
+
+    /* ensure newline, as _tklog() does */
+    size_t len = strlen(msgbuf);
+    if (len + 1 < sizeof msgbuf && msgbuf[len - 1] != '\n') {
+        msgbuf[len]   = '\n';
+        msgbuf[len+1] = '\0';
+    }
+    fputs(msgbuf, stdout);
+    free(path);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <tklog.bin>\n", argv[0]);
+        return 2;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    char       magic[8];
+    FileHeader hdr;
+    if (!read_exact(in, magic, sizeof magic) || memcmp(magic, TKLOG_BIN_MAGIC, sizeof magic) != 0 ||
+        !read_exact(in, &hdr.start_ns, sizeof hdr.start_ns) ||
+        !read_exact(in, &hdr.wall_offset_ns, sizeof hdr.wall_offset_ns) ||
+        !read_exact(in, &hdr.time_fmt, sizeof hdr.time_fmt)) {
+        fprintf(stderr, "tklog_decode: %s is not a tklog binary log\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+
+    int ok = 1, tag;
+    while (ok && (tag = fgetc(in)) != EOF) {
+        switch (tag) {
+            case TKLOG_BIN_REC_CALLSITE: ok = read_callsite(in);          break;
+            case TKLOG_BIN_REC_LOG:
+            case TKLOG_BIN_REC_TEXT:     ok = read_log(in, tag, &hdr);      break;
+            default:                     ok = 0;                          break;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "tklog_decode: truncated or corrupt record, stopping\n");
+    }
+
+    for (uint32_t i = 0; i < g_sites_cap; ++i) {
+        free(g_sites[i].file);
+        free(g_sites[i].fmt);
+    }
+    free(g_sites);
+    fclose(in);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,293 @@
+/*  tklog_preload.c – allocation tracking without recompiling (TKLOG_PRELOAD)
+ *
+ *  Built together with tklog.c into two targets:
+ *      libtklog_preload.so  interposes the allocator through LD_PRELOAD
+ *                               LD_PRELOAD=./libtklog_preload.so ./app
+ *      libtklog_wrap.a      the same hooks as __wrap_* for static binaries
+ *                               cc app.o libtklog_wrap.a -lpthread -ldl \
+ *                                  -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free \
+ *                                  -Wl,--wrap=posix_memalign,--wrap=aligned_alloc
+ *
+ *  With LD_PRELOAD every malloc/calloc/realloc/free/posix_memalign/
+ *  aligned_alloc of the process, libc and third-party libraries included,
+ *  is recorded with its return address; addresses are only symbolised
+ *  (dladdr) when reported.  --wrap only rewrites the references of the
+ *  objects being linked: allocations made inside libc (strdup, getline,
+ *  fopen, ...) call libc's malloc directly and are not seen, so their
+ *  leaks are not reported.
+ *  At exit the per-site report is written to stderr, or to the file named
+ *  by TKLOG_PRELOAD_OUT.  Environment:
+ *      TKLOG_PRELOAD_OUT    report file (default: stderr)
+ *      TKLOG_PRELOAD_SORT   bytes (default), live, count or slack
+ *      TKLOG_PRELOAD_LEAKS  1 = also list every block still allocated
+ */
+#define _GNU_SOURCE     /* RTLD_NEXT */
+#include "tklog.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef TKLOG_PRELOAD_WRAP
+    #define HOOK(fn)  __wrap_##fn
+    #define REAL(fn)  __real_##fn
+    void *__real_malloc(size_t size);
+    void *__real_calloc(size_t nmemb, size_t size);
+    void *__real_realloc(void *ptr, size_t size);
+    void  __real_free(void *ptr);
+    int   __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+    void *__real_aligned_alloc(size_t alignment, size_t size);
+#else
+    #define HOOK(fn)  fn
+    #define REAL(fn)  real_##fn
+    static void *(*real_malloc)(size_t);
+    static void *(*real_calloc)(size_t, size_t);
+    static void *(*real_realloc)(void *, size_t);
+    static void  (*real_free)(void *);
+    static int   (*real_posix_memalign)(void **, size_t, size_t);
+    static void *(*real_aligned_alloc)(size_t, size_t);
+#endif
+#define EXPORT __attribute__((visibility("default")))
+
+/* Raised while a hook runs: allocations made by the tracker itself, by
+ * dladdr or by the report go straight to libc.  initial-exec keeps the
+ * TLS access from allocating. */
+static __thread int t_busy __attribute__((tls_model("initial-exec")));
+
+/* ====================================================================== */
+/*                               BOOTSTRAP                                */
+/* ====================================================================== */
+/*  dlsym() may calloc before the real allocator is known; those few      */
+/*  requests are served from a static arena and never freed.              */
+static unsigned char g_boot[8192] __attribute__((aligned(16)));
+static size_t        g_boot_used;
+
+static void *boot_alloc(size_t size)
+{
+    size_t need = (size + 15) & ~(size_t)15;
+    size_t at   = __atomic_fetch_add(&g_boot_used, need, __ATOMIC_RELAXED);
+    if (at + need > sizeof g_boot) {
+        return NULL;
+    }
+    return g_boot + at;     /* static storage: already zeroed */
+}
+
+static inline bool boot_owns(const void *ptr)
+{
+    return (const unsigned char *)ptr >= g_boot && (const unsigned char *)ptr < g_boot + sizeof g_boot;
+}
+
+#ifdef TKLOG_PRELOAD_WRAP
+    static inline bool resolve(void) { return true; }
+#else
+    static __thread int t_resolving __attribute__((tls_model("initial-exec")));
+
+    /* false only inside dlsym on the resolving thread (or if dlsym failed);
+     * other threads wait, so their heap pointers never meet the arena path */
+    static bool resolve(void)
+    {
+        static int resolving;
+        if (__builtin_expect(__atomic_load_n(&real_free, __ATOMIC_ACQUIRE) != NULL, 1)) {
+            return true;
+        }
+        if (t_resolving) {
+            return false;   /* dlsym re-entered us */
+        }
+        if (__atomic_exchange_n(&resolving, 1, __ATOMIC_ACQUIRE)) {
+            while (!__atomic_load_n(&real_free, __ATOMIC_ACQUIRE) && __atomic_load_n(&resolving, __ATOMIC_ACQUIRE)) {
+                sched_yield();
+            }
+            return __atomic_load_n(&real_free, __ATOMIC_ACQUIRE) != NULL;
+        }
+        t_resolving = 1;
+        real_malloc         = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+        real_calloc         = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+        real_realloc        = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+        real_posix_memalign = (int (*)(void **, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+        real_aligned_alloc  = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "aligned_alloc");
+        __atomic_store_n(&real_free, (void (*)(void *))dlsym(RTLD_NEXT, "free"), __ATOMIC_RELEASE);
+        t_resolving = 0;
+        __atomic_store_n(&resolving, 0, __ATOMIC_RELEASE);
+        return real_free != NULL;
+    }
+#endif
+
+/* ====================================================================== */
+/*                                 HOOKS                                  */
+/* ====================================================================== */
+
+EXPORT void *HOOK(malloc)(size_t size)
+{
+    if (!resolve()) {
+        return boot_alloc(size);
+    }
+    if (t_busy) {
+        return REAL(malloc)(size);
+    }
+    t_busy = 1;
+    void *p = REAL(malloc)(size);
+    _tklog_preload_track(p, size, __builtin_return_address(0));
+    t_busy = 0;
+    return p;
+}
+
+EXPORT void *HOOK(calloc)(size_t nmemb, size_t size)
+{
+    if (!resolve()) {
+        return size && nmemb > SIZE_MAX / size ? NULL : boot_alloc(nmemb * size);
+    }
+    if (t_busy) {
+        return REAL(calloc)(nmemb, size);
+    }
+    t_busy = 1;
+    void *p = REAL(calloc)(nmemb, size);
+    _tklog_preload_track(p, nmemb * size, __builtin_return_address(0));
+    t_busy = 0;
+    return p;
+}
+
+EXPORT void *HOOK(realloc)(void *ptr, size_t size)
+{
+    if (boot_owns(ptr)) {
+        /* bootstrap blocks move to the real heap; their size is unknown, so
+         * copy what fits in the arena behind them */
+        void *p = HOOK(malloc)(size);
+        if (p) {
+            size_t left = (size_t)(g_boot + sizeof g_boot - (unsigned char *)ptr);
+            memcpy(p, ptr, size < left ? size : left);
+        }
+        return p;
+    }
+    if (!resolve()) {
+        /* inside dlsym: no real block can exist yet, so a heap ptr is not ours */
+        return ptr ? NULL : boot_alloc(size);
+    }
+    if (t_busy) {
+        return REAL(realloc)(ptr, size);
+    }
+    t_busy = 1;
+    /* detached first: once realloc releases ptr another thread may get it */
+    void *held = ptr ? _tklog_preload_detach(ptr) : NULL;
+    void *p    = REAL(realloc)(ptr, size);
+    if (!ptr) {
+        _tklog_preload_track(p, size, __builtin_return_address(0));
+    } else if (p || size == 0) {
+        _tklog_preload_retrack(held, p, size, __builtin_return_address(0));   /* p NULL: realloc(p, 0) freed it */
+    } else {
+        _tklog_preload_reattach(held);  /* failed: ptr is still live */
+    }
+    t_busy = 0;
+    return p;
+}
+
+EXPORT void HOOK(free)(void *ptr)
+{
+    if (!ptr || boot_owns(ptr) || !resolve()) {
+        return;     /* arena blocks are never freed; !resolve() only inside dlsym */
+    }
+    if (!t_busy) {
+        t_busy = 1;
+        _tklog_preload_untrack(ptr);    /* unknown blocks predate the hooks */
+        t_busy = 0;
+    }
+    REAL(free)(ptr);
+}
+
+EXPORT int HOOK(posix_memalign)(void **memptr, size_t alignment, size_t size)
+{
+    if (!resolve()) {
+        return ENOMEM;
+    }
+    if (t_busy) {
+        return REAL(posix_memalign)(memptr, alignment, size);
+    }
+    t_busy = 1;
+    int rc = REAL(posix_memalign)(memptr, alignment, size);
+    if (rc == 0) {
+        _tklog_preload_track(*memptr, size, __builtin_return_address(0));
+    }
+    t_busy = 0;
+    return rc;
+}
+
+EXPORT void *HOOK(aligned_alloc)(size_t alignment, size_t size)
+{
+    if (!resolve()) {
+        return NULL;
+    }
+    if (t_busy) {
+        return REAL(aligned_alloc)(alignment, size);
+    }
+    t_busy = 1;
+    void *p = REAL(aligned_alloc)(alignment, size);
+    _tklog_preload_track(p, size, __builtin_return_address(0));
+    t_busy = 0;
+    return p;
+}
+
+/* ====================================================================== */
+/*                                 REPORT                                 */
+/* ====================================================================== */
+
+static int g_out_fd = STDERR_FILENO;  /* a private copy once initialised */
+
+bool tklog_preload_output(const char *msg, void *user)
+{
+    (void)user;
+    size_t len = strlen(msg);
+    while (len) {
+        ssize_t n = write(g_out_fd, msg, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        msg += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static void preload_report(void)
+{
+    t_busy = 1;
+    const char *sort = getenv("TKLOG_PRELOAD_SORT");
+    tklog_memory_sort_t by = TKLOG_MEMORY_BY_BYTES;
+    if (sort && !strcmp(sort, "live")) {
+        by = TKLOG_MEMORY_BY_LIVE;
+    } else if (sort && !strcmp(sort, "count")) {
+        by = TKLOG_MEMORY_BY_COUNT;
+    } else if (sort && !strcmp(sort, "slack")) {
+        by = TKLOG_MEMORY_BY_SLACK;
+    }
+    tklog_memory_report(by);
+
+    const char *leaks = getenv("TKLOG_PRELOAD_LEAKS");
+    if (leaks && leaks[0] == '1') {
+        tklog_memory_dump();
+    }
+    if (g_out_fd > STDERR_FILENO) {
+        close(g_out_fd);
+        g_out_fd = STDERR_FILENO;
+    }
+    t_busy = 0;
+}
+
+__attribute__((constructor)) static void preload_init(void)
+{
+    t_busy = 1;
+    resolve();
+    /* stderr is duplicated because programs may close it before our atexit runs */
+    const char *out = getenv("TKLOG_PRELOAD_OUT");
+    int fd = out && out[0] ? open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                           : fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    if (fd >= 0) {
+        g_out_fd = fd;
+    }
+    atexit(preload_report);
+    t_busy = 0;
+}